@@ -0,0 +1,481 @@
+//
+//  devicetransport.cpp
+//  futurerestore
+//
+//  Everything the restore state machine says to the device goes through a transport,
+//  either a real device over USB or a simulated one living in this process.
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "devicetransport.hpp"
+
+#ifdef __APPLE__
+#   include <CommonCrypto/CommonDigest.h>
+#   define SHA1(d, n, md) CC_SHA1(d, n, md)
+#   define SHA384(d, n, md) CC_SHA384(d, n, md)
+#else
+#   include <openssl/sha.h>
+#endif // __APPLE__
+
+extern "C"{
+#include "common.h"
+#include "normal.h"
+#include "recovery.h"
+#include "dfu.h"
+#include "restore.h"
+#include <libirecovery.h>
+    void irecv_event_cb(const irecv_device_event_t* event, void *userdata);
+    void idevice_event_cb(const idevice_event_t *event, void *userdata);
+}
+
+using namespace tihmstar;
+
+#pragma mark usbTransport
+usbTransport::~usbTransport(){
+    unsubscribe();
+}
+
+void usbTransport::irecvEventTrampoline(const irecv_device_event_t *event, void *userdata){
+    usbTransport *t = (usbTransport*)userdata;
+    irecv_event_cb(event, t->_client);
+    t->notify();
+}
+
+void usbTransport::ideviceEventTrampoline(const idevice_event_t *event, void *userdata){
+    usbTransport *t = (usbTransport*)userdata;
+    idevice_event_cb(event, t->_client);
+    t->notify();
+}
+
+void usbTransport::notify(){
+    if (_cb) _cb((_client->mode) ? _client->mode->index : MODE_UNKNOWN);
+}
+
+void usbTransport::subscribe(modeCallback cb){
+    if (_subscribed) return;
+    _cb = cb;
+    irecv_device_event_subscribe(&_client->irecv_e_ctx, irecvEventTrampoline, this);
+    idevice_event_subscribe(ideviceEventTrampoline, this);
+    //idevicerestore resubscribes with this callback and the client as userdata, so it must stay the plain one
+    _client->idevice_e_ctx = (void*)idevice_event_cb;
+    _subscribed = true;
+}
+
+void usbTransport::unsubscribe(){
+    if (!_subscribed) return;
+    //the trampolines point at us
+    irecv_device_event_unsubscribe(_client->irecv_e_ctx);
+    idevice_event_unsubscribe();
+    _subscribed = false;
+    _cb = NULL;
+}
+
+int usbTransport::checkMode(){
+    return check_mode(_client);
+}
+
+uint64_t usbTransport::getEcid(){
+    uint64_t ecid = 0;
+    if (get_ecid(_client, &ecid)) return 0;
+    return ecid;
+}
+
+bool usbTransport::isImage4Supported(){
+    return is_image4_supported(_client);
+}
+
+irecv_device_t usbTransport::getDevice(int mode){
+    switch (mode) {
+        case MODE_RESTORE:
+            return restore_get_irecv_device(_client);
+        case MODE_NORMAL:
+            return normal_get_irecv_device(_client);
+        case MODE_DFU:
+        case MODE_RECOVERY:
+            return dfu_get_irecv_device(_client);
+        default:
+            return NULL;
+    }
+}
+
+void usbTransport::enterRecovery(){
+    retassure(!normal_enter_recovery(_client),"Unable to place device into recovery mode from %s mode\n", (_client->mode) ? _client->mode->string : "unknown");
+}
+
+void usbTransport::openDFU(){
+    retassure(!dfu_client_new(_client),"Unable to connect to DFU device\n");
+}
+
+void usbTransport::openRecovery(){
+    if (recovery_client_new(_client) < 0) {
+        if (_client->recovery && _client->recovery->client) {
+            irecv_close(_client->recovery->client);
+            _client->recovery->client = NULL;
+        }
+        reterror("Could not connect to device in recovery mode\n");
+    }
+}
+
+bool usbTransport::isOpen(){
+    return (_client->dfu && _client->dfu->client) || (_client->recovery && _client->recovery->client);
+}
+
+void usbTransport::close(){
+    dfu_client_free(_client);
+    recovery_client_free(_client);
+}
+
+//dfu connections are only open while futurerestore drives the Odysseus bootchain, so they win
+static irecv_client_t openConnection(struct idevicerestore_client_t *client){
+    irecv_client_t ret = NULL;
+    if (client->dfu && client->dfu->client) ret = client->dfu->client;
+    else if (client->recovery && client->recovery->client) ret = client->recovery->client;
+    retassure(ret, "no connection to device\n");
+    return ret;
+}
+
+int usbTransport::usbMode(){
+    int mode = 0;
+    irecv_get_mode(openConnection(_client), &mode);
+    return mode;
+}
+
+void usbTransport::setConfiguration(int configuration){
+    retassure(!irecv_usb_set_configuration(openConnection(_client), configuration),"ERROR: set configuration failed\n");
+}
+
+void usbTransport::setAutoboot(bool val){
+    retassure(!recovery_set_autoboot(_client, val),"Setting auto-boot failed?!\n");
+}
+
+void usbTransport::reset(){
+    recovery_send_reset(_client);
+}
+
+std::string usbTransport::apNonce(){
+    unsigned char *nonce = NULL;
+    int nonceSize = 0;
+    cleanup([&]{
+        safeFree(nonce);
+    });
+    recovery_get_ap_nonce(_client, &nonce, &nonceSize);
+    return (nonce) ? std::string((char*)nonce, nonceSize) : "";
+}
+
+std::string usbTransport::getenv(const char *var){
+    char *val = NULL;
+    cleanup([&]{
+        safeFree(val);
+    });
+    irecv_getenv(openConnection(_client), var, &val);
+    return (val) ? val : "";
+}
+
+void usbTransport::setenv(const char *var, const char *val){
+    retassure(!irecv_setenv(openConnection(_client), var, val),"failed to write %s to nvram", var);
+}
+
+void usbTransport::saveenv(){
+    retassure(!irecv_saveenv(openConnection(_client)), "failed to save nvram");
+}
+
+bool usbTransport::sendCommand(const char *cmd){
+    return !irecv_send_command(openConnection(_client), cmd);
+}
+
+void usbTransport::sendBuffer(const char *buf, size_t size){
+    irecv_error_t err = irecv_send_buffer(openConnection(_client), (unsigned char*)buf, (unsigned long)size, 1);
+    retassure(err == IRECV_E_SUCCESS,"%s", irecv_strerror(err));
+}
+
+#pragma mark simulatedDevice
+#define SIMULATED_NONCE_GENERATOR "com.apple.System.boot-nonce"
+
+simulatedDevice::config::config() : mode(MODE_NORMAL){}
+
+static uint64_t splitmix64(uint64_t &state){
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+simulatedDevice::config simulatedDevice::parseSpec(const char *spec){
+    config ret;
+    std::string rest = (spec) ? spec : "";
+    while (rest.size()) {
+        size_t comma = rest.find(',');
+        std::string opt = rest.substr(0, comma);
+        rest = (comma == std::string::npos) ? "" : rest.substr(comma+1);
+        if (opt.empty()) continue;
+        size_t eq = opt.find('=');
+        retassure(eq != std::string::npos, "simulator option '%s' needs a value\n", opt.c_str());
+        std::string key = opt.substr(0, eq);
+        std::string val = opt.substr(eq+1);
+
+        if (key == "mode") {
+            if (val == "normal") ret.mode = MODE_NORMAL;
+            else if (val == "recovery") ret.mode = MODE_RECOVERY;
+            else if (val == "dfu") ret.mode = MODE_DFU;
+            else reterror("unknown simulator mode '%s'\n", val.c_str());
+        } else if (key == "ecid") {
+            ret.ecid = strtoull(val.c_str(), NULL, 0);
+        } else if (key == "arch") {
+            retassure(val == "32" || val == "64", "simulator arch must be 32 or 64\n");
+            ret.image4 = (val == "64");
+            if (!ret.image4) ret.nonceSize = 20;
+        } else if (key == "board") {
+            ret.board = val;
+        } else if (key == "noncesize") {
+            ret.nonceSize = (size_t)atol(val.c_str());
+            retassure(ret.nonceSize == 20 || ret.nonceSize == 32, "simulator noncesize must be 20 or 32\n");
+        } else if (key == "reconnect") {
+            ret.reconnectMs = (uint32_t)atol(val.c_str());
+        } else if (key == "latency") {
+            ret.commandMs = (uint32_t)atol(val.c_str());
+        } else if (key == "bandwidth") {
+            ret.bandwidth = atof(val.c_str());
+            retassure(ret.bandwidth > 0, "simulator bandwidth must be positive\n");
+        } else if (key == "nonces") {
+            ret.noncePool = (size_t)atol(val.c_str());
+        } else if (key == "resets") {
+            ret.targetResets = (uint32_t)atol(val.c_str());
+        } else {
+            reterror("unknown simulator option '%s'\n", key.c_str());
+        }
+    }
+    if (ret.board.empty()) ret.board = (ret.image4) ? "d321ap" : "n94ap";
+    return ret;
+}
+
+simulatedDevice::simulatedDevice(const config &cfg) : _config(cfg), _mode(cfg.mode){
+    _worker = std::thread(&simulatedDevice::run, this);
+}
+
+simulatedDevice::~simulatedDevice(){
+    {
+        std::unique_lock<std::mutex> ul(_lock);
+        _stop = true;
+        _cb = NULL;
+    }
+    _cond.notify_all();
+    _worker.join();
+}
+
+//moves the device along _schedule, the callback runs without _lock held since it takes the client's event lock
+void simulatedDevice::run(){
+    std::unique_lock<std::mutex> ul(_lock);
+    while (!_stop) {
+        if (_schedule.empty()) {
+            _cond.wait(ul);
+            continue;
+        }
+        auto next = _schedule.front();
+        if (std::chrono::steady_clock::now() < next.first) {
+            _cond.wait_until(ul, next.first);
+            continue;
+        }
+        _schedule.erase(_schedule.begin());
+        _mode = next.second;
+        modeCallback cb = _cb;
+        ul.unlock();
+        if (cb) cb(next.second);
+        ul.lock();
+    }
+}
+
+//caller holds _lock. The device drops off the bus right away and shows up in mode after the reconnect delay
+void simulatedDevice::scheduleReboot(int mode){
+    auto now = std::chrono::steady_clock::now();
+    _connected = false;
+    _hasPendingImage = false;
+    if (mode != MODE_DFU) _imagesReceived = 0;
+    _bootCount++;
+    _schedule.clear();
+    _schedule.push_back({now, MODE_UNKNOWN});
+    _schedule.push_back({now + std::chrono::milliseconds(_config.reconnectMs), mode});
+    _cond.notify_all();
+}
+
+void simulatedDevice::assureConnected(){
+    retassure(_connected, "no connection to simulated device\n");
+}
+
+uint64_t simulatedDevice::bootCount(){
+    std::unique_lock<std::mutex> ul(_lock);
+    return _bootCount;
+}
+
+std::string simulatedDevice::nonceForBoot(uint64_t boot){
+    std::unique_lock<std::mutex> ul(_lock);
+    return nonceForBootLocked(boot);
+}
+
+//Image4 devices derive their nonce from the generator in nvram like real ones do, so tickets saved with a generator
+//match after the Odysseus path wrote it. Everything else rolls a new nonce per boot
+std::string simulatedDevice::nonceForBootLocked(uint64_t boot){
+    auto generator = _savedNvram.find(SIMULATED_NONCE_GENERATOR);
+    if (_config.image4 && generator != _savedNvram.end()) {
+        uint64_t gen = strtoull(generator->second.c_str(), NULL, 16);
+        unsigned char genBytes[sizeof(gen)];
+        for (size_t i=0; i<sizeof(gen); i++) genBytes[i] = (unsigned char)(gen >> (8*i));
+        unsigned char md[48]; //SHA384 digest length
+        if (_config.nonceSize == 20)
+            SHA1(genBytes, sizeof(genBytes), md);
+        else
+            SHA384(genBytes, sizeof(genBytes), md);
+        return std::string((char*)md, _config.nonceSize);
+    }
+    uint64_t state = _config.ecid ^ ((_config.noncePool) ? boot % _config.noncePool : boot);
+    std::string ret;
+    while (ret.size() < _config.nonceSize) {
+        uint64_t v = splitmix64(state);
+        ret.append((char*)&v, std::min(sizeof(v), _config.nonceSize - ret.size()));
+    }
+    return ret;
+}
+
+void simulatedDevice::subscribe(modeCallback cb){
+    std::unique_lock<std::mutex> ul(_lock);
+    _cb = cb;
+}
+
+void simulatedDevice::unsubscribe(){
+    std::unique_lock<std::mutex> ul(_lock);
+    _cb = NULL;
+}
+
+int simulatedDevice::checkMode(){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    return _mode;
+}
+
+irecv_device_t simulatedDevice::getDevice(int mode){
+    irecv_device_t device = NULL;
+    retassure(irecv_devices_get_device_by_hardware_model(_config.board.c_str(), &device) == IRECV_E_SUCCESS && device, "unknown simulator board '%s'\n", _config.board.c_str());
+    return device;
+}
+
+void simulatedDevice::enterRecovery(){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    retassure(_mode == MODE_NORMAL, "Unable to place simulated device into recovery mode, it is not in normal mode\n");
+    //like normal_enter_recovery, the device stays in recovery until someone sets auto-boot again
+    _nvram["auto-boot"] = _savedNvram["auto-boot"] = "false";
+    scheduleReboot(MODE_RECOVERY);
+}
+
+void simulatedDevice::openDFU(){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    retassure(_mode == MODE_DFU || _mode == MODE_RECOVERY, "Unable to connect to DFU device\n");
+    _connected = true;
+}
+
+void simulatedDevice::openRecovery(){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    retassure(_mode == MODE_RECOVERY, "Could not connect to device in recovery mode\n");
+    _connected = true;
+}
+
+bool simulatedDevice::isOpen(){
+    std::unique_lock<std::mutex> ul(_lock);
+    return _connected;
+}
+
+void simulatedDevice::close(){
+    std::unique_lock<std::mutex> ul(_lock);
+    _connected = false;
+}
+
+int simulatedDevice::usbMode(){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    assureConnected();
+    return (_mode == MODE_DFU) ? IRECV_K_DFU_MODE : IRECV_K_RECOVERY_MODE_2;
+}
+
+void simulatedDevice::setConfiguration(int configuration){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    assureConnected();
+}
+
+void simulatedDevice::setAutoboot(bool val){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    assureConnected();
+    _nvram["auto-boot"] = _savedNvram["auto-boot"] = (val) ? "true" : "false";
+}
+
+void simulatedDevice::reset(){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    assureConnected();
+    scheduleReboot((_savedNvram["auto-boot"] == "false") ? MODE_RECOVERY : MODE_NORMAL);
+}
+
+std::string simulatedDevice::apNonce(){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    retassure(_mode == MODE_RECOVERY || _mode == MODE_DFU, "simulated device is not in recovery or DFU mode\n");
+    return nonceForBootLocked(_bootCount);
+}
+
+std::string simulatedDevice::getenv(const char *var){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    assureConnected();
+    if (!strcmp(var, "build-version")) return "iBoot-simulated";
+    auto val = _nvram.find(var);
+    return (val != _nvram.end()) ? val->second : "";
+}
+
+void simulatedDevice::setenv(const char *var, const char *val){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    assureConnected();
+    _nvram[var] = val;
+}
+
+void simulatedDevice::saveenv(){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    assureConnected();
+    _savedNvram = _nvram;
+}
+
+bool simulatedDevice::sendCommand(const char *cmd){
+    roundTrip();
+    std::unique_lock<std::mutex> ul(_lock);
+    if (!_connected) return false;
+    if (!strcmp(cmd, "go")) {
+        if (!_hasPendingImage) return false;
+        scheduleReboot(MODE_RECOVERY);
+    } else if (!strcmp(cmd, "reboot") || !strcmp(cmd, "reset")) {
+        scheduleReboot((_savedNvram["auto-boot"] == "false") ? MODE_RECOVERY : MODE_NORMAL);
+    }
+    return true;
+}
+
+//DFU boots whatever it received right away: the first image (iBSS) comes back as DFU, the second one as recovery
+void simulatedDevice::sendBuffer(const char *buf, size_t size){
+    {
+        std::unique_lock<std::mutex> ul(_lock);
+        assureConnected();
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds((uint64_t)(size / (_config.bandwidth * 1024 * 1024) * 1e6)));
+    std::unique_lock<std::mutex> ul(_lock);
+    assureConnected();
+    if (_mode == MODE_DFU) {
+        scheduleReboot((_imagesReceived++ == 0) ? MODE_DFU : MODE_RECOVERY);
+    } else {
+        _hasPendingImage = true;
+    }
+}
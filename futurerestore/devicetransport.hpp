@@ -0,0 +1,171 @@
+//
+//  devicetransport.hpp
+//  futurerestore
+//
+//  Everything the restore state machine says to the device goes through a transport,
+//  either a real device over USB or a simulated one living in this process.
+//
+
+#ifndef devicetransport_hpp
+#define devicetransport_hpp
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include "idevicerestore.h"
+
+class deviceTransport {
+public:
+    //called with the new MODE_* value whenever the device appears, disappears or changes mode
+    typedef std::function<void(int mode)> modeCallback;
+
+    virtual ~deviceTransport(){};
+    virtual const char *name() = 0;
+
+    virtual void subscribe(modeCallback cb) = 0;
+    virtual void unsubscribe() = 0;
+    virtual int checkMode() = 0;
+    virtual uint64_t getEcid() = 0;
+    virtual bool isImage4Supported() = 0;
+    virtual irecv_device_t getDevice(int mode) = 0;
+    virtual void enterRecovery() = 0;
+
+    //dfu connections also work with pwned recovery devices, which is how the Odysseus path talks to them
+    virtual void openDFU() = 0;
+    virtual void openRecovery() = 0;
+    virtual bool isOpen() = 0;
+    virtual void close() = 0;
+
+    //these talk to the open connection
+    virtual int usbMode() = 0;
+    virtual void setConfiguration(int configuration) = 0;
+    virtual void setAutoboot(bool val) = 0;
+    virtual void reset() = 0;
+    virtual std::string apNonce() = 0;
+    virtual std::string getenv(const char *var) = 0;
+    virtual void setenv(const char *var, const char *val) = 0;
+    virtual void saveenv() = 0;
+    virtual bool sendCommand(const char *cmd) = 0; //false if the device didn't take it, which is expected for some commands
+    virtual void sendBuffer(const char *buf, size_t size) = 0;
+};
+
+class usbTransport : public deviceTransport {
+    struct idevicerestore_client_t *_client;
+    modeCallback _cb;
+    bool _subscribed = false;
+
+    //forward to idevicerestore's callbacks, which update _client->mode, then report the mode they left behind
+    static void irecvEventTrampoline(const irecv_device_event_t *event, void *userdata);
+    static void ideviceEventTrampoline(const idevice_event_t *event, void *userdata);
+    void notify();
+public:
+    usbTransport(struct idevicerestore_client_t *client) : _client(client){};
+    usbTransport(const usbTransport &) = delete;
+    ~usbTransport();
+    const char *name() override {return "usb";};
+
+    void subscribe(modeCallback cb) override;
+    void unsubscribe() override;
+    int checkMode() override;
+    uint64_t getEcid() override;
+    bool isImage4Supported() override;
+    irecv_device_t getDevice(int mode) override;
+    void enterRecovery() override;
+    void openDFU() override;
+    void openRecovery() override;
+    bool isOpen() override;
+    void close() override;
+    int usbMode() override;
+    void setConfiguration(int configuration) override;
+    void setAutoboot(bool val) override;
+    void reset() override;
+    std::string apNonce() override;
+    std::string getenv(const char *var) override;
+    void setenv(const char *var, const char *val) override;
+    void saveenv() override;
+    bool sendCommand(const char *cmd) override;
+    void sendBuffer(const char *buf, size_t size) override;
+};
+
+//a device which behaves like the real thing as far as futurerestore can tell: it changes modes after a
+//reconnect delay, rolls a new ApNonce on every boot and takes its time receiving images
+class simulatedDevice : public deviceTransport {
+public:
+    struct config {
+        int mode;                   //MODE_* the device starts in
+        uint64_t ecid = 0x1122334455667788ULL;
+        bool image4 = true;
+        std::string board;              //hardware model, defaults to one matching arch
+        size_t nonceSize = 32;          //20 derives nonces from the generator with SHA1, 32 with SHA384
+        uint32_t reconnectMs = 1500;    //time between leaving a mode and showing up in the next one
+        uint32_t commandMs = 2;         //round trip of a control transfer
+        double bandwidth = 30;          //MB/s for images
+        size_t noncePool = 0;           //nonces repeat after this many boots, 0 never repeats
+        uint32_t targetResets = 3;      //boots until the ApNonce --simulate waits for without tickets shows up
+        config();
+    };
+private:
+    config _config;
+    std::mutex _lock;
+    std::condition_variable _cond;
+    std::thread _worker;
+    bool _stop = false;
+
+    int _mode;
+    bool _connected = false;
+    uint64_t _bootCount = 0;
+    size_t _imagesReceived = 0;     //images which booted since the device was last in DFU
+    bool _hasPendingImage = false;  //recovery mode keeps an uploaded image until it is told to "go"
+    std::map<std::string, std::string> _nvram;
+    std::map<std::string, std::string> _savedNvram;
+    //modes the worker moves the device into, with the time they should happen at
+    std::vector<std::pair<std::chrono::steady_clock::time_point, int>> _schedule;
+    modeCallback _cb;
+
+    void run();
+    void scheduleReboot(int mode);
+    std::string nonceForBootLocked(uint64_t boot);
+    void roundTrip(){std::this_thread::sleep_for(std::chrono::milliseconds(_config.commandMs));};
+    void assureConnected();
+public:
+    simulatedDevice(const config &cfg);
+    simulatedDevice(const simulatedDevice &) = delete;
+    ~simulatedDevice();
+    //SPEC is a comma separated list of key=value, see cmd_help for the keys
+    static config parseSpec(const char *spec);
+    const char *name() override {return "simulator";};
+    const config &settings(){return _config;};
+
+    uint64_t bootCount();
+    std::string nonceForBoot(uint64_t boot);
+
+    void subscribe(modeCallback cb) override;
+    void unsubscribe() override;
+    int checkMode() override;
+    uint64_t getEcid() override {return _config.ecid;};
+    bool isImage4Supported() override {return _config.image4;};
+    irecv_device_t getDevice(int mode) override;
+    void enterRecovery() override;
+    void openDFU() override;
+    void openRecovery() override;
+    bool isOpen() override;
+    void close() override;
+    int usbMode() override;
+    void setConfiguration(int configuration) override;
+    void setAutoboot(bool val) override;
+    void reset() override;
+    std::string apNonce() override;
+    std::string getenv(const char *var) override;
+    void setenv(const char *var, const char *val) override;
+    void saveenv() override;
+    bool sendCommand(const char *cmd) override;
+    void sendBuffer(const char *buf, size_t size) override;
+};
+
+#endif /* devicetransport_hpp */
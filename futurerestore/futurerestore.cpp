@@ -13,7 +13,24 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <zlib.h>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <fcntl.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <signal.h>
+#endif
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#endif
 #include "futurerestore.hpp"
+#include "remoteipsw.hpp"
+#include "remotefs.hpp"
+#include "utils.hpp"
 
 #ifdef HAVE_LIBIPATCHER
 #include <libipatcher/libipatcher.hpp>
@@ -54,15 +71,26 @@ extern "C"{
 #define FUTURERESTORE_TMP_PATH TMP_PATH"/futurerestore"
 #endif
 
-#define BASEBAND_TMP_PATH FUTURERESTORE_TMP_PATH"/baseband.bbfw"
-#define BASEBAND_MANIFEST_TMP_PATH FUTURERESTORE_TMP_PATH"/basebandManifest.plist"
-#define SEP_TMP_PATH FUTURERESTORE_TMP_PATH"/sep.im4p"
-#define SEP_MANIFEST_TMP_PATH FUTURERESTORE_TMP_PATH"/sepManifest.plist"
-#define FIRMWARES_TMP_PATH FUTURERESTORE_TMP_PATH"/Firmwares/"
+//every run works in its own session directory, only content which is safe to share lives in the cache
+#define FUTURERESTORE_SESSIONS_PATH FUTURERESTORE_TMP_PATH"/sessions"
+#define FUTURERESTORE_CACHE_PATH FUTURERESTORE_TMP_PATH"/cache"
+#define IPSW_CACHE_PATH FUTURERESTORE_CACHE_PATH"/ipsw"
+
+//names inside the session directory
+#define BASEBAND_TMP_NAME "baseband.bbfw"
+#define BASEBAND_MANIFEST_TMP_NAME "basebandManifest.plist"
+#define SEP_TMP_NAME "sep.im4p"
+#define SEP_MANIFEST_TMP_NAME "sepManifest.plist"
+#define FIRMWARES_TMP_NAME "Firmwares/"
+#define FIRMWARES_ZIP_TMP_NAME "Firmwares.ipsw"
+#define REMOTE_FS_MOUNT_NAME "remotefs"
+//what ASR asks for at a time while sending the payload
+#define ASR_READ_SIZE 0x20000
 
 #ifdef __APPLE__
 #   include <CommonCrypto/CommonDigest.h>
 #   define SHA1(d, n, md) CC_SHA1(d, n, md)
+#   define SHA256(d, n, md) CC_SHA256(d, n, md)
 #   define SHA384(d, n, md) CC_SHA384(d, n, md)
 #else
 #   include <openssl/sha.h>
@@ -75,10 +103,143 @@ extern "C"{
 using namespace tihmstar;
 
 #pragma mark helpers
-extern "C"{
-    void irecv_event_cb(const irecv_device_event_t* event, void *userdata);
-    void idevice_event_cb(const idevice_event_t *event, void *userdata);
-};
+static bool writeBinaryPlist(plist_t plist, const std::string &path){
+    char *bin = NULL;
+    uint32_t binSize = 0;
+    cleanup([&]{
+        safeFree(bin);
+    });
+    plist_to_bin(plist, &bin, &binSize);
+    return bin && writeFileAtomically(path, bin, binSize);
+}
+
+//runs job(0..count-1) on up to hardware_concurrency threads, job must not throw
+static size_t parallelFor(size_t count, std::function<void(size_t)> job){
+    size_t threadCnt = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), count));
+    std::atomic<size_t> next{0};
+    vector<std::thread> workers;
+    for (size_t i=0; i<threadCnt; i++) {
+        workers.emplace_back([&]{
+            for (size_t j = 0; (j = next++) < count;) job(j);
+        });
+    }
+    for (auto &w : workers) w.join();
+    return threadCnt;
+}
+
+static void removeDirectory(const std::string &path){
+    DIR *dp = ::opendir(path.c_str());
+    if (dp) {
+        struct dirent *dirp;
+        while ((dirp = readdir(dp)) != NULL) {
+            std::string name = dirp->d_name;
+            if (name == "." || name == "..") continue;
+            std::string fullname = path + "/" + name;
+            struct stat st{0};
+            if (stat(fullname.c_str(), &st)) continue;
+            if (S_ISDIR(st.st_mode)) removeDirectory(fullname);
+            else unlink(fullname.c_str());
+        }
+        ::closedir(dp);
+    }
+    rmdir(path.c_str());
+}
+
+//session directories are named after the pid that owns them (checks append "-check")
+static void removeStaleSessions(){
+#ifndef WIN32
+    DIR *dp = ::opendir(FUTURERESTORE_SESSIONS_PATH);
+    if (!dp) return;
+    struct dirent *dirp;
+    while ((dirp = readdir(dp)) != NULL) {
+        char *end = NULL;
+        long pid = strtol(dirp->d_name, &end, 10);
+        if (end == dirp->d_name || pid <= 0 || (*end && strcmp(end, "-check"))) continue;
+        if (kill((pid_t)pid, 0) == -1 && errno == ESRCH) {
+            info("Removing stale session directory of process %ld\n", pid);
+            removeDirectory(std::string(FUTURERESTORE_SESSIONS_PATH "/") + dirp->d_name);
+        }
+    }
+    ::closedir(dp);
+#endif
+}
+
+#pragma mark prewarm
+#define PREWARM_STEP (32*1024*1024)
+#define PREWARM_READ_SIZE (1024*1024)
+
+//asks the kernel to start reading [off, off+len) of fd in the background
+static void adviseWillNeed(int fd, uint64_t off, size_t len){
+#if defined(__APPLE__)
+    struct radvisory ra = {(off_t)off, (int)len};
+    fcntl(fd, F_RDADVISE, &ra);
+#elif defined(__linux__)
+    readahead(fd, (off64_t)off, len);
+#elif !defined(WIN32)
+    posix_fadvise(fd, (off_t)off, (off_t)len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+//pulls the first budget bytes of path into the page cache, so ASR doesn't stall on a cold disk.
+//The next step is only advised, the current one is read for real: advice alone may be dropped by the kernel
+static void prewarmFile(const char *path, uint64_t budget, const std::atomic<bool> *cancel){
+#ifndef WIN32
+    struct stat st = {};
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    if (fstat(fd, &st) == 0) {
+        uint64_t len = std::min<uint64_t>(st.st_size, budget);
+        auto start = std::chrono::steady_clock::now();
+        vector<char> buf(PREWARM_READ_SIZE);
+        uint64_t off = 0;
+        if (len) adviseWillNeed(fd, 0, (size_t)std::min<uint64_t>(PREWARM_STEP, len));
+        while (off < len && !*cancel) {
+            uint64_t stepEnd = std::min<uint64_t>(off + PREWARM_STEP, len);
+            if (stepEnd < len) adviseWillNeed(fd, stepEnd, (size_t)std::min<uint64_t>(PREWARM_STEP, len - stepEnd));
+            while (off < stepEnd && !*cancel) {
+                ssize_t didRead = pread(fd, buf.data(), (size_t)std::min<uint64_t>(buf.size(), stepEnd - off), (off_t)off);
+                if (didRead <= 0) {
+                    off = len;
+                    break;
+                }
+                off += didRead;
+            }
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        debug("[prewarm] read %llu MB of '%s' in %.2fs\n", (unsigned long long)(std::min(off, len) >> 20), path, elapsed);
+    }
+    close(fd);
+#endif
+}
+
+//returns how many bytes of path are currently in the page cache
+static uint64_t residentBytes(const char *path, uint64_t *fileSize){
+    uint64_t resident = 0;
+    *fileSize = 0;
+#ifndef WIN32
+    struct stat st = {};
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        *fileSize = st.st_size;
+        if (addr != MAP_FAILED) {
+#ifdef __APPLE__
+            vector<char> vec(((size_t)st.st_size + pageSize - 1) / pageSize);
+#else
+            vector<unsigned char> vec(((size_t)st.st_size + pageSize - 1) / pageSize);
+#endif
+            if (mincore(addr, (size_t)st.st_size, vec.data()) == 0) {
+                for (auto v : vec) if (v & 1) resident += pageSize;
+            }
+            munmap(addr, (size_t)st.st_size);
+        }
+    }
+    close(fd);
+#endif
+    return std::min(resident, *fileSize);
+}
 
 #pragma mark futurerestore
 futurerestore::futurerestore(bool isUpdateInstall, bool isPwnDfu) : _isUpdateInstall(isUpdateInstall), _isPwnDfu(isPwnDfu){
@@ -88,14 +249,46 @@ futurerestore::futurerestore(bool isUpdateInstall, bool isPwnDfu) : _isUpdateIns
     struct stat st{0};
     if (stat(FUTURERESTORE_TMP_PATH, &st) == -1) __mkdir(FUTURERESTORE_TMP_PATH, 0755);
     
+    //pids are unique among running processes, a directory left behind by a dead one is stale
+    removeStaleSessions();
+    _sessionDir = FUTURERESTORE_SESSIONS_PATH "/" + std::to_string(getpid());
+    removeDirectory(_sessionDir);
+    mkdir_with_parents(_sessionDir.c_str(), 0755);
+    mkdir_with_parents(FUTURERESTORE_CACHE_PATH, 0755);
+    _basebandTmpPath = _sessionDir + "/" BASEBAND_TMP_NAME;
+    _basebandManifestTmpPath = _sessionDir + "/" BASEBAND_MANIFEST_TMP_NAME;
+    _sepTmpPath = _sessionDir + "/" SEP_TMP_NAME;
+    _sepManifestTmpPath = _sessionDir + "/" SEP_MANIFEST_TMP_NAME;
+    _firmwaresTmpPath = _sessionDir + "/" FIRMWARES_TMP_NAME;
+    _transport = std::make_shared<usbTransport>(_client);
+    
     nocache = 1; //tsschecker nocache
     _foundnonce = -1;
 }
 
+void futurerestore::setTransport(std::shared_ptr<deviceTransport> transport){
+    retassure(!_didInit, "the transport can't be changed after init\n");
+    _transport = transport;
+}
+
+void futurerestore::setTSSURL(const char *url){
+    safeFree(_client->tss_url);
+    _client->tss_url = strdup(url);
+}
+
+int futurerestore::checkMode(){
+    int mode = _transport->checkMode();
+    //check_mode already did this for usb, a simulated device doesn't know about our client
+    _client->mode = &idevicerestore_modes[mode];
+    return mode;
+}
+
 bool futurerestore::init(){
     if (_didInit) return _didInit;
-    _didInit = (check_mode(_client) != MODE_UNKNOWN);
-    if (!(_client->image4supported = is_image4_supported(_client))){
+    _didInit = (checkMode() != MODE_UNKNOWN);
+    if (_didInit && !_client->ecid && (_client->ecid = _transport->getEcid())) loadDeviceProfile();
+    if (_didInit) subscribeDeviceEvents();
+    if (!(_client->image4supported = _transport->isImage4Supported())){
         info("[INFO] 32-bit device detected\n");
     }else{
         info("[INFO] 64-bit device detected\n");
@@ -105,20 +298,26 @@ bool futurerestore::init(){
 
 uint64_t futurerestore::getDeviceEcid(){
     retassure(_didInit, "did not init\n");
-    uint64_t ecid;
-    get_ecid(_client, &ecid);
-    return ecid;
+    //the ECID never changes, no need to ask the device again
+    if (!_client->ecid) _client->ecid = _transport->getEcid();
+    return _client->ecid;
 }
 
 int futurerestore::getDeviceMode(bool reRequest){
     retassure(_didInit, "did not init\n");
     if (!reRequest && _client->mode && _client->mode->index != MODE_UNKNOWN) {
         return _client->mode->index;
-    }else{
-        dfu_client_free(_client);
-        recovery_client_free(_client);
-        return check_mode(_client);
     }
+    if (_didSubscribeEvents) {
+        //the event callbacks keep the mode current, a device that didn't go away needs no USB round trip
+        dropStaleConnections();
+        mutex_lock(&_client->device_event_mutex);
+        int mode = (_client->mode) ? _client->mode->index : MODE_UNKNOWN;
+        mutex_unlock(&_client->device_event_mutex);
+        if (mode != MODE_UNKNOWN) return mode;
+    }
+    _transport->close();
+    return checkMode();
 }
 
 void futurerestore::putDeviceIntoRecovery(){
@@ -135,7 +334,9 @@ void futurerestore::putDeviceIntoRecovery(){
         retassure(!_isPwnDfu, "isPwnDfu enabled, but device was found in normal mode\n");
 #endif
         info("Entering recovery mode...\n");
-        retassure(!normal_enter_recovery(_client),"Unable to place device into recovery mode from %s mode\n", _client->mode->string);
+        modeMark mark = markModeTransitions();
+        _transport->enterRecovery();
+        retassure(waitForModeTransition(mark, {MODE_RECOVERY}, 60000), "Device did not show up in recovery mode\n");
     }else if (_client->mode->index == MODE_RECOVERY){
         info("Device already in recovery mode\n");
     }else if (_client->mode->index == MODE_DFU && _isPwnDfu &&
@@ -154,25 +355,22 @@ void futurerestore::putDeviceIntoRecovery(){
     
     safeFree(_client->udid); //only needs to be freed manually when function did't throw exception
     
-    //these get also freed by destructor
-    dfu_client_free(_client);
-    recovery_client_free(_client);
+    //connections survive as long as the device stays in its mode, they get also freed by destructor
+    dropStaleConnections();
 }
 
 void futurerestore::setAutoboot(bool val){
     retassure(_didInit, "did not init\n");
 
     retassure(getDeviceMode(false) == MODE_RECOVERY, "can't set auto-boot, when device isn't in recovery mode\n");
-    if(!_client->recovery){
-        retassure(!recovery_client_new(_client),"Could not connect to device in recovery mode.\n");
-    }
-    retassure(!recovery_set_autoboot(_client, val),"Setting auto-boot failed?!\n");
+    connectRecovery();
+    _transport->setAutoboot(val);
 }
 
 void futurerestore::exitRecovery(){
     setAutoboot(true);
-    recovery_send_reset(_client);
-    recovery_client_free(_client);
+    _transport->reset();
+    _transport->close();
 }
 
 plist_t futurerestore::nonceMatchesApTickets(){
@@ -185,20 +383,21 @@ plist_t futurerestore::nonceMatchesApTickets(){
             _rerestoreiOS9 = (info("Detected iOS 9.x 32-bit re-restore, proceeding in DFU mode\n"),true);
     }
     
-    unsigned char* realnonce;
-    int realNonceSize = 0;
+    std::string nonceBuf;
     if (_rerestoreiOS9) {
         info("Skipping ApNonce check\n");
     }else{
-        recovery_get_ap_nonce(_client, &realnonce, &realNonceSize);
+        connectRecovery();
+        nonceBuf = _transport->apNonce();
         
         info("Got ApNonce from device: ");
-        int i = 0;
-        for (i = 0; i < realNonceSize; i++) {
-            info("%02x ", ((unsigned char *)realnonce)[i]);
+        for (size_t i = 0; i < nonceBuf.size(); i++) {
+            info("%02x ", (unsigned char)nonceBuf[i]);
         }
         info("\n");
     }
+    const char *realnonce = nonceBuf.data();
+    int realNonceSize = (int)nonceBuf.size();
     
     vector<const char*>nonces;
     
@@ -240,9 +439,10 @@ std::pair<const char *,size_t> futurerestore::nonceMatchesIM4Ms(){
 
     retassure(getDeviceMode(true) == MODE_RECOVERY, "Device is not in recovery mode, can't check ApNonce\n");
     
-    unsigned char* realnonce;
-    int realNonceSize = 0;
-    recovery_get_ap_nonce(_client, &realnonce, &realNonceSize);
+    connectRecovery();
+    std::string nonceBuf = _transport->apNonce();
+    const char *realnonce = nonceBuf.data();
+    int realNonceSize = (int)nonceBuf.size();
     
     vector<const char*>nonces;
     
@@ -274,8 +474,7 @@ void futurerestore::waitForNonce(vector<const char *>nonces, size_t nonceSize){
     retassure(_didInit, "did not init\n");
     setAutoboot(false);
     
-    unsigned char* realnonce;
-    int realNonceSize = 0;
+    std::string realnonce;
     
     for (auto nonce : nonces){
         info("waiting for ApNonce: ");
@@ -287,23 +486,24 @@ void futurerestore::waitForNonce(vector<const char *>nonces, size_t nonceSize){
     }
     
     do {
-        if (realNonceSize){
-            recovery_send_reset(_client);
-            recovery_client_free(_client);
-            usleep(1*USEC_PER_SEC);
+        if (realnonce.size()){
+            modeMark mark = markModeTransitions();
+            _transport->reset();
+            _transport->close();
+            if (!_didSubscribeEvents || !waitForModeTransition(mark, {MODE_UNKNOWN, MODE_RECOVERY}, 60000))
+                usleep(1*USEC_PER_SEC);
         }
         while (getDeviceMode(true) != MODE_RECOVERY) usleep(USEC_PER_SEC*0.5);
-        retassure(!recovery_client_new(_client), "Could not connect to device in recovery mode\n");
+        connectRecovery();
         
-        recovery_get_ap_nonce(_client, &realnonce, &realNonceSize);
+        realnonce = _transport->apNonce();
         info("Got ApNonce from device: ");
-        int i = 0;
-        for (i = 0; i < realNonceSize; i++) {
-            info("%02x ", realnonce[i]);
+        for (size_t i = 0; i < realnonce.size(); i++) {
+            info("%02x ", (unsigned char)realnonce[i]);
         }
         info("\n");
         for (int i=0; i<nonces.size(); i++){
-            if (memcmp(realnonce, (unsigned const char*)nonces[i], realNonceSize) == 0) _foundnonce = i;
+            if (realnonce.size() == nonceSize && memcmp(realnonce.data(), nonces[i], nonceSize) == 0) _foundnonce = i;
         }
     } while (_foundnonce == -1);
     info("Device has requested ApNonce now\n");
@@ -391,11 +591,15 @@ void futurerestore::loadAPTickets(const vector<const char *> &apticketPaths){
 }
 
 uint64_t futurerestore::getBasebandGoldCertIDFromDevice(){
-    if (!_client->preflight_info){
-        if (normal_get_preflight_info(_client, &_client->preflight_info) == -1){
-            printf("[WARNING] failed to read BasebandGoldCertID from device! Is it already in recovery?\n");
-            return 0;
+    uint64_t val = 0;
+    if (!_client->preflight_info && normal_get_preflight_info(_client, &_client->preflight_info) == -1){
+        //preflight info is only available in normal mode, a previous run may have already seen it
+        if (getProfileUint("BbGoldCertID", &val) && val) {
+            info("Using BasebandGoldCertID %llu from device profile\n", (unsigned long long)val);
+            return val;
         }
+        printf("[WARNING] failed to read BasebandGoldCertID from device! Is it already in recovery?\n");
+        return 0;
     }
     plist_t node;
     node = plist_dict_get_item(_client->preflight_info, "CertID");
@@ -403,34 +607,811 @@ uint64_t futurerestore::getBasebandGoldCertIDFromDevice(){
         error("Unable to find required BbGoldCertId in parameters\n");
         return 0;
     }
-    uint64_t val = 0;
-    plist_get_uint_val(node, &val);
-    return val;
+    plist_get_uint_val(node, &val);
+    setProfileUint("BbGoldCertID", val);
+    return val;
+}
+
+char *futurerestore::getiBootBuild(){
+    if (!_ibootBuild){
+        connectRecovery();
+        std::string build = _transport->getenv("build-version");
+        retassure(build.size(), "Error: can't get a build-version");
+        _ibootBuild = strdup(build.c_str());
+    }
+    return _ibootBuild;
+}
+
+pair<ptr_smart<char*>, size_t> getIPSWComponent(struct idevicerestore_client_t* client, plist_t build_identity, string component){
+    ptr_smart<char *> path;
+    unsigned char* component_data = NULL;
+    unsigned int component_size = 0;
+
+    if (!(char*)path) {
+        retassure(!build_identity_get_component_path(build_identity, component.c_str(), &path),"ERROR: Unable to get path for component '%s'\n", component.c_str());
+    }
+    
+    retassure(!extract_component(client->ipsw, (char*)path, &component_data, &component_size),"ERROR: Unable to extract component: %s\n", component.c_str());
+    
+    return {(char*)component_data,component_size};
+}
+
+#pragma mark device profile
+#define DEVICE_PROFILES_PATH FUTURERESTORE_CACHE_PATH"/devices"
+
+std::string futurerestore::deviceProfilePath(){
+    char ecidStr[17];
+    snprintf(ecidStr, sizeof(ecidStr), "%016llx", (unsigned long long)_client->ecid);
+    return std::string(DEVICE_PROFILES_PATH "/") + ecidStr + ".plist";
+}
+
+void futurerestore::loadDeviceProfile(){
+    std::string path = deviceProfilePath();
+    safeFreeCustom(_deviceProfile, plist_free);
+    if (access(path.c_str(), F_OK)) return;
+    if ((_deviceProfile = loadPlistFromFile(path.c_str())) && plist_get_node_type(_deviceProfile) != PLIST_DICT)
+        safeFreeCustom(_deviceProfile, plist_free);
+    if (_deviceProfile) debug("Loaded device profile %s\n", path.c_str());
+}
+
+void futurerestore::saveDeviceProfile(){
+    std::string path = deviceProfilePath();
+    //the profile is only a shortcut, failing to save it is not an error
+    mkdir_with_parents(DEVICE_PROFILES_PATH, 0755);
+    if (!writeBinaryPlist(_deviceProfile, path)) debug("failed to save device profile %s\n", path.c_str());
+}
+
+bool futurerestore::getProfileUint(const char *key, uint64_t *val){
+    plist_t node = (_deviceProfile) ? plist_dict_get_item(_deviceProfile, key) : NULL;
+    if (!node || plist_get_node_type(node) != PLIST_UINT) return false;
+    plist_get_uint_val(node, val);
+    return true;
+}
+
+void futurerestore::setProfileUint(const char *key, uint64_t val){
+    uint64_t old = 0;
+    if (!_client->ecid || (getProfileUint(key, &old) && old == val)) return;
+    if (!_deviceProfile) loadDeviceProfile();
+    if (!_deviceProfile) _deviceProfile = plist_new_dict();
+    plist_dict_set_item(_deviceProfile, key, plist_new_uint(val));
+    saveDeviceProfile();
+}
+
+void futurerestore::setProfileString(const char *key, const char *val){
+    char *old = NULL;
+    if (!_client->ecid || !val) return;
+    plist_t node = (_deviceProfile) ? plist_dict_get_item(_deviceProfile, key) : NULL;
+    if (node && plist_get_node_type(node) == PLIST_STRING) plist_get_string_val(node, &old);
+    bool isSame = old && !strcmp(old, val);
+    safeFree(old);
+    if (isSame) return;
+    if (!_deviceProfile) loadDeviceProfile();
+    if (!_deviceProfile) _deviceProfile = plist_new_dict();
+    plist_dict_set_item(_deviceProfile, key, plist_new_string(val));
+    saveDeviceProfile();
+}
+
+#pragma mark restore journal
+#define RESTORE_JOURNALS_PATH FUTURERESTORE_CACHE_PATH"/journals"
+
+std::string futurerestore::restoreJournalPath(){
+    char ecidStr[17];
+    snprintf(ecidStr, sizeof(ecidStr), "%016llx", (unsigned long long)_client->ecid);
+    return std::string(RESTORE_JOURNALS_PATH "/") + ecidStr + ".plist";
+}
+
+//everything the recorded steps depend on. If any of it changed, the journal is worthless
+std::string futurerestore::restoreJournalKey(std::pair<const char *,size_t> im4m){
+    std::string input;
+    auto addFile = [&](const char *path){
+        struct stat st = {};
+        input += (path) ? path : "";
+        input += '\0';
+        if (path && !stat(path, &st)) input += std::to_string((long long)st.st_size) + ":" + std::to_string((long long)st.st_mtime);
+        input += '\0';
+    };
+    addFile(_client->ipsw);
+    addFile(_basebandPath);
+    if (im4m.first) input.append(im4m.first, im4m.second);
+    input += '\0';
+    if (_client->sepfwdata) input.append(_client->sepfwdata, _client->sepfwdatasize);
+    input += (_isUpdateInstall) ? "update" : "erase";
+    input += (_enterPwnRecoveryRequested) ? "pwn" : "";
+
+    return sha1Hex(input.data(), input.size());
+}
+
+void futurerestore::loadRestoreJournal(const std::string &key){
+    std::string path = restoreJournalPath();
+    char *oldKey = NULL;
+    cleanup([&]{
+        safeFree(oldKey);
+    });
+    safeFreeCustom(_restoreJournal, plist_free);
+    if (_client->ecid && !access(path.c_str(), F_OK) && (_restoreJournal = loadPlistFromFile(path.c_str()))) {
+        plist_t node = (plist_get_node_type(_restoreJournal) == PLIST_DICT) ? plist_dict_get_item(_restoreJournal, "Key") : NULL;
+        if (node && plist_get_node_type(node) == PLIST_STRING) plist_get_string_val(node, &oldKey);
+        if (oldKey && key == oldKey) {
+            info("[journal] resuming an earlier attempt of this restore\n");
+            return;
+        }
+        debug("[journal] %s belongs to a different restore, starting over\n", path.c_str());
+        discardRestoreJournal();
+    }
+    startRestoreJournal(key);
+}
+
+void futurerestore::startRestoreJournal(const std::string &key){
+    safeFreeCustom(_restoreJournal, plist_free);
+    _restoreJournal = plist_new_dict();
+    plist_dict_set_item(_restoreJournal, "Key", plist_new_string(key.c_str()));
+    plist_dict_set_item(_restoreJournal, "Steps", plist_new_dict());
+}
+
+//a temporary filesystem is only known to the journal, so it goes together with it
+void futurerestore::discardRestoreJournal(){
+    if (journalArtifact("Filesystem", "Temporary") == "yes") {
+        std::string filesystem = journalArtifact("Filesystem", "Path");
+        if (filesystem.size() && !unlink(filesystem.c_str())) debug("[journal] removed filesystem '%s' of the discarded attempt\n", filesystem.c_str());
+    }
+    safeFreeCustom(_restoreJournal, plist_free);
+}
+
+//enough to tell build identities apart, e.g. "n71ap 15.1 Customer Erase Install (IPSW) (19B74)"
+static std::string buildIdentityName(plist_t identity){
+    std::string ret;
+    plist_t info = (identity) ? plist_dict_get_item(identity, "Info") : NULL;
+    for (const char *key : {"DeviceClass", "Variant", "BuildNumber"}) {
+        plist_t node = (info) ? plist_dict_get_item(info, key) : NULL;
+        char *val = NULL;
+        if (!node || plist_get_node_type(node) != PLIST_STRING) continue;
+        plist_get_string_val(node, &val);
+        if (ret.size()) ret += " ";
+        ret += (!strcmp(key, "BuildNumber")) ? std::string("(") + val + ")" : std::string(val);
+        safeFree(val);
+    }
+    return ret;
+}
+
+//identities are picked from the manifests on every run, steps recorded against other ones are worthless
+void futurerestore::journalIdentities(std::vector<std::pair<std::string, std::string>> identities){
+    if (!_restoreJournal) return;
+    if (journalStepNode("IdentitiesResolved")) {
+        for (auto &identity : identities) {
+            if (journalArtifact("IdentitiesResolved", identity.first.c_str()) == identity.second) continue;
+            info("[journal] %s identity changed since the earlier attempt, starting over\n", identity.first.c_str());
+            char *key = NULL;
+            plist_t node = plist_dict_get_item(_restoreJournal, "Key");
+            if (node && plist_get_node_type(node) == PLIST_STRING) plist_get_string_val(node, &key);
+            std::string journalKey = (key) ? key : "";
+            safeFree(key);
+            discardRestoreJournal();
+            startRestoreJournal(journalKey);
+            break;
+        }
+    }
+    journalStep("IdentitiesResolved", identities);
+}
+
+plist_t futurerestore::journalStepNode(const char *step){
+    plist_t steps = (_restoreJournal) ? plist_dict_get_item(_restoreJournal, "Steps") : NULL;
+    plist_t node = (steps) ? plist_dict_get_item(steps, step) : NULL;
+    return (node && plist_get_node_type(node) == PLIST_DICT) ? node : NULL;
+}
+
+bool futurerestore::journalStepDone(const char *step){
+    bool done = journalStepNode(step) != NULL;
+    if (done) info("[journal] %s was completed by an earlier attempt, skipping\n", step);
+    return done;
+}
+
+std::string futurerestore::journalArtifact(const char *step, const char *key){
+    plist_t node = journalStepNode(step);
+    plist_t val = (node) ? plist_dict_get_item(node, key) : NULL;
+    char *str = NULL;
+    if (!val || plist_get_node_type(val) != PLIST_STRING) return "";
+    plist_get_string_val(val, &str);
+    std::string ret = (str) ? str : "";
+    safeFree(str);
+    return ret;
+}
+
+//artifacts are string key/value pairs, the journal is saved right away so a crash in the next step doesn't lose it
+void futurerestore::journalStep(const char *step, std::vector<std::pair<std::string, std::string>> artifacts){
+    if (!_restoreJournal || !_client->ecid) return;
+    plist_t node = plist_new_dict();
+    plist_dict_set_item(node, "Time", plist_new_uint((uint64_t)time(NULL)));
+    for (auto &artifact : artifacts) plist_dict_set_item(node, artifact.first.c_str(), plist_new_string(artifact.second.c_str()));
+    plist_dict_set_item(plist_dict_get_item(_restoreJournal, "Steps"), step, node);
+
+    std::string path = restoreJournalPath();
+    mkdir_with_parents(RESTORE_JOURNALS_PATH, 0755);
+    if (!writeBinaryPlist(_restoreJournal, path)) debug("failed to save restore journal %s\n", path.c_str());
+}
+
+void futurerestore::clearRestoreJournal(){
+    safeFreeCustom(_restoreJournal, plist_free);
+    if (_client->ecid) remove(restoreJournalPath().c_str());
+}
+
+#pragma mark device events
+#define MODE_WAIT_SLICE_MS 50
+
+static const char *modeName(int mode){
+    return (mode >= 0 && idevicerestore_modes[mode].string) ? idevicerestore_modes[mode].string : "Unknown";
+}
+
+//the usb transport calls this after idevicerestore's callbacks updated _client->mode, the simulator relies on us doing it
+void futurerestore::deviceModeChanged(int mode){
+    mutex_lock(&_client->device_event_mutex);
+    _client->mode = &idevicerestore_modes[mode];
+    noteModeChangeLocked();
+    cond_signal(&_client->device_event_cond);
+    mutex_unlock(&_client->device_event_mutex);
+}
+
+void futurerestore::noteModeChangeLocked(){
+    int mode = (_client->mode) ? _client->mode->index : MODE_UNKNOWN;
+    if (mode == _lastSeenMode) return;
+    auto now = std::chrono::steady_clock::now();
+    _modeTransitions.push_back({_lastSeenMode, mode, now, std::chrono::duration<double>(now - _lastTransitionTime).count()});
+    _lastSeenMode = mode;
+    _lastTransitionTime = now;
+}
+
+void futurerestore::subscribeDeviceEvents(){
+    if (_didSubscribeEvents) return;
+    mutex_lock(&_client->device_event_mutex);
+    _lastSeenMode = (_client->mode) ? _client->mode->index : MODE_UNKNOWN;
+    _lastTransitionTime = std::chrono::steady_clock::now();
+    mutex_unlock(&_client->device_event_mutex);
+
+    _transport->subscribe([this](int mode){
+        deviceModeChanged(mode);
+    });
+    _didSubscribeEvents = true;
+}
+
+//closes dfu/recovery connections which were opened before the last mode transition, the device behind them is gone.
+//Without events we can't tell, so the caller gets the old behaviour of reconnecting every time
+void futurerestore::dropStaleConnections(){
+    size_t transitions = 0;
+    if (_didSubscribeEvents) {
+        mutex_lock(&_client->device_event_mutex);
+        transitions = _modeTransitions.size();
+        mutex_unlock(&_client->device_event_mutex);
+        if (transitions == _connectionTransition) return;
+    }
+    _transport->close();
+    _connectionTransition = transitions;
+}
+
+void futurerestore::connectRecovery(){
+    if (_didSubscribeEvents) dropStaleConnections();
+    if (_transport->isOpen()) return;
+    _transport->openRecovery();
+}
+
+//take a mark before triggering a transition, so events that arrive before the wait starts are not lost
+futurerestore::modeMark futurerestore::markModeTransitions(){
+    mutex_lock(&_client->device_event_mutex);
+    modeMark ret = {_modeTransitions.size(), std::chrono::steady_clock::now()};
+    mutex_unlock(&_client->device_event_mutex);
+    return ret;
+}
+
+//waits until the device went through sequence (MODE_* values, in order) after mark.
+//The last entry is the target: once it shows up we return, even if an intermediate event was missed
+bool futurerestore::waitForModeTransition(modeMark mark, std::vector<int> sequence, uint32_t timeoutMs){
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    size_t matched = 0;
+    size_t scanned = mark.transition;
+    assure(sequence.size());
+
+    mutex_lock(&_client->device_event_mutex);
+    while (matched < sequence.size()) {
+        //picks up transitions of callbacks we did not wrap (idevicerestore resubscribing its own)
+        noteModeChangeLocked();
+        for (; scanned < _modeTransitions.size() && matched < sequence.size(); scanned++) {
+            auto &t = _modeTransitions[scanned];
+            debug("[transition] %s -> %s after %.2fs\n", modeName(t.fromMode), modeName(t.toMode), std::chrono::duration<double>(t.time - mark.time).count());
+            if (t.toMode == sequence[matched]) {
+                matched++;
+            } else if (t.toMode == sequence.back()) {
+                debug("[transition] missed an intermediate event, target mode %s reached\n", modeName(t.toMode));
+                matched = sequence.size();
+            }
+        }
+        if (matched == sequence.size() || std::chrono::steady_clock::now() >= deadline) break;
+        //callbacks signal the cond before logging the transition, so wait in slices instead of for the full timeout
+        cond_wait_timeout(&_client->device_event_cond, &_client->device_event_mutex, MODE_WAIT_SLICE_MS);
+    }
+    mutex_unlock(&_client->device_event_mutex);
+
+    if (matched < sequence.size())
+        debug("[transition] timed out after %ums waiting for %s\n", timeoutMs, modeName(sequence.back()));
+    return matched == sequence.size();
+}
+
+//waits for the first event which tells us which mode the device is in
+bool futurerestore::waitForDeviceMode(uint32_t timeoutMs){
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    bool found = false;
+    mutex_lock(&_client->device_event_mutex);
+    while (!(found = (_client->mode && _client->mode->index != MODE_UNKNOWN)) && std::chrono::steady_clock::now() < deadline)
+        cond_wait_timeout(&_client->device_event_cond, &_client->device_event_mutex, MODE_WAIT_SLICE_MS);
+    noteModeChangeLocked();
+    mutex_unlock(&_client->device_event_mutex);
+    return found;
+}
+
+std::vector<futurerestore::modeTransition> futurerestore::modeTransitions(){
+    mutex_lock(&_client->device_event_mutex);
+    std::vector<modeTransition> ret = _modeTransitions;
+    mutex_unlock(&_client->device_event_mutex);
+    return ret;
+}
+
+void futurerestore::printTimingReport(){
+    auto transitions = modeTransitions();
+    double transitionTime = 0;
+    double uploadTime = 0;
+    info("[timing] %s transport, %zu mode transitions, %zu uploads\n", _transport->name(), transitions.size(), _uploadStats.size());
+    for (auto &t : transitions) {
+        info("[timing]   %-8s -> %-8s after %6.2fs\n", modeName(t.fromMode), modeName(t.toMode), t.latency);
+        transitionTime += t.latency;
+    }
+    for (auto &u : _uploadStats) {
+        info("[timing]   sent %-12s %9zu bytes in %6.2fs\n", u.name.c_str(), u.size, u.seconds);
+        uploadTime += u.seconds;
+    }
+    info("[timing] %.2fs between the first and last transition, %.2fs spent uploading\n", transitionTime, uploadTime);
+}
+
+#pragma mark restore metrics
+static const char *restoreStepName(int step){
+    switch (step) {
+        case RESTORE_STEP_DETECT:       return "detect";
+        case RESTORE_STEP_PREPARE:      return "prepare";
+        case RESTORE_STEP_UPLOAD_FS:    return "filesystem upload";
+        case RESTORE_STEP_VERIFY_FS:    return "filesystem verify";
+        case RESTORE_STEP_FLASH_FW:     return "firmware flash";
+        case RESTORE_STEP_FLASH_BB:     return "baseband flash";
+        case RESTORE_STEP_FUD:          return "FUD firmware";
+        default:                        return "unknown";
+    }
+}
+
+void futurerestore::restoreProgressCallback(int step, double progress, void *userdata){
+    ((futurerestore*)userdata)->noteRestoreProgress(step, progress);
+}
+
+//called for every progress message restored sends, so this only does arithmetic unless a line is due
+void futurerestore::noteRestoreProgress(int step, double progress){
+    auto now = std::chrono::steady_clock::now();
+    if (_restorePhases.empty() || _restorePhases.back().step != step) {
+        finishRestorePhase();
+        _restorePhases.push_back({step, restoreStepName(step), 0, 0, 0});
+        _phaseStart = now;
+        _phaseLastPrint = now - std::chrono::seconds(1); //show the new phase right away
+    }
+    restorePhase &phase = _restorePhases.back();
+    phase.progress = progress;
+    phase.seconds = std::chrono::duration<double>(now - _phaseStart).count();
+    //ASR streams the filesystem, restored only tells us how far it got
+    bool hasBytes = (step == RESTORE_STEP_UPLOAD_FS || step == RESTORE_STEP_VERIFY_FS) && _restoreFilesystemSize;
+    if (hasBytes) phase.bytes = (uint64_t)(progress * _restoreFilesystemSize);
+
+    if (now - _phaseLastPrint < std::chrono::milliseconds(500) && progress < 1.0) return;
+    _phaseLastPrint = now;
+    if (hasBytes && phase.seconds > 0)
+        printf("\r[restore] %s: %5.1f%% %llu MB, %.2f MB/s   ", phase.name.c_str(), progress * 100, (unsigned long long)(phase.bytes >> 20), phase.bytes / phase.seconds / (1024*1024));
+    else
+        printf("\r[restore] %s: %5.1f%%   ", phase.name.c_str(), progress * 100);
+    fflush(stdout);
+}
+
+void futurerestore::finishRestorePhase(){
+    if (_restorePhases.empty()) return;
+    restorePhase &phase = _restorePhases.back();
+    phase.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _phaseStart).count();
+    printf("\n");
+}
+
+void futurerestore::printRestoreSummary(){
+    for (auto &phase : _restorePhases) {
+        if (phase.bytes && phase.seconds > 0)
+            info("[restore] %-18s %6.2fs %8llu MB %8.2f MB/s (%.0f%%)\n", phase.name.c_str(), phase.seconds, (unsigned long long)(phase.bytes >> 20), phase.bytes / phase.seconds / (1024*1024), phase.progress * 100);
+        else
+            info("[restore] %-18s %6.2fs (%.0f%%)\n", phase.name.c_str(), phase.seconds, phase.progress * 100);
+    }
+}
+
+void futurerestore::writeMetrics(const char *path){
+    plist_t metrics = NULL;
+    char *xml = NULL;
+    uint32_t xmlSize = 0;
+    cleanup([&]{
+        safeFreeCustom(xml, plist_to_xml_free);
+        safeFreeCustom(metrics, plist_free);
+    });
+    metrics = plist_new_dict();
+    plist_dict_set_item(metrics, "Transport", plist_new_string(_transport->name()));
+
+    plist_t transitions = plist_new_array();
+    for (auto &t : modeTransitions()) {
+        plist_t entry = plist_new_dict();
+        plist_dict_set_item(entry, "From", plist_new_string(modeName(t.fromMode)));
+        plist_dict_set_item(entry, "To", plist_new_string(modeName(t.toMode)));
+        plist_dict_set_item(entry, "Seconds", plist_new_real(t.latency));
+        plist_array_append_item(transitions, entry);
+    }
+    plist_dict_set_item(metrics, "ModeTransitions", transitions);
+
+    plist_t uploads = plist_new_array();
+    for (auto &u : _uploadStats) {
+        plist_t entry = plist_new_dict();
+        plist_dict_set_item(entry, "Name", plist_new_string(u.name.c_str()));
+        plist_dict_set_item(entry, "Bytes", plist_new_uint(u.size));
+        plist_dict_set_item(entry, "Seconds", plist_new_real(u.seconds));
+        plist_array_append_item(uploads, entry);
+    }
+    plist_dict_set_item(metrics, "Uploads", uploads);
+
+    plist_t phases = plist_new_array();
+    for (auto &phase : _restorePhases) {
+        plist_t entry = plist_new_dict();
+        plist_dict_set_item(entry, "Name", plist_new_string(phase.name.c_str()));
+        plist_dict_set_item(entry, "Bytes", plist_new_uint(phase.bytes));
+        plist_dict_set_item(entry, "Seconds", plist_new_real(phase.seconds));
+        plist_dict_set_item(entry, "Progress", plist_new_real(phase.progress));
+        plist_array_append_item(phases, entry);
+    }
+    plist_dict_set_item(metrics, "RestorePhases", phases);
+
+    plist_to_xml(metrics, &xml, &xmlSize);
+    retassure(xml, "failed to serialize metrics\n");
+    saveStringToFile(xml, path);
+    info("[metrics] written to %s\n", path);
+}
+
+#pragma mark boot images
+void futurerestore::noteUpload(const char *name, size_t size, std::chrono::steady_clock::time_point start){
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    _uploadStats.push_back({name, size, seconds});
+    if (size && seconds > 0)
+        info("[upload] sent %s (%zu bytes) in %.2fs (%.2f MB/s)\n", name, size, seconds, size / seconds / (1024*1024));
+    else
+        info("[upload] sent %s in %.2fs\n", name, seconds);
+}
+
+//libirecovery only has a blocking send, so the overlap happens on the preparation side
+void futurerestore::sendBootImage(const char *name, const char *buf, size_t size){
+    info("Sending %s (%lu bytes)...\n", name, (unsigned long)size);
+    auto start = std::chrono::steady_clock::now();
+    try {
+        _transport->sendBuffer(buf, size);
+    } catch (tihmstar::exception &e) {
+        reterror("ERROR: Unable to send %s component: %s\n", name, e.what());
+    }
+    noteUpload(name, size, start);
+}
+
+//keeps _client->nonce current for the idevicerestore code which runs after us
+void futurerestore::readApNonce(){
+    std::string nonce = _transport->apNonce();
+    safeFree(_client->nonce);
+    _client->nonce = (unsigned char*)malloc(nonce.size());
+    memcpy(_client->nonce, nonce.data(), nonce.size());
+    _client->nonce_size = (int)nonce.size();
+    info("ApNonce: ");
+    for (size_t i = 0; i < nonce.size(); i++) {
+        info("%02x ", (unsigned char)nonce[i]);
+    }
+    info("\n");
+}
+
+#pragma mark bootchain preparation
+//what a pwned 32-bit iBEC gets through get_custom_component, all of it decrypted
+static const char *decryptedComponents[] = {"RestoreLogo", "RestoreRamDisk", "RestoreDeviceTree", "RestoreKernelCache", NULL};
+
+static std::mutex gComponentOwnersLock;
+static std::map<struct idevicerestore_client_t*, futurerestore*> gComponentOwners;
+
+static futurerestore *componentOwner(struct idevicerestore_client_t* client){
+    std::lock_guard<std::mutex> lock(gComponentOwnersLock);
+    auto it = gComponentOwners.find(client);
+    return (it != gComponentOwners.end()) ? it->second : NULL;
+}
+
+static std::string componentPathForIdentity(plist_t build_identity, const char *component){
+    char *path = NULL;
+    cleanup([&]{
+        safeFree(path);
+    });
+    retassure(!build_identity_get_component_path(build_identity, component, &path) && path, "ERROR: Unable to get path for component '%s'\n", component);
+    return path;
+}
+
+static std::string extractComponentBytes(const std::string &ipsw, const std::string &path){
+    unsigned char *data = NULL;
+    unsigned int size = 0;
+    cleanup([&]{
+        safeFree(data);
+    });
+    retassure(!extract_component(ipsw.c_str(), path.c_str(), &data, &size), "ERROR: Unable to extract component: %s\n", path.c_str());
+    return {(char*)data, size};
+}
+
+#pragma mark firmware keys
+#ifdef HAVE_LIBIPATCHER
+#define FIRMWARE_KEYS_PATH FUTURERESTORE_CACHE_PATH"/firmwarekeys.plist"
+
+//published keys never change, so every key we fetched or imported is kept for good.
+//On disk it is ProductType -> Build -> component -> {IV, Key, Path}, in memory a flat map
+static std::mutex gFirmwareKeysLock;
+static std::map<std::string, libipatcher::fw_key> gFirmwareKeys;
+static bool gFirmwareKeysLoaded = false;
+
+static std::string firmwareKeyName(const std::string &productType, const std::string &build, const std::string &component){
+    return productType + "/" + build + "/" + component;
+}
+
+static std::string plistStringValue(plist_t node){
+    char *val = NULL;
+    cleanup([&]{
+        safeFree(val);
+    });
+    if (!node || plist_get_node_type(node) != PLIST_STRING) return "";
+    plist_get_string_val(node, &val);
+    return (val) ? val : "";
+}
+
+//returns how many keys were new or differed from what we had
+static size_t mergeFirmwareKeysLocked(plist_t keys){
+    size_t merged = 0;
+    auto forEach = [&](plist_t dict, std::function<void(const char *, plist_t)> fn){
+        plist_dict_iter iter = NULL;
+        char *key = NULL;
+        cleanup([&]{
+            safeFree(iter);
+            safeFree(key);
+        });
+        if (!dict || plist_get_node_type(dict) != PLIST_DICT) return;
+        plist_dict_new_iter(dict, &iter);
+        plist_t node = NULL;
+        for (plist_dict_next_item(dict, iter, &key, &node); node; plist_dict_next_item(dict, iter, &key, &node)) {
+            fn(key, node);
+            safeFree(key);
+        }
+    };
+    forEach(keys, [&](const char *productType, plist_t builds){
+        forEach(builds, [&](const char *build, plist_t components){
+            forEach(components, [&](const char *component, plist_t entry){
+                std::string iv = plistStringValue(plist_dict_get_item(entry, "IV"));
+                std::string key = plistStringValue(plist_dict_get_item(entry, "Key"));
+                if (iv.size() > 32 || key.size() > 64) {
+                    warning("ignoring malformed key for %s %s %s\n", productType, build, component);
+                    return;
+                }
+                libipatcher::fw_key fwkey{};
+                strncpy(fwkey.iv, iv.c_str(), sizeof(fwkey.iv)-1);
+                strncpy(fwkey.key, key.c_str(), sizeof(fwkey.key)-1);
+                fwkey.pathname = plistStringValue(plist_dict_get_item(entry, "Path"));
+
+                auto &stored = gFirmwareKeys[firmwareKeyName(productType, build, component)];
+                if (strcmp(stored.iv, fwkey.iv) || strcmp(stored.key, fwkey.key) || stored.pathname != fwkey.pathname) merged++;
+                stored = fwkey;
+            });
+        });
+    });
+    return merged;
+}
+
+static void loadFirmwareKeysLocked(){
+    if (gFirmwareKeysLoaded) return;
+    gFirmwareKeysLoaded = true;
+    plist_t keys = NULL;
+    cleanup([&]{
+        safeFreeCustom(keys, plist_free);
+    });
+    if (access(FIRMWARE_KEYS_PATH, F_OK)) return;
+    if (!(keys = futurerestore::loadPlistFromFile(FIRMWARE_KEYS_PATH))) {
+        warning("failed to load firmware keys from %s, ignoring them\n", FIRMWARE_KEYS_PATH);
+        return;
+    }
+    mergeFirmwareKeysLocked(keys);
+    debug("Loaded %zu firmware keys from %s\n", gFirmwareKeys.size(), FIRMWARE_KEYS_PATH);
+}
+
+static void saveFirmwareKeysLocked(){
+    plist_t keys = NULL;
+    cleanup([&]{
+        safeFreeCustom(keys, plist_free);
+    });
+    keys = plist_new_dict();
+    for (auto &stored : gFirmwareKeys) {
+        size_t buildStart = stored.first.find('/') + 1;
+        size_t componentStart = stored.first.find('/', buildStart) + 1;
+        std::string productType = stored.first.substr(0, buildStart-1);
+        std::string build = stored.first.substr(buildStart, componentStart-buildStart-1);
+        std::string component = stored.first.substr(componentStart);
+
+        plist_t builds = plist_dict_get_item(keys, productType.c_str());
+        if (!builds) plist_dict_set_item(keys, productType.c_str(), builds = plist_new_dict());
+        plist_t components = plist_dict_get_item(builds, build.c_str());
+        if (!components) plist_dict_set_item(builds, build.c_str(), components = plist_new_dict());
+        plist_t entry = plist_new_dict();
+        plist_dict_set_item(entry, "IV", plist_new_string(stored.second.iv));
+        plist_dict_set_item(entry, "Key", plist_new_string(stored.second.key));
+        plist_dict_set_item(entry, "Path", plist_new_string(stored.second.pathname.c_str()));
+        plist_dict_set_item(components, component.c_str(), entry);
+    }
+    //the store is only a cache of public data, the next fetch will try again
+    mkdir_with_parents(FUTURERESTORE_CACHE_PATH, 0755);
+    if (!writeBinaryPlist(keys, FIRMWARE_KEYS_PATH)) debug("failed to save firmware keys %s\n", FIRMWARE_KEYS_PATH);
+}
+
+//only goes to the network for keys we have never seen, workers may call this concurrently
+static libipatcher::fw_key firmwareKey(const std::string &productType, const std::string &build, const std::string &component){
+    std::string name = firmwareKeyName(productType, build, component);
+    {
+        std::lock_guard<std::mutex> lock(gFirmwareKeysLock);
+        loadFirmwareKeysLocked();
+        auto stored = gFirmwareKeys.find(name);
+        if (stored != gFirmwareKeys.end()) return stored->second;
+    }
+    info("fetching keys for %s %s %s\n", productType.c_str(), build.c_str(), component.c_str());
+    libipatcher::fw_key keys;
+    try {
+        keys = libipatcher::getFirmwareKey(productType, build, component);
+    } catch (tihmstar::exception &e) {
+        reterror("getting keys for %s failed with error: %d (%s). Are keys publicly available? Keys can also be imported with --import-keys", component.c_str(), e.code(), e.what());
+    }
+    std::lock_guard<std::mutex> lock(gFirmwareKeysLock);
+    gFirmwareKeys[name] = keys;
+    saveFirmwareKeysLocked();
+    return keys;
+}
+#endif
+
+size_t futurerestore::importFirmwareKeys(const char *path){
+#ifndef HAVE_LIBIPATCHER
+    reterror("compiled without libipatcher");
+#else
+    plist_t keys = NULL;
+    cleanup([&]{
+        safeFreeCustom(keys, plist_free);
+    });
+    retassure(keys = loadPlistFromFile(path), "failed to load firmware keys from %s\n", path);
+    retassure(plist_get_node_type(keys) == PLIST_DICT, "%s is not a ProductType -> Build -> component dictionary\n", path);
+    std::lock_guard<std::mutex> lock(gFirmwareKeysLock);
+    loadFirmwareKeysLocked();
+    size_t merged = mergeFirmwareKeysLocked(keys);
+    if (merged) saveFirmwareKeysLocked();
+    return merged;
+#endif
+}
+
+#ifdef HAVE_LIBIPATCHER
+#define PATCHED_BOOTCHAIN_PATH FUTURERESTORE_CACHE_PATH"/bootchain"
+
+static std::string takeBuffer(std::pair<char*,size_t> buf){
+    std::string ret(buf.first, buf.second);
+    free(buf.first);
+    return ret;
+}
+
+//patching is deterministic, so the output only depends on what goes into it and the patcher doing it
+//path is part of it because boards sharing a product type have their own iBSS/iBEC
+static std::string patchedComponentPath(const std::string &productType, const std::string &build, const std::string &component, const std::string &path, const std::string &bootargs, const std::string &im4m){
+    std::string input = libipatcher::version();
+    for (const std::string *part : {&productType, &build, &component, &path, &bootargs, &im4m}) {
+        input += '\0';
+        input += *part;
+    }
+    return std::string(PATCHED_BOOTCHAIN_PATH "/") + component + "-" + sha1Hex(input.data(), input.size());
+}
+
+#endif
+
+//everything a worker needs is copied here, the build identity gets modified on the main thread while they run
+void futurerestore::preparePwnBootchain(plist_t build_identity, std::string bootargs){
+#ifndef HAVE_LIBIPATCHER
+    reterror("compiled without libipatcher");
+#else
+    std::string ipsw = _client->ipsw;
+    std::string productType = _client->device->product_type;
+    std::string build = _client->build;
+    std::string im4m = (_client->image4supported) ? std::string(_im4ms[0].first, _im4ms[0].second) : "";
+
+    for (const char *component : {"iBSS", "iBEC"}) {
+        std::string name = component;
+        std::string path = componentPathForIdentity(build_identity, component);
+        std::string cachePath = patchedComponentPath(productType, build, name, path, (name == "iBEC") ? bootargs : "", im4m);
+        _preparedCachePaths[name] = cachePath;
+        _preparedComponents[name] = std::async(std::launch::async, [=]{
+            std::string patched;
+            if (readWholeFile(cachePath, patched)) {
+                debug("[prepare] using cached patched %s %s\n", name.c_str(), cachePath.c_str());
+                return patched;
+            }
+            libipatcher::fw_key keys = firmwareKey(productType, build, name);
+            std::string raw = extractComponentBytes(ipsw, path);
+            patched = (name == "iBSS")
+                ? takeBuffer(libipatcher::patchiBSS((char*)raw.data(), raw.size(), keys))
+                : takeBuffer(libipatcher::patchiBEC((char*)raw.data(), raw.size(), keys, bootargs));
+            /* if this is 64-bit, we need to back IM4P to IMG4
+               also due to the nature of iBoot64Patchers sigpatches we need to stich a valid signed im4m to it (but nonce is ignored) */
+            if (im4m.size())
+                patched = takeBuffer(libipatcher::packIM4PToIMG4(patched.data(), patched.size(), im4m.data(), im4m.size()));
+            //a missing cache entry only costs the next run the patching again
+            mkdir_with_parents(PATCHED_BOOTCHAIN_PATH, 0755);
+            if (!writeFileAtomically(cachePath, patched.data(), patched.size())) debug("failed to cache patched %s at %s\n", name.c_str(), cachePath.c_str());
+            return patched;
+        }).share();
+    }
+    _preparedBootargs = bootargs;
+#endif
+}
+
+#ifdef HAVE_LIBIPATCHER
+static std::string decryptComponentBytes(const std::string &ipsw, const std::string &path, const std::string &productType, const std::string &build, const std::string &component){
+    std::string raw = extractComponentBytes(ipsw, path);
+    return takeBuffer(libipatcher::decryptFile3((char*)raw.data(), raw.size(), firmwareKey(productType, build, component)));
+}
+#endif
+
+//keys, extraction and decryption of every component all run on their own worker, so
+//get_custom_component only has to copy a buffer by the time the device asks for it
+void futurerestore::prepareDecryptedComponents(plist_t build_identity){
+#ifndef HAVE_LIBIPATCHER
+    reterror("compiled without libipatcher");
+#else
+    std::string ipsw = _client->ipsw;
+    std::string productType = _client->device->product_type;
+    std::string build = _client->build;
+    size_t prepared = 0;
+    for (int i=0; decryptedComponents[i]; i++) {
+        if (!build_identity_has_component(build_identity, decryptedComponents[i])) continue;
+        std::string path = componentPathForIdentity(build_identity, decryptedComponents[i]);
+        _preparedComponents[decryptedComponents[i]] = std::async(std::launch::async, decryptComponentBytes, ipsw, path, productType, build, std::string(decryptedComponents[i])).share();
+        prepared++;
+    }
+    debug("[prepare] decrypting %zu components in the background\n", prepared);
+#endif
 }
 
-char *futurerestore::getiBootBuild(){
-    if (!_ibootBuild){
-        if (_client->recovery == NULL) {
-            retassure(!recovery_client_new(_client), "Error: can't create new recovery client");
-        }
-        irecv_getenv(_client->recovery->client, "build-version", &_ibootBuild);
-        retassure(_ibootBuild, "Error: can't get a build-version");
+void futurerestore::serveComponentsFromMemory(){
+    {
+        std::lock_guard<std::mutex> lock(gComponentOwnersLock);
+        gComponentOwners[_client] = this;
     }
-    return _ibootBuild;
+    _client->recovery_custom_component_function = preparedComponentHook;
 }
 
-pair<ptr_smart<char*>, size_t> getIPSWComponent(struct idevicerestore_client_t* client, plist_t build_identity, string component){
-    ptr_smart<char *> path;
-    unsigned char* component_data = NULL;
-    unsigned int component_size = 0;
+std::string futurerestore::preparedComponent(const char *component){
+    auto prepared = _preparedComponents.find(component);
+    retassure(prepared != _preparedComponents.end(), "%s was not prepared\n", component);
+    auto waitStart = std::chrono::steady_clock::now();
+    std::string ret = prepared->second.get();
+    double waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+    debug("[prepare] %s ready (%zu bytes, waited %.2fs)\n", component, ret.size(), waited);
+    return ret;
+}
 
-    if (!(char*)path) {
-        retassure(!build_identity_get_component_path(build_identity, component.c_str(), &path),"ERROR: Unable to get path for component '%s'\n", component.c_str());
+void futurerestore::preparedComponentHook(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, unsigned char** data, unsigned int *size){
+    futurerestore *owner = componentOwner(client);
+    std::string bytes;
+    if (owner && owner->_preparedComponents.count(component)) {
+        bytes = owner->preparedComponent(component);
+    } else {
+        bytes = extractComponentBytes(client->ipsw, componentPathForIdentity(build_identity, component));
     }
-    
-    retassure(!extract_component(client->ipsw, (char*)path, &component_data, &component_size),"ERROR: Unable to extract component: %s\n", component.c_str());
-    
-    return {(char*)component_data,component_size};
+    if (owner) owner->cacheBootComponent(component, bytes);
+    *data = (unsigned char*)malloc(bytes.size());
+    memcpy(*data, bytes.data(), bytes.size());
+    *size = (unsigned int)bytes.size();
 }
 
 void futurerestore::enterPwnRecovery(plist_t build_identity, string bootargs){
@@ -444,34 +1425,17 @@ void futurerestore::enterPwnRecovery(plist_t build_identity, string bootargs){
     }
     
     int mode = 0;
-    libipatcher::fw_key iBSSKeys;
-    libipatcher::fw_key iBECKeys;
     
-    retassure(!dfu_client_new(_client),"Unable to connect to DFU device\n");
-
-    irecv_get_mode(_client->dfu->client, &mode);
-        
-    try {
-        iBSSKeys = libipatcher::getFirmwareKey(_client->device->product_type, _client->build, "iBSS");
-        iBECKeys = libipatcher::getFirmwareKey(_client->device->product_type, _client->build, "iBEC");
-    } catch (tihmstar::exception &e) {
-        reterror("getting keys failed with error: %d (%s). Are keys publicly available?",e.code(),e.what());
-    }
+    //usually doRestore started this long ago, iBEC keeps being prepared while iBSS is on the wire
+    if (!_preparedComponents.count("iBSS") || _preparedBootargs != bootargs) preparePwnBootchain(build_identity, bootargs);
     
-    auto iBSS = getIPSWComponent(_client, build_identity, "iBSS");
-    iBSS = move(libipatcher::patchiBSS((char*)iBSS.first, iBSS.second, iBSSKeys));
+    _transport->openDFU();
+    mode = _transport->usbMode();
     
-    auto iBEC = getIPSWComponent(_client, build_identity, "iBEC");
-    iBEC = move(libipatcher::patchiBEC((char*)iBEC.first, iBEC.second, iBECKeys, bootargs));
-        
-    if (_client->image4supported) {
-        /* if this is 64-bit, we need to back IM4P to IMG4
-           also due to the nature of iBoot64Patchers sigpatches we need to stich a valid signed im4m to it (but nonce is ignored) */
-        iBSS = move(libipatcher::packIM4PToIMG4(iBSS.first, iBSS.second, _im4ms[0].first, _im4ms[0].second));
-        iBEC = move(libipatcher::packIM4PToIMG4(iBEC.first, iBEC.second, _im4ms[0].first, _im4ms[0].second));
-    }
+    std::string iBSS = preparedComponent("iBSS");
     
     bool modeIsRecovery = false;
+    modeMark mark = markModeTransitions();
     if (mode != IRECV_K_DFU_MODE) {
         info("NOTE: device is not in DFU mode, assuming pwn recovery mode.\n");
         for (int i=IRECV_K_RECOVERY_MODE_1; i<=IRECV_K_RECOVERY_MODE_4; i++) {
@@ -480,63 +1444,36 @@ void futurerestore::enterPwnRecovery(plist_t build_identity, string bootargs){
         }
         retassure(modeIsRecovery, "device is not in recovery mode\n");
     }else{
-        info("Sending %s (%lu bytes)...\n", "iBSS", iBSS.second);
-        mutex_lock(&_client->device_event_mutex);
-        irecv_error_t err = irecv_send_buffer(_client->dfu->client, (unsigned char*)(char*)iBSS.first, (unsigned long)iBSS.second, 1);
-        retassure(err == IRECV_E_SUCCESS,"ERROR: Unable to send %s component: %s\n", "iBSS", irecv_strerror(err));
+        mark = markModeTransitions();
+        sendBootImage("iBSS", iBSS.data(), iBSS.size());
         
         /* reconnect */
-        dfu_client_free(_client);
+        _transport->close();
         
-        debug("Waiting for device to disconnect...\n");
-        cond_wait_timeout(&_client->device_event_cond, &_client->device_event_mutex, 10000);
-        retassure((_client->mode == &idevicerestore_modes[MODE_UNKNOWN] || (mutex_unlock(&_client->device_event_mutex),0)), "Device did not disconnect. Possibly invalid iBSS. Reset device and try again");
-        mutex_unlock(&_client->device_event_mutex);
-
         debug("Waiting for device to reconnect...\n");
-        mutex_lock(&_client->device_event_mutex);
-        cond_wait_timeout(&_client->device_event_cond, &_client->device_event_mutex, 10000);
-        retassure((_client->mode == &idevicerestore_modes[MODE_DFU] || (mutex_unlock(&_client->device_event_mutex),0)), "Device did not disconnect. Possibly invalid iBSS. Reset device and try again");
-        mutex_unlock(&_client->device_event_mutex);
+        retassure(waitForModeTransition(mark, {MODE_UNKNOWN, MODE_DFU}, 10000), "Device did not reconnect. Possibly invalid iBSS. Reset device and try again");
+        mark = markModeTransitions();
         
-        dfu_client_new(_client);
+        _transport->openDFU();
     }
     
+    std::string iBEC = preparedComponent("iBEC");
+    
     if (_client->build_major > 8) {
-        retassure(!irecv_usb_set_configuration(_client->dfu->client, 1),"ERROR: set configuration failed\n");
+        _transport->setConfiguration(1);
         /* send iBEC */
-        info("Sending %s (%lu bytes)...\n", "iBEC", iBEC.second);
-        mutex_lock(&_client->device_event_mutex);
-        irecv_error_t err = irecv_send_buffer(_client->dfu->client, (unsigned char*)(char*)iBEC.first, (unsigned long)iBEC.second, 1);
-        retassure(err == IRECV_E_SUCCESS,"ERROR: Unable to send %s component: %s\n", "iBEC", irecv_strerror(err));
+        mark = markModeTransitions();
+        sendBootImage("iBEC", iBEC.data(), iBEC.size());
         printf("waiting for device to reconnect...\n");
-        if (modeIsRecovery){
-            irecv_send_command(_client->dfu->client, "go");
-            recovery_client_free(_client);
-        }else{
-            dfu_client_free(_client);
-        }
-
-        debug("Waiting for device to disconnect...\n");
-        cond_wait_timeout(&_client->device_event_cond, &_client->device_event_mutex, 10000);
-        /* retassure((_client->mode == &idevicerestore_modes[MODE_UNKNOWN] || (mutex_unlock(&_client->device_event_mutex),0)), "Device did not disconnect. Possibly invalid iBEC. Reset device and try again"); */
-        mutex_unlock(&_client->device_event_mutex);
+        if (modeIsRecovery) _transport->sendCommand("go");
+        _transport->close();
     }
 
     debug("Waiting for device to reconnect...\n");
-    mutex_lock(&_client->device_event_mutex);
-    cond_wait_timeout(&_client->device_event_cond, &_client->device_event_mutex, 10000);
-    retassure((_client->mode == &idevicerestore_modes[MODE_RECOVERY] || (mutex_unlock(&_client->device_event_mutex),0)), "Device did not reconnect. Possibly invalid iBEC. Reset device and try again");
-    mutex_unlock(&_client->device_event_mutex);
+    retassure(waitForModeTransition(mark, {MODE_UNKNOWN, MODE_RECOVERY}, 10000), "Device did not reconnect. Possibly invalid iBEC. Reset device and try again");
     
     // Reconnect to device, but this time make sure we're not still in DFU mode
-    if (recovery_client_new(_client) < 0) {
-        if (_client->recovery->client) {
-            irecv_close(_client->recovery->client);
-            _client->recovery->client = NULL;
-        }
-        reterror("ERROR: Unable to connect to recovery device\n");
-    }
+    _transport->openRecovery();
     
     if (_client->image4supported) {
         char *deviceGen = NULL;
@@ -546,13 +1483,13 @@ void futurerestore::enterPwnRecovery(plist_t build_identity, string bootargs){
         /* IMG4 requires to have a generator set for the device to successfully boot after restore
            set generator now and make sure the nonce is the one we are trying to restore */
         
-        assure(!irecv_send_command(_client->recovery->client, "bgcolor 255 0 0"));
+        assure(_transport->sendCommand("bgcolor 255 0 0"));
         sleep(2); //yes, I like displaying colored screens to the user and making him wait for no reason :P
         
         auto nonceelem = img4tool::getValFromIM4M({_im4ms[0].first,_im4ms[0].second}, 'BNCH');
 
         printf("ApNonce pre-hax:\n");
-        get_ap_nonce(_client, &_client->nonce, &_client->nonce_size);
+        readApNonce();
         std::string generator = getGeneratorFromSHSH2(_client->tss);
 
         if (memcmp(_client->nonce, nonceelem.payload(), _client->nonce_size) != 0) {
@@ -561,40 +1498,30 @@ void futurerestore::enterPwnRecovery(plist_t build_identity, string bootargs){
             assure(_client->tss);
             printf("Writing generator=%s to nvram!\n",generator.c_str());
             
-            retassure(!irecv_setenv(_client->recovery->client, "com.apple.System.boot-nonce", generator.c_str()),"failed to write generator to nvram");
-            retassure(!irecv_saveenv(_client->recovery->client), "failed to save nvram");
+            _transport->setenv("com.apple.System.boot-nonce", generator.c_str());
+            _transport->saveenv();
             
             /* send iBEC */
-            info("Sending %s (%lu bytes)...\n", "iBEC", iBEC.second);
-            mutex_lock(&_client->device_event_mutex);
-            irecv_error_t err = irecv_send_buffer(_client->recovery->client, (unsigned char*)(char*)iBEC.first, (unsigned long)iBEC.second, 1);
-            retassure(err == IRECV_E_SUCCESS,"ERROR: Unable to send %s component: %s\n", "iBEC", irecv_strerror(err));
+            mark = markModeTransitions();
+            sendBootImage("iBEC", iBEC.data(), iBEC.size());
             printf("waiting for device to reconnect...\n");
-            retassure(!irecv_send_command(_client->recovery->client, "go"),"failed to re-launch iBEC after ApNonce hax");
-            recovery_client_free(_client);
+            retassure(_transport->sendCommand("go"),"failed to re-launch iBEC after ApNonce hax");
+            _transport->close();
 
-            debug("Waiting for device to disconnect...\n");
-            cond_wait_timeout(&_client->device_event_cond, &_client->device_event_mutex, 10000);
-            retassure((_client->mode == &idevicerestore_modes[MODE_UNKNOWN] || (mutex_unlock(&_client->device_event_mutex),0)), "Device did not disconnect after sending hax-iBEC in pwn-iBEC mode");
-            mutex_unlock(&_client->device_event_mutex);
-            
             debug("Waiting for device to reconnect...\n");
-            mutex_lock(&_client->device_event_mutex);
-            cond_wait_timeout(&_client->device_event_cond, &_client->device_event_mutex, 10000);
-            retassure((_client->mode == &idevicerestore_modes[MODE_RECOVERY] || (mutex_unlock(&_client->device_event_mutex),0)), "Device did not reconnect after sending hax-iBEC in pwn-iBEC mode");
-            mutex_unlock(&_client->device_event_mutex);
+            retassure(waitForModeTransition(mark, {MODE_UNKNOWN, MODE_RECOVERY}, 10000), "Device did not reconnect after sending hax-iBEC in pwn-iBEC mode");
 
-            retassure(!recovery_client_new(_client), "failed to reconnect to recovery after ApNonce hax");
+            _transport->openRecovery();
             
             printf("APnonce post-hax:\n");
-            get_ap_nonce(_client, &_client->nonce, &_client->nonce_size);
-            assure(!irecv_send_command(_client->recovery->client, "bgcolor 255 255 0"));
+            readApNonce();
+            assure(_transport->sendCommand("bgcolor 255 255 0"));
             retassure(memcmp(_client->nonce, nonceelem.payload(), _client->nonce_size) == 0, "ApNonce from device doesn't match IM4M nonce after applying ApNonce hax. Aborting!");
         }else{
             printf("APNonce from device already matches IM4M nonce, no need for extra hax...\n");
         }
-        retassure(!irecv_setenv(_client->recovery->client, "com.apple.System.boot-nonce", generator.c_str()),"failed to write generator to nvram");
-        retassure(!irecv_saveenv(_client->recovery->client), "failed to save nvram");
+        _transport->setenv("com.apple.System.boot-nonce", generator.c_str());
+        _transport->saveenv();
         
         sleep(2); //yes, I like displaying colored screens to the user and making him wait for no reason :P
     }
@@ -606,9 +1533,19 @@ void get_custom_component(struct idevicerestore_client_t* client, plist_t build_
 #ifndef HAVE_LIBIPATCHER
     reterror("compiled without libipatcher");
 #else
+    futurerestore *owner = componentOwner(client);
+    if (owner && owner->_preparedComponents.count(component)) {
+        std::string bytes = owner->preparedComponent(component);
+        owner->cacheBootComponent(component, bytes);
+        *data = (unsigned char*)malloc(bytes.size());
+        memcpy(*data, bytes.data(), bytes.size());
+        *size = (unsigned int)bytes.size();
+        return;
+    }
     try {
         auto comp = getIPSWComponent(client, build_identity, component);
-        comp = move(libipatcher::decryptFile3((char*)comp.first, comp.second, libipatcher::getFirmwareKey(client->device->product_type, client->build, component)));
+        comp = move(libipatcher::decryptFile3((char*)comp.first, comp.second, firmwareKey(client->device->product_type, client->build, component)));
+        if (owner) owner->cacheBootComponent(component, std::string((char*)comp.first, comp.second));
         *data = (unsigned char*)(char*)comp.first;
         *size = comp.second;
         comp.first = NULL; //don't free on destruction
@@ -619,14 +1556,507 @@ void get_custom_component(struct idevicerestore_client_t* client, plist_t build_
 #endif
 }
 
+#pragma mark remote ipsw
+static string ipswNameFromURL(const char *url){
+    string name = url;
+    size_t pos = 0;
+    if ((pos = name.find_first_of("?#")) != string::npos) name.erase(pos);
+    if ((pos = name.rfind('/')) != string::npos) name.erase(0, pos+1);
+    if (name.size() > 5 && !strcasecmp(name.c_str()+name.size()-5, ".ipsw")) name.erase(name.size()-5);
+    if (name.empty()) name = "remote";
+    return name;
+}
+
+//where --download-ipsw puts the iPSW behind url, it only exists there once its SHA1 checked out
+static string downloadedIPSWPath(const char *url){
+    return string(IPSW_CACHE_PATH "/") + ipswNameFromURL(url) + ".ipsw";
+}
+
+const char *futurerestore::downloadIPSW(const char *version, const char *deviceModel){
+    string url;
+    string sha1;
+    if (!deviceModel) deviceModel = getDeviceModelNoCopy();
+    loadFirmwareTokens();
+
+    jssytok_t *devices = jssy_dictGetValueForKey(_firmwareTokens, "devices");
+    jssytok_t *device = (devices) ? jssy_dictGetValueForKey(devices, deviceModel) : NULL;
+    jssytok_t *firmwares = (device) ? jssy_dictGetValueForKey(device, "firmwares") : NULL;
+    retassure(firmwares, "[TSSC] could not find firmwares for %s in firmware.json\n", deviceModel);
+
+    auto tokenEquals = [](jssytok_t *tok, const char *str){
+        return tok && tok->size == strlen(str) && !strncmp(tok->value, str, tok->size);
+    };
+    jssytok_t *firmware = firmwares->subval;
+    for (size_t i = 0; i < firmwares->size; i++, firmware = firmware->next) {
+        if (!tokenEquals(jssy_dictGetValueForKey(firmware, "version"), version) && !tokenEquals(jssy_dictGetValueForKey(firmware, "buildid"), version)) continue;
+        jssytok_t *fwUrl = jssy_dictGetValueForKey(firmware, "url");
+        jssytok_t *fwSha1 = jssy_dictGetValueForKey(firmware, "sha1sum");
+        if (!fwUrl) continue;
+        url = string(fwUrl->value, fwUrl->size);
+        if (fwSha1) sha1 = string(fwSha1->value, fwSha1->size);
+        break;
+    }
+    retassure(url.size(), "[TSSC] could not find iPSW %s for %s in firmware.json\n", version, deviceModel);
+
+    _downloadedIPSWPath = downloadedIPSWPath(url.c_str());
+    mkdir_with_parents(IPSW_CACHE_PATH, 0755);
+
+    //another run might be downloading the same iPSW into the shared cache, wait for it instead of racing it
+    string lockPath = _downloadedIPSWPath + ".lock";
+    lock_info_t li;
+    lock_file(lockPath.c_str(), &li);
+    cleanup([&]{
+        unlock_file(&li);
+    });
+    if (access(_downloadedIPSWPath.c_str(), F_OK) == 0) {
+        info("Using already downloaded iPSW '%s'\n", _downloadedIPSWPath.c_str());
+        return _downloadedIPSWPath.c_str();
+    }
+
+    info("Downloading %s to '%s'\n", url.c_str(), _downloadedIPSWPath.c_str());
+    if (sha1.empty()) warning("firmware.json has no SHA1 for this iPSW, the download can not be verified\n");
+    remoteipsw::download(url, _downloadedIPSWPath, sha1);
+    info("Downloaded and verified %s\n", _downloadedIPSWPath.c_str());
+    return _downloadedIPSWPath.c_str();
+}
+
+const char *futurerestore::stageRemoteIPSW(const char *url){
+    plist_t buildmanifest = NULL;
+    plist_dict_iter iter = NULL;
+    vector<string> files;
+    vector<string> errors;
+    std::mutex errorsLock;
+    string fsname;
+    cleanup([&]{
+        safeFree(iter);
+        safeFreeCustom(buildmanifest, plist_free);
+    });
+
+    info("Reading remote iPSW %s\n", url);
+    _remoteIPSW = std::make_shared<remoteipsw>(url);
+
+    _remoteIPSWDir = string(IPSW_CACHE_PATH "/") + ipswNameFromURL(url);
+    mkdir_with_parents(_remoteIPSWDir.c_str(), 0755);
+
+    //files are written to <name>.part and renamed once their crc32 checked out, so a complete file is a valid one
+    auto stageFile = [&](const string &path){
+        const remoteipsw::entry *e = _remoteIPSW->getEntry(path);
+        string dst = _remoteIPSWDir + "/" + path;
+        struct stat st = {};
+        retassure(e, "%s does not exist in remote iPSW\n", path.c_str());
+        if (stat(dst.c_str(), &st) == 0 && (uint64_t)st.st_size == e->size) return;
+        char *dir = strdup(dst.c_str());
+        mkdir_with_parents(dirname(dir), 0755);
+        free(dir);
+        _remoteIPSW->extractToFile(path, dst);
+    };
+
+    stageFile("BuildManifest.plist");
+    if (_remoteIPSW->getEntry("Restore.plist")) stageFile("Restore.plist");
+    retassure(buildmanifest = loadBuildManifestFromFile((_remoteIPSWDir + "/BuildManifest.plist").c_str(), getDeviceBoardNoCopy(), _isUpdateInstall), "ERROR: Unable to load BuildManifest from remote iPSW\n");
+
+    plist_t build_identity = getBuildidentityWithBoardconfig(buildmanifest, getDeviceBoardNoCopy(), _isUpdateInstall);
+    retassure(build_identity, "ERROR: Unable to find any build identities for iPSW\n");
+    plist_t manifest = plist_dict_get_item(build_identity, "Manifest");
+    retassure(manifest, "ERROR: build identity does not contain a Manifest\n");
+
+    plist_dict_new_iter(manifest, &iter);
+    while (true) {
+        char *key = NULL;
+        plist_t node = NULL;
+        plist_dict_next_item(manifest, iter, &key, &node);
+        if (!key) break;
+        bool isOS = !strcmp(key, "OS");
+        free(key);
+
+        plist_t path = plist_access_path(node, 2, "Info", "Path");
+        if (!path || plist_get_node_type(path) != PLIST_STRING) continue;
+        char *pathStr = NULL;
+        plist_get_string_val(path, &pathStr);
+        if (isOS) {
+            fsname = pathStr;
+        } else if (_remoteIPSW->getEntry(pathStr) && std::find(files.begin(), files.end(), pathStr) == files.end()) {
+            files.push_back(pathStr);
+        }
+        safeFree(pathStr);
+    }
+    retassure(fsname.size(), "ERROR: Unable to get path for filesystem component\n");
+
+    info("Fetching %zu components from remote iPSW\n", files.size());
+    parallelFor(files.size(), [&](size_t i){
+        try {
+            stageFile(files[i]);
+        } catch (tihmstar::exception &e) {
+            std::unique_lock<std::mutex> ul(errorsLock);
+            errors.push_back(files[i] + ": " + e.what());
+        }
+    });
+    for (auto &err : errors) error("[remote] failed to fetch %s\n", err.c_str());
+    retassure(errors.empty(), "failed to fetch %zu components from remote iPSW\n", errors.size());
+
+    const remoteipsw::entry *fs = _remoteIPSW->getEntry(fsname);
+    retassure(fs, "%s does not exist in remote iPSW\n", fsname.c_str());
+    string fsdst = _remoteIPSWDir + "/" + fsname;
+    struct stat st = {};
+    if (stat(fsdst.c_str(), &st) == 0 && (uint64_t)st.st_size == fs->size) {
+        info("Using cached filesystem from '%s'\n", fsdst.c_str());
+        return _remoteIPSWDir.c_str();
+    }
+
+    //ASR reads the filesystem mostly in order, a stored one can go to it straight from the server
+    string notStreamed;
+    if (fs->method != 0) {
+        notStreamed = "it is compressed in the iPSW";
+    } else if (!remoteFileMount::isSupported()) {
+        notStreamed = "futurerestore was built without FUSE";
+    } else {
+        string mountPoint = _sessionDir + "/" REMOTE_FS_MOUNT_NAME;
+        try {
+            mkdir_with_parents(mountPoint.c_str(), 0755);
+            _remoteFilesystemMount = std::make_shared<remoteFileMount>(_remoteIPSW, fsname, mountPoint);
+            info("Streaming filesystem (%llu bytes) from remote iPSW through '%s'\n", (unsigned long long)fs->size, _remoteFilesystemMount->path().c_str());
+            return _remoteIPSWDir.c_str();
+        } catch (tihmstar::exception &e) {
+            notStreamed = string("mounting it failed (") + e.what() + ")";
+        }
+    }
+
+    //storing a whole filesystem is what remote iPSWs are meant to avoid, so only do it when asked to
+    retassure(_remoteFilesystemToDisk, "Can't stream the filesystem from the remote iPSW, %s. Use --remote-fs-to-disk to store it (%llu bytes) on disk instead\n", notStreamed.c_str(), (unsigned long long)fs->size);
+    warning("Can't stream the filesystem from the remote iPSW, %s\n", notStreamed.c_str());
+    info("Storing filesystem (%llu bytes) from remote iPSW on disk in '%s', in the background\n", (unsigned long long)fs->size, fsdst.c_str());
+    std::shared_ptr<remoteipsw> remote = _remoteIPSW;
+    _remoteFilesystem = std::async(std::launch::async, [remote, fsname, fsdst]{
+        remote->extractToFile(fsname, fsdst);
+    });
+    return _remoteIPSWDir.c_str();
+}
+
+void futurerestore::checkRemoteIPSW(const char *url){
+    std::shared_ptr<remoteipsw> remote = std::make_shared<remoteipsw>(url);
+    string mountPoint = FUTURERESTORE_SESSIONS_PATH "/" + std::to_string(getpid()) + "-check";
+    std::vector<char> buf(ASR_READ_SIZE);
+    cleanup([&]{
+        removeDirectory(mountPoint);
+    });
+
+    for (auto &it : remote->entries()) {
+        const remoteipsw::entry &e = it.second;
+        if (e.name.size() < 4 || strcasecmp(e.name.c_str() + e.name.size() - 4, ".dmg")) continue;
+        sha1Hasher hasher;
+        string how;
+        auto start = std::chrono::steady_clock::now();
+
+        if (e.method == 0) {
+            std::shared_ptr<remoteFileMount> mount;
+            std::shared_ptr<remoteFileStream> stream;
+            int fd = -1;
+            cleanup([&]{
+                if (fd != -1) close(fd);
+            });
+            if (remoteFileMount::isSupported()) {
+                try {
+                    mkdir_with_parents(mountPoint.c_str(), 0755);
+                    mount = std::make_shared<remoteFileMount>(remote, e.name, mountPoint);
+                    retassure((fd = open(mount->path().c_str(), O_RDONLY)) != -1, "failed to open %s\n", mount->path().c_str());
+                } catch (tihmstar::exception &ex) {
+                    warning("Failed to mount %s (%s), reading it without FUSE\n", e.name.c_str(), ex.what());
+                    if (fd != -1) close(fd);
+                    fd = -1;
+                    mount = NULL;
+                }
+            }
+            if (!mount) stream = std::make_shared<remoteFileStream>(remote, e.name);
+            auto readAt = [&](char *dst, size_t size, uint64_t offset)->size_t{
+                if (!mount) return stream->read(dst, size, offset);
+                ssize_t didRead = pread(fd, dst, size, (off_t)offset);
+                retassure(didRead >= 0, "failed to read %s\n", mount->path().c_str());
+                return (size_t)didRead;
+            };
+
+            //like ASR, look at the UDIF trailer first and then go through the image in order
+            uint64_t trailer = std::min<uint64_t>(e.size, 512);
+            retassure(readAt(buf.data(), (size_t)trailer, e.size - trailer) == trailer, "short read at the end of %s\n", e.name.c_str());
+            for (uint64_t offset = 0; offset < e.size;) {
+                size_t didRead = readAt(buf.data(), buf.size(), offset);
+                retassure(didRead, "short read at %llu of %s\n", (unsigned long long)offset, e.name.c_str());
+                hasher.update(buf.data(), didRead);
+                offset += didRead;
+            }
+            remoteFileStream &used = (mount) ? mount->stream() : *stream;
+            how = string((mount) ? "streamed through FUSE" : "streamed") + ", " + std::to_string(used.directBytes()) + " bytes outside the read-ahead window";
+        } else {
+            remote->extract(e.name, [&](const char *data, size_t size){
+                hasher.update(data, size);
+                return true;
+            });
+            how = "compressed, a restore needs --remote-fs-to-disk";
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        info("[remote] %s: %llu bytes, SHA1 %s, %.1f MB/s (%s)\n", e.name.c_str(), (unsigned long long)e.size, hasher.hexDigest().c_str(), (seconds > 0) ? (e.size / seconds) / (1024*1024) : 0.0, how.c_str());
+    }
+}
+
+#pragma mark component preload
+#define PRELOAD_BASE_PATH "/dev/shm"
+
+//preloading only pays off in memory, on disk it is the same extraction the restore would do anyway.
+//Returns why preloading isn't possible, or NULL if it is
+static const char *preloadUnavailableReason(){
+#ifdef __linux__
+    struct statfs sfs = {};
+    if (statfs(PRELOAD_BASE_PATH, &sfs) || sfs.f_type != TMPFS_MAGIC || access(PRELOAD_BASE_PATH, W_OK))
+        return PRELOAD_BASE_PATH " is not a writable tmpfs";
+    return NULL;
+#else
+    return "only Linux provides a tmpfs at " PRELOAD_BASE_PATH " to inflate them into";
+#endif
+}
+
+//every file besides the filesystem which restoring build_identity reads from the iPSW.
+//Cryptex images are as large as the filesystem and restore_device never sends them, so they are left out
+static vector<string> restoreFilesForIdentity(const char *ipsw, plist_t build_identity){
+    vector<string> files;
+    plist_t manifest = plist_dict_get_item(build_identity, "Manifest");
+    plist_dict_iter iter = NULL;
+    auto addFile = [&](const string &path){
+        if (std::find(files.begin(), files.end(), path) == files.end() && ipsw_file_exists(ipsw, path.c_str())) files.push_back(path);
+    };
+    addFile("BuildManifest.plist");
+    addFile("Restore.plist");
+    if (!manifest) return files;
+
+    plist_dict_new_iter(manifest, &iter);
+    while (true) {
+        char *key = NULL;
+        plist_t node = NULL;
+        plist_dict_next_item(manifest, iter, &key, &node);
+        if (!key) break;
+        bool skip = !strcmp(key, "OS") || !strncmp(key, "Cryptex1,", strlen("Cryptex1,"));
+        free(key);
+        if (skip) continue;
+
+        plist_t path = plist_access_path(node, 2, "Info", "Path");
+        if (!path || plist_get_node_type(path) != PLIST_STRING) continue;
+        char *pathStr = NULL;
+        plist_get_string_val(path, &pathStr);
+        string component = pathStr;
+        safeFree(pathStr);
+        addFile(component);
+        //image3 devices look up the firmware folder's manifest next to its components
+        size_t slash = component.rfind('/');
+        if (slash != string::npos) addFile(component.substr(0, slash) + "/manifest");
+    }
+    safeFree(iter);
+    return files;
+}
+
+bool futurerestore::preloadComponents(std::string ipsw, vector<string> files){
+    if (const char *reason = preloadUnavailableReason()) {
+        info("[preload] skipped, %s. Reading components from the iPSW during restore\n", reason);
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    uint64_t total = 0;
+    for (auto &file : files) {
+        uint64_t size = 0;
+        ipsw_get_file_size(ipsw.c_str(), file.c_str(), &size);
+        total += size;
+    }
+    if (total > _preloadBudget) {
+        info("[preload] components need %llu MB which exceeds the budget of %llu MB, reading them from the iPSW during restore\n", (unsigned long long)(total >> 20), (unsigned long long)(_preloadBudget >> 20));
+        return false;
+    }
+
+    string dir = PRELOAD_BASE_PATH "/futurerestore_components_" + std::to_string(getpid());
+    removeDirectory(dir);
+    if (mkdir_with_parents(dir.c_str(), 0755)) {
+        error("[preload] failed to create '%s'\n", dir.c_str());
+        return false;
+    }
+    _preloadDir = dir;
+
+    std::atomic<size_t> failed{0};
+    size_t threadCnt = parallelFor(files.size(), [&](size_t i){
+        string dst = dir + "/" + files[i];
+        size_t slash = dst.rfind('/');
+        mkdir_with_parents(dst.substr(0, slash).c_str(), 0755);
+        if (ipsw_extract_to_file(ipsw.c_str(), files[i].c_str(), dst.c_str())) {
+            error("[preload] failed to extract %s\n", files[i].c_str());
+            failed++;
+        }
+    });
+    if (failed) {
+        removeDirectory(dir);
+        _preloadDir.clear();
+        return false;
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    info("[preload] inflated %zu files (%llu MB) into '%s' using %zu threads in %.2fs\n", files.size(), (unsigned long long)(total >> 20), dir.c_str(), threadCnt, elapsed);
+    return true;
+}
+
+#pragma mark preflight
+struct componentCheck {
+    std::string name;
+    std::string path;
+    std::string manifestDigest;
+    std::string computedDigest;
+    std::string err;
+};
+
+static std::string digestWithLength(const void *buf, size_t bufSize, size_t digestLen){
+    unsigned char md[48]; //SHA384 digest length
+    switch (digestLen) {
+        case 20:
+            SHA1((const unsigned char*)buf, bufSize, md);
+            break;
+        case 32:
+            SHA256((const unsigned char*)buf, bufSize, md);
+            break;
+        case 48:
+            SHA384((const unsigned char*)buf, bufSize, md);
+            break;
+        default:
+            reterror("unsupported digest length %zu\n",digestLen);
+    }
+    return {(char*)md,digestLen};
+}
+
+void futurerestore::verifyComponentDigests(plist_t build_identity, std::pair<const char *,size_t> im4m, std::vector<const char*> ticketIgnoreList){
+    plist_t manifest = plist_dict_get_item(build_identity, "Manifest");
+    retassure(manifest, "ERROR: build identity does not contain a Manifest\n");
+
+    vector<componentCheck> checks;
+    size_t skipped = 0;
+    plist_dict_iter iter = NULL;
+    plist_dict_new_iter(manifest, &iter);
+    while (true) {
+        char *key = NULL;
+        plist_t node = NULL;
+        plist_dict_next_item(manifest, iter, &key, &node);
+        if (!key) break;
+        componentCheck check;
+        check.name = key;
+        free(key);
+
+        //filesystem is verified by ASR, SEP and baseband get replaced by the user supplied ones
+        if (check.name == "OS" || check.name == "SEP" || check.name == "BasebandFirmware") continue;
+
+        plist_t digest = plist_dict_get_item(node, "Digest");
+        plist_t nodeInfo = plist_dict_get_item(node, "Info");
+        plist_t path = (nodeInfo) ? plist_dict_get_item(nodeInfo, "Path") : NULL;
+        if (!digest || plist_get_node_type(digest) != PLIST_DATA || !path || plist_get_node_type(path) != PLIST_STRING) continue;
+
+        char *pathStr = NULL;
+        char *digestBuf = NULL;
+        uint64_t digestSize = 0;
+        plist_get_string_val(path, &pathStr);
+        plist_get_data_val(digest, &digestBuf, &digestSize);
+        check.path = pathStr;
+        check.manifestDigest = {digestBuf,(size_t)digestSize};
+        safeFree(pathStr);
+        safeFree(digestBuf);
+
+        if (!ipsw_file_exists(_client->ipsw, check.path.c_str())) {
+            //components like Rose or Savage firmware are provided by the latest firmware, not by this iPSW
+            debug("[preflight] skipping %s, %s is not part of the iPSW\n",check.name.c_str(),check.path.c_str());
+            skipped++;
+            continue;
+        }
+        checks.push_back(check);
+    }
+    safeFree(iter);
+
+    info("[preflight] verifying %zu components against BuildManifest%s...\n",checks.size(),(im4m.first) ? " and APTicket" : "");
+    auto start = std::chrono::steady_clock::now();
+
+    size_t threadCnt = parallelFor(checks.size(), [&](size_t i){
+        componentCheck &check = checks[i];
+        unsigned char *data = NULL;
+        unsigned int dataSize = 0;
+        if (extract_component(_client->ipsw, check.path.c_str(), &data, &dataSize)) {
+            check.err = "failed to extract component from iPSW";
+            return;
+        }
+        try {
+            check.computedDigest = digestWithLength(data, dataSize, check.manifestDigest.size());
+        } catch (tihmstar::exception &e) {
+            check.err = e.what();
+        }
+        free(data);
+    });
+
+    plist_t ticketIdentity = NULL;
+    cleanup([&]{
+        safeFreeCustom(ticketIdentity, plist_free);
+    });
+    if (im4m.first && _client->image4supported) {
+        //check every digest on its own, by matching a build identity which only contains that component
+        ticketIdentity = plist_copy(build_identity);
+        plist_dict_remove_item(ticketIdentity, "Manifest");
+    }
+
+    size_t failed = 0;
+    for (auto &check : checks) {
+        if (check.err.empty() && check.computedDigest != check.manifestDigest)
+            check.err = "component digest does not match BuildManifest";
+
+        if (check.err.empty() && ticketIdentity) {
+            plist_t ticketManifest = plist_new_dict();
+            plist_dict_set_item(ticketManifest, check.name.c_str(), plist_copy(plist_dict_get_item(manifest, check.name.c_str())));
+            plist_dict_set_item(ticketIdentity, "Manifest", ticketManifest);
+            try {
+                if (!img4tool::im4mMatchesBuildIdentity({im4m.first,im4m.second}, ticketIdentity, ticketIgnoreList))
+                    check.err = "component digest does not match APTicket";
+            } catch (tihmstar::exception &e) {
+                check.err = std::string("failed to match component against APTicket: ") + e.what();
+            }
+        } else if (check.err.empty() && im4m.first && check.name == "RestoreRamDisk") {
+            //SCAB only carries the ramdisk hash
+            auto ticket = getRamdiskHashFromSCAB(im4m.first, im4m.second);
+            if (ticket.second != check.computedDigest.size() || memcmp(ticket.first, check.computedDigest.data(), ticket.second))
+                check.err = "component digest does not match APTicket";
+        }
+
+        if (!check.err.empty()) {
+            error("[preflight] %s (%s): %s\n",check.name.c_str(),check.path.c_str(),check.err.c_str());
+            failed++;
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    info("[preflight] checked %zu components (%zu skipped) using %zu threads in %.2fs\n",checks.size(),skipped,threadCnt,elapsed);
+    retassure(!failed, "%zu components failed verification, refusing to continue\n",failed);
+    printf("Verified all iPSW components to be valid for this restore\n");
+}
+
 void futurerestore::doRestore(const char *ipsw){
     plist_t buildmanifest = NULL;
     int delete_fs = 0;
     char* filesystem = NULL;
+    bool restored = false;
+    std::atomic<bool> stopPrewarm{false};
+    std::thread prewarmThread;
+    std::future<bool> preloadDone;
     cleanup([&]{
         info("Cleaning up...\n");
+        stopPrewarm = true;
+        if (prewarmThread.joinable()) prewarmThread.join();
+        if (preloadDone.valid()) preloadDone.wait();
+        if (_preloadDir.size()) {
+            removeDirectory(_preloadDir);
+            _preloadDir.clear();
+        }
         safeFreeCustom(buildmanifest, plist_free);
-        if (delete_fs && filesystem) unlink(filesystem);
+        //a failed attempt leaves the filesystem to the journal once it is recorded there, the next one picks it up.
+        //Anything not recorded yet may be a partial extraction and nobody would ever find it again
+        if (delete_fs && filesystem) {
+            if (restored || journalArtifact("Filesystem", "Path") != filesystem) unlink(filesystem);
+            else info("[journal] keeping filesystem '%s' for the next attempt\n", filesystem);
+        }
     });
     struct idevicerestore_client_t* client = _client;
     plist_t build_identity = NULL;
@@ -635,14 +2065,9 @@ void futurerestore::doRestore(const char *ipsw){
     client->ipsw = strdup(ipsw);
     if (!_isUpdateInstall) client->flags |= FLAG_ERASE;
     
-    irecv_device_event_subscribe(&client->irecv_e_ctx, irecv_event_cb, client);
-    idevice_event_subscribe(idevice_event_cb, client);
-    client->idevice_e_ctx = (void*)idevice_event_cb;
-
-    mutex_lock(&client->device_event_mutex);
-    cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
+    subscribeDeviceEvents();
     
-    retassure(client->mode != &idevicerestore_modes[MODE_UNKNOWN],  "Unable to discover device mode. Please make sure a device is attached.\n");
+    retassure(waitForDeviceMode(10000),  "Unable to discover device mode. Please make sure a device is attached.\n");
     if (client->mode != &idevicerestore_modes[MODE_RECOVERY]) {
         retassure(client->mode == &idevicerestore_modes[MODE_DFU], "Device is in unexpected mode detected!");
         retassure(_enterPwnRecoveryRequested, "Device is in DFU mode detected, but we were expecting recovery mode!");
@@ -651,16 +2076,31 @@ void futurerestore::doRestore(const char *ipsw){
     }
         
     info("Found device in %s mode\n", client->mode->string);
-    mutex_unlock(&client->device_event_mutex);
 
     info("Identified device as %s, %s\n", getDeviceBoardNoCopy(), getDeviceModelNoCopy());
 
+    if (remoteipsw::isRemote(client->ipsw)) {
+        string localIPSW = downloadedIPSWPath(client->ipsw);
+        if (access(localIPSW.c_str(), F_OK) == 0) {
+            info("Using downloaded iPSW '%s'\n", localIPSW.c_str());
+        } else {
+            localIPSW = stageRemoteIPSW(client->ipsw);
+        }
+        free(client->ipsw);
+        client->ipsw = strdup(localIPSW.c_str());
+    }
+
     retassure(!access(client->ipsw, F_OK),"ERROR: Firmware file %s does not exist.\n", client->ipsw); // verify if ipsw file exists
 
     info("Extracting BuildManifest from iPSW\n");
     {
-        int unused;
-        retassure(!ipsw_extract_build_manifest(client->ipsw, &buildmanifest, &unused),"ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
+        char *manifestBuf = NULL;
+        cleanup([&]{
+            safeFree(manifestBuf);
+        });
+        uint32_t manifestSize = 0;
+        retassure(!ipsw_extract_to_memory(client->ipsw, "BuildManifest.plist", (unsigned char**)&manifestBuf, &manifestSize),"ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
+        retassure(buildmanifest = loadBuildManifestForBoard(manifestBuf, manifestSize, client->device->hardware_model, _isUpdateInstall),"ERROR: Unable to parse BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
     }
 
     /* check if device type is supported by the given build manifest */
@@ -687,6 +2127,23 @@ void futurerestore::doRestore(const char *ipsw){
     
     retassure(build_identity = getBuildidentityWithBoardconfig(buildmanifest, client->device->hardware_model, _isUpdateInstall),"ERROR: Unable to find any build identities for iPSW\n");
 
+    //the pwned bootchain only depends on ticket and identity, get it ready while we validate them.
+    //On the normal path idevicerestore personalizes the bootchain itself, there is nothing to prepare
+    if (_enterPwnRecoveryRequested) {
+        if (!_client->image4supported && strncmp(_client->version, "10.", 3)) {
+            //32-bit pwn restores send decrypted components through get_custom_component
+            prepareDecryptedComponents(build_identity);
+        } else {
+            preparePwnBootchain(build_identity);
+        }
+    }
+
+    //inflate everything the restore phase needs while we are still busy with tickets and iBEC,
+    //so the device never waits on zip decompression. Extracted iPSWs have nothing to inflate
+    if (_preloadBudget && !ipsw_is_directory(client->ipsw)) {
+        preloadDone = std::async(std::launch::async, &futurerestore::preloadComponents, this, string(client->ipsw), restoreFilesForIdentity(client->ipsw, build_identity));
+    }
+
     if (_client->image4supported) {
         if (!(sep_build_identity = getBuildidentityWithBoardconfig(_sepbuildmanifest, client->device->hardware_model, _isUpdateInstall))){
             retassure(_isPwnDfu, "ERROR: Unable to find any build identities for SEP\n");
@@ -700,7 +2157,14 @@ void futurerestore::doRestore(const char *ipsw){
 
     printf("checking APTicket to be valid for this restore...\n"); //if we are in pwnDFU, just use first APTicket. We don't need to check nonces.
     auto im4m = (_enterPwnRecoveryRequested || _rerestoreiOS9) ? _im4ms.at(0) : nonceMatchesIM4Ms();
+    loadRestoreJournal(restoreJournalKey(im4m));
+    journalIdentities({{"Build", buildIdentityName(build_identity)}, {"SEP", buildIdentityName(sep_build_identity)}});
+    if (_preparedCachePaths.size()) {
+        //the patched bootchain was looked up in the cache before the journal was loaded, record which entries it used
+        journalStep("BootchainCached", std::vector<std::pair<std::string, std::string>>(_preparedCachePaths.begin(), _preparedCachePaths.end()));
+    }
 
+    vector<const char*> ticketIgnoreList;
     uint64_t deviceEcid = getDeviceEcid();
     uint64_t im4mEcid = 0;
     if (_client->image4supported) {
@@ -719,7 +2183,9 @@ void futurerestore::doRestore(const char *ipsw){
     }else
         printf("Verified ECID in APTicket matches device ECID\n");
 
-    if (_client->image4supported) {
+    if (_client->image4supported && journalStepDone("TicketValidated")) {
+        printf("Verified APTicket to be valid for this restore\n");
+    }else if (_client->image4supported) {
         printf("checking APTicket to be valid for this restore...\n");
         uint64_t deviceEcid = getDeviceEcid();
 
@@ -730,17 +2196,9 @@ void futurerestore::doRestore(const char *ipsw){
         }else
             printf("Verified ECID in APTicket matches device ECID\n");
 
-        plist_t ticketIdentity = NULL;
-        
-        try {
-            ticketIdentity = img4tool::getBuildIdentityForIm4m({im4m.first,im4m.second}, buildmanifest);
-        } catch (tihmstar::exception &e) {
-            //
-        }
-        
-        if (!ticketIdentity) {
+        plist_t ticketIdentity = getBuildIdentityForIM4M(im4m, buildmanifest, &ticketIgnoreList);
+        if (ticketIgnoreList.size()) {
             printf("Failed to get exact match for build identity, using fallback to ignore certain values\n");
-            ticketIdentity = img4tool::getBuildIdentityForIm4m({im4m.first,im4m.second}, buildmanifest, {"RestoreRamDisk","RestoreTrustCache"});
         }
 
         /* TODO: make this nicer!
@@ -791,12 +2249,22 @@ void futurerestore::doRestore(const char *ipsw){
             reterror("APTicket can't be used for this restore\n");
         }
     }
+    journalStep("TicketValidated");
+
+    if (!journalStepDone("ComponentsVerified")) {
+        if (_enterPwnRecoveryRequested && !_client->image4supported)
+            verifyComponentDigests(build_identity, {NULL,0});
+        else
+            verifyComponentDigests(build_identity, im4m, ticketIgnoreList);
+        journalStep("ComponentsVerified");
+    }
 
     if (_basebandbuildmanifest){
         if (!(client->basebandBuildIdentity = getBuildidentityWithBoardconfig(_basebandbuildmanifest, client->device->hardware_model, _isUpdateInstall))){
             retassure(client->basebandBuildIdentity = getBuildidentityWithBoardconfig(_basebandbuildmanifest, client->device->hardware_model, !_isUpdateInstall), "ERROR: Unable to find any build identities for Baseband\n");
             info("[WARNING] Unable to find Baseband buildidentities for restore type %s, using fallback %s\n", (_isUpdateInstall) ? "Update" : "Erase",(!_isUpdateInstall) ? "Update" : "Erase");
         }
+        journalStep("BasebandResolved", {{"Baseband", buildIdentityName(client->basebandBuildIdentity)}});
 
         client->bbfwtmp = (char*)_basebandPath;
 
@@ -814,6 +2282,9 @@ void futurerestore::doRestore(const char *ipsw){
         plist_t sep_manifest = plist_dict_get_item(sep_build_identity, "Manifest");
         plist_t sep_sep = plist_copy(plist_dict_get_item(sep_manifest, "SEP"));
         plist_dict_set_item(manifest, "SEP", sep_sep);
+    }
+    if (_client->image4supported && !journalStepDone("SEPVerified")) {
+        plist_t sep_sep = plist_dict_get_item(manifest, "SEP");
         unsigned char genHash[48]; //SHA384 digest length
         ptr_smart<unsigned char *>sephash = NULL;
         uint64_t sephashlen = 0;
@@ -828,6 +2299,7 @@ void futurerestore::doRestore(const char *ipsw){
         else
             SHA384((unsigned char*)_client->sepfwdata, (unsigned int)_client->sepfwdatasize, genHash);
         retassure(!memcmp(genHash, sephash, sephashlen), "ERROR: SEP does not match sepmanifest\n");
+        journalStep("SEPVerified");
     }
 
     build_identity_print_information(build_identity); // print information about current build identity
@@ -842,6 +2314,38 @@ void futurerestore::doRestore(const char *ipsw){
     char* fsname = NULL;
     retassure(!build_identity_get_component_path(build_identity, "OS", &fsname), "ERROR: Unable to get path for filesystem component\n");
 
+    if (_remoteFilesystem.valid()) {
+        info("Waiting for filesystem to finish streaming from remote iPSW...\n");
+        _remoteFilesystem.get();
+    }
+
+    if (_remoteFilesystemMount) {
+        info("Using filesystem streamed from remote iPSW '%s'\n", _remoteFilesystemMount->path().c_str());
+        filesystem = strdup(_remoteFilesystemMount->path().c_str());
+    }
+
+    // an earlier attempt may have left one behind
+    std::string journalFilesystem = journalArtifact("Filesystem", "Path");
+    if (!filesystem && journalFilesystem.size()) {
+        struct stat jst = {};
+        uint64_t fssize = 0;
+        ipsw_get_file_size(client->ipsw, fsname, &fssize);
+        if (!stat(journalFilesystem.c_str(), &jst) && fssize && (uint64_t)jst.st_size == fssize) {
+            info("Using filesystem from earlier attempt '%s'\n", journalFilesystem.c_str());
+            filesystem = strdup(journalFilesystem.c_str());
+            delete_fs = (journalArtifact("Filesystem", "Temporary") == "yes");
+        }
+    }
+
+    // extracted iPSWs (and staged remote ones) already contain the filesystem
+    if (!filesystem && ipsw_is_directory(client->ipsw)) {
+        std::string fspath = std::string(client->ipsw) + "/" + fsname;
+        if (access(fspath.c_str(), F_OK) == 0) {
+            info("Using filesystem from '%s'\n", fspath.c_str());
+            filesystem = strdup(fspath.c_str());
+        }
+    }
+
     // check if we already have an extracted filesystem
     struct stat st;
     memset(&st, '\0', sizeof(struct stat));
@@ -863,14 +2367,14 @@ void futurerestore::doRestore(const char *ipsw){
         *p = '\0';
     }
 
-    if (stat(tmpf, &st) < 0) {
+    if (!filesystem && stat(tmpf, &st) < 0) {
         __mkdir(tmpf, 0755);
     }
     strcat(tmpf, "/");
     strcat(tmpf, fsname);
 
     memset(&st, '\0', sizeof(struct stat));
-    if (stat(tmpf, &st) == 0) {
+    if (!filesystem && stat(tmpf, &st) == 0) {
         off_t fssize = 0;
         ipsw_get_file_size(client->ipsw, fsname, (uint64_t*)&fssize);
         if ((fssize > 0) && (st.st_size == fssize)) {
@@ -920,51 +2424,51 @@ void futurerestore::doRestore(const char *ipsw){
             filesystem = strdup(tmpf);
         }
     }
+    //the mount is gone with this session, a later attempt streams again
+    if (!_remoteFilesystemMount) journalStep("Filesystem", {{"Path", filesystem}, {"Temporary", (delete_fs) ? "yes" : "no"}});
+
+    //reading ahead through the mount would only push the window past where ASR starts
+    bool prewarm = _prewarmBudget && !_remoteFilesystemMount;
+    if (prewarm) {
+        std::string fspath = filesystem;
+        uint64_t budget = _prewarmBudget;
+        prewarmThread = std::thread([fspath, budget, &stopPrewarm]{
+            prewarmFile(fspath.c_str(), budget, &stopPrewarm);
+        });
+    }
 
     if (_rerestoreiOS9) {
-        mutex_lock(&_client->device_event_mutex);
+        modeMark mark = markModeTransitions();
+        auto uploadStart = std::chrono::steady_clock::now();
         if (dfu_send_component(client, build_identity, "iBSS") < 0) {
             irecv_close(client->dfu->client);
             client->dfu->client = NULL;
             reterror("ERROR: Unable to send iBSS to device\n");
         }
+        noteUpload("iBSS", 0, uploadStart);
 
         /* reconnect */
         dfu_client_free(client);
         
-        debug("Waiting for device to disconnect...\n");
-        cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-        retassure((client->mode == &idevicerestore_modes[MODE_UNKNOWN] || (mutex_unlock(&client->device_event_mutex),0)), "Device did not disconnect. Possibly invalid iBSS. Reset device and try again");
-        mutex_unlock(&client->device_event_mutex);
-
         debug("Waiting for device to reconnect...\n");
-        mutex_lock(&_client->device_event_mutex);
-        cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-        retassure((client->mode == &idevicerestore_modes[MODE_DFU] || (mutex_unlock(&client->device_event_mutex),0)), "Device did not disconnect. Possibly invalid iBSS. Reset device and try again");
-        mutex_unlock(&client->device_event_mutex);
+        retassure(waitForModeTransition(mark, {MODE_UNKNOWN, MODE_DFU}, 10000), "Device did not reconnect. Possibly invalid iBSS. Reset device and try again");
         
         dfu_client_new(client);
 
         /* send iBEC */
+        mark = markModeTransitions();
+        uploadStart = std::chrono::steady_clock::now();
         if (dfu_send_component(client, build_identity, "iBEC") < 0) {
             irecv_close(client->dfu->client);
             client->dfu->client = NULL;
             reterror("ERROR: Unable to send iBEC to device\n");
         }
+        noteUpload("iBEC", 0, uploadStart);
         
         dfu_client_free(client);
         
-        debug("Waiting for device to disconnect...\n");
-        mutex_lock(&_client->device_event_mutex);
-        cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-        /* retassure((client->mode == &idevicerestore_modes[MODE_UNKNOWN] || (mutex_unlock(&client->device_event_mutex),0)), "Device did not disconnect. Possibly invalid iBEC. Reset device and try again"); */
-        mutex_unlock(&client->device_event_mutex);
-
         debug("Waiting for device to reconnect...\n");
-        mutex_lock(&_client->device_event_mutex);
-        cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-        retassure((client->mode == &idevicerestore_modes[MODE_RECOVERY] || (mutex_unlock(&client->device_event_mutex),0)), "Device did not reconnect. Possibly invalid iBEC. Reset device and try again");
-        mutex_unlock(&client->device_event_mutex);
+        retassure(waitForModeTransition(mark, {MODE_UNKNOWN, MODE_RECOVERY}, 10000), "Device did not reconnect. Possibly invalid iBEC. Reset device and try again");
 
     }else{
         if ((client->build_major > 8)) {
@@ -979,27 +2483,24 @@ void futurerestore::doRestore(const char *ipsw){
 
     if (_enterPwnRecoveryRequested){
         if (!_client->image4supported) {
-            if (strncmp(client->version, "10.", 3))//if pwnrecovery send all components decrypted, unless we're dealing with iOS 10
+            if (strncmp(client->version, "10.", 3)) {//if pwnrecovery send all components decrypted, unless we're dealing with iOS 10
+                std::lock_guard<std::mutex> lock(gComponentOwnersLock);
+                gComponentOwners[client] = this;
                 client->recovery_custom_component_function = get_custom_component;
+            }
         }
     }else if (!_rerestoreiOS9){
         /* now we load the iBEC */
+        modeMark mark = markModeTransitions();
+        auto uploadStart = std::chrono::steady_clock::now();
         retassure(!recovery_send_ibec(client, build_identity),"ERROR: Unable to send iBEC\n");
+        noteUpload("iBEC", 0, uploadStart);
 
         printf("waiting for device to reconnect... ");
         recovery_client_free(client);
         
-        debug("Waiting for device to disconnect...\n");
-        mutex_unlock(&client->device_event_mutex);
-        cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-        /* retassure((client->mode == &idevicerestore_modes[MODE_UNKNOWN] || (mutex_unlock(&client->device_event_mutex),0)), "Device did not disconnect. Possibly invalid iBEC. Reset device and try again"); */
-        mutex_unlock(&client->device_event_mutex);
-
         debug("Waiting for device to reconnect...\n");
-        mutex_unlock(&client->device_event_mutex);
-        cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-        /* retassure((client->mode == &idevicerestore_modes[MODE_RECOVERY] || (mutex_unlock(&client->device_event_mutex),0)), "Device did not disconnect. Possibly invalid iBEC. Reset device and try again"); */
-        mutex_unlock(&client->device_event_mutex);
+        waitForModeTransition(mark, {MODE_UNKNOWN, MODE_RECOVERY}, 10000);
     }
 
     retassure(client->mode == &idevicerestore_modes[MODE_RECOVERY], "failed to reconnect to device in recovery (iBEC) mode\n");
@@ -1009,6 +2510,29 @@ void futurerestore::doRestore(const char *ipsw){
     get_ap_nonce(client, &client->nonce, &client->nonce_size);
     get_ecid(client, &client->ecid);
 
+    //with both nonces known the request needs nothing else from the device, so the signing server
+    //round trip overlaps with recovery_enter_restore instead of following it
+    std::future<plist_t> sepTicket;
+    if (_client->image4supported && client->nonce && client->sepnonce) {
+        debug("requesting SEP ticket in the background\n");
+        sepTicket = std::async(std::launch::async, [client, sep_build_identity]{
+            plist_t septss = NULL;
+            retassure(!get_tss_response(client, sep_build_identity, &septss), "ERROR: Unable to get signing tickets for SEP\n");
+            return septss;
+        });
+    }
+
+    if (preloadDone.valid()) {
+        auto waitStart = std::chrono::steady_clock::now();
+        if (preloadDone.get()) {
+            double waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+            info("[preload] restore components are served from '%s' (waited %.2fs)\n", _preloadDir.c_str(), waited);
+            free(client->ipsw);
+            client->ipsw = strdup(_preloadDir.c_str());
+        }
+    }
+
+    modeMark restoreMark = markModeTransitions();
     if (client->mode->index == MODE_RECOVERY) {
         retassure(client->srnm,"ERROR: could not retrieve device serial number. Can't continue.\n");
 
@@ -1023,110 +2547,228 @@ void futurerestore::doRestore(const char *ipsw){
 
     if (_client->image4supported) {
         info("getting SEP ticket\n");
-        retassure(!get_tss_response(client, sep_build_identity, &client->septss), "ERROR: Unable to get signing tickets for SEP\n");
+        if (sepTicket.valid()) {
+            auto waitStart = std::chrono::steady_clock::now();
+            client->septss = sepTicket.get();
+            debug("SEP ticket ready (waited %.2fs)\n", std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count());
+        } else {
+            retassure(!get_tss_response(client, sep_build_identity, &client->septss), "ERROR: Unable to get signing tickets for SEP\n");
+        }
         retassure(_client->sepfwdatasize && _client->sepfwdata, "SEP is not loaded, refusing to continue");
     }
     
-    mutex_lock(&client->device_event_mutex);
     debug("Waiting for device to enter restore mode...\n");
-    cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 180000);
-    retassure((client->mode == &idevicerestore_modes[MODE_RESTORE] || (mutex_unlock(&client->device_event_mutex),0)), "Device can't enter to restore mode");
-    mutex_unlock(&client->device_event_mutex);
+    retassure(waitForModeTransition(restoreMark, {MODE_RESTORE}, 180000), "Device can't enter to restore mode");
+
+    if (prewarm) {
+        uint64_t fssize = 0;
+        uint64_t resident = residentBytes(filesystem, &fssize);
+        info("[prewarm] %llu of %llu MB of the filesystem are in memory (budget %llu MB)\n", (unsigned long long)(resident >> 20), (unsigned long long)(fssize >> 20), (unsigned long long)(_prewarmBudget >> 20));
+    }
+
+    struct stat fsst = {0};
+    if (!stat(filesystem, &fsst)) _restoreFilesystemSize = (uint64_t)fsst.st_size;
+    //this replaces idevicerestore's progress bars, noteRestoreProgress prints its own
+    idevicerestore_set_progress_callback(client, restoreProgressCallback, this);
 
     info("About to restore device... \n");
-    int result = 0;
-    retassure(!(result = restore_device(client, build_identity, filesystem)), "ERROR: Unable to restore device\n");
+    int result = restore_device(client, build_identity, filesystem);
+    idevicerestore_set_progress_callback(client, NULL, NULL);
+    finishRestorePhase();
+    printRestoreSummary();
+    if (_remoteFilesystemMount) info("[remote] %llu MB of the filesystem were read outside the read-ahead window\n", (unsigned long long)(_remoteFilesystemMount->stream().directBytes() >> 20));
+    retassure(!result, "ERROR: Unable to restore device\n");
+    restored = true;
+    clearRestoreJournal();
 }
 
-int futurerestore::doJustBoot(const char *ipsw, string bootargs){
-    reterror("not implemented");
-//    int err = 0;
-//    //some memory might not get freed if this function throws an exception, but you probably don't want to catch that anyway.
-//
-//    struct idevicerestore_client_t* client = _client;
-//    int unused;
-//    int result = 0;
-//    plist_t buildmanifest = NULL;
-//    plist_t build_identity = NULL;
-//
-//    client->ipsw = strdup(ipsw);
-//
-//    getDeviceMode(true);
-//    info("Found device in %s mode\n", client->mode->string);
-//
-//    retassure((client->mode->index == MODE_DFU || client->mode->index == MODE_RECOVERY) && _enterPwnRecoveryRequested, "device not in DFU/Recovery mode\n");
-//
-//    // discover the device type
-//    retassure(check_hardware_model(client) && client->device,"ERROR: Unable to discover device model\n");
-//    info("Identified device as %s, %s\n", client->device->hardware_model, client->device->product_type);
-//
-//    // verify if ipsw file exists
-//    retassure(!access(client->ipsw, F_OK), "ERROR: Firmware file %s does not exist.\n", client->ipsw);
-//    info("Extracting BuildManifest from IPSW\n");
-//
-//    retassure(!ipsw_extract_build_manifest(client->ipsw, &buildmanifest, &unused),"ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
-//
-//    /* check if device type is supported by the given build manifest */
-//    retassure(!build_manifest_check_compatibility(buildmanifest, client->device->product_type),"ERROR: Could not make sure this firmware is suitable for the current device. Refusing to continue.\n");
-//
-//    /* print iOS information from the manifest */
-//    build_manifest_get_version_information(buildmanifest, client);
-//
-//    info("Product Version: %s\n", client->version);
-//    info("Product Build: %s Major: %d\n", client->build, client->build_major);
-//
-//    client->image4supported = is_image4_supported(client);
-//    info("Device supports Image4: %s\n", (client->image4supported) ? "true" : "false");
-//
-//    retassure(build_identity = getBuildidentityWithBoardconfig(buildmanifest, client->device->hardware_model, 0),"ERROR: Unable to find any build identities for IPSW\n");
-//
-//    /* print information about current build identity */
-//    build_identity_print_information(build_identity);
-//
-//    //check for enterpwnrecovery, because we could be in DFU mode
-//    retassure(_enterPwnRecoveryRequested, "enterPwnRecoveryRequested is not set, but required");
-//
-//    retassure(getDeviceMode(true) == MODE_DFU || getDeviceMode(false) == MODE_RECOVERY, "unexpected device mode\n");
-//
-//    enterPwnRecovery(build_identity, bootargs);
-//
-//    client->recovery_custom_component_function = get_custom_component;
-//
-//    for (int i=0;getDeviceMode(true) != MODE_RECOVERY && i<40; i++) putchar('.'),usleep(USEC_PER_SEC*0.5);
-//    putchar('\n');
-//
-//    retassure(check_mode(client), "failed to reconnect to device in recovery (iBEC) mode\n");
-//
-//    get_ecid(client, &client->ecid);
-//
-//    client->flags |= FLAG_BOOT;
-//
-//    if (client->mode->index == MODE_RECOVERY) {
-//        retassure(client->srnm,"ERROR: could not retrieve device serial number. Can't continue.\n");
-//
-//        retassure(!irecv_send_command(client->recovery->client, "bgcolor 0 255 0"), "ERROR: Unable to set bgcolor\n");
-//
-//        info("[WARNING] Setting bgcolor to green! If you don't see a green screen, then your device didn't boot iBEC correctly\n");
-//        sleep(2); //show the user a green screen!
-//        client->image4supported = true; //dirty hack to not require apticket
-//
-//        retassure(!recovery_enter_restore(client, build_identity),"ERROR: Unable to place device into restore mode\n");
-//
-//        client->image4supported = false;
-//        recovery_client_free(client);
-//    }
-//
-//    info("Cleaning up...\n");
-//
-//error:
-//    safeFree(client->sepfwdata);
-//    safeFreeCustom(buildmanifest, plist_free);
-//    if (!result && !err) info("DONE\n");
-//    return result ? abs(result) : err;
+#pragma mark tethered boot
+#define BOOT_CACHE_PATH FUTURERESTORE_CACHE_PATH"/boot"
+#define BOOT_PROFILE_NAME "Boot.plist"
+
+//one directory per iPSW, board and boot-args. It keeps everything sent after iBEC plus the build identity,
+//so together with the patched iBSS/iBEC cache a warm boot never opens the iPSW
+std::string futurerestore::bootCachePath(const char *ipsw, const std::string &bootargs){
+    struct stat st = {};
+    std::string input = ipsw;
+    input += '\0';
+    if (!stat(ipsw, &st)) input += std::to_string((long long)st.st_size) + ":" + std::to_string((long long)st.st_mtime);
+    input += '\0';
+    input += _client->device->hardware_model;
+    input += '\0';
+    input += bootargs;
+    input += '\0';
+    if (_client->image4supported && _im4ms.size()) input.append(_im4ms[0].first, _im4ms[0].second);
+
+    return std::string(BOOT_CACHE_PATH "/") + sha1Hex(input.data(), input.size());
+}
+
+//called by the component hooks with what they hand to idevicerestore, only does something while doJustBoot runs
+void futurerestore::cacheBootComponent(const char *component, const std::string &bytes){
+    if (_bootCacheDir.empty() || std::find(_bootComponents.begin(), _bootComponents.end(), component) != _bootComponents.end()) return;
+    mkdir_with_parents(_bootCacheDir.c_str(), 0755);
+    if (!writeFileAtomically(_bootCacheDir + "/" + component, bytes.data(), bytes.size())) {
+        debug("failed to cache %s for the next boot\n", component);
+        return;
+    }
+    _bootComponents.push_back(component);
+    _bootCacheDirty = true;
+}
+
+//only written after a successful boot, so every component it lists is one the device accepted
+void futurerestore::saveBootProfile(plist_t build_identity){
+    plist_t profile = NULL;
+    cleanup([&]{
+        safeFreeCustom(profile, plist_free);
+    });
+    if (!_bootCacheDirty) return;
+    profile = plist_new_dict();
+    plist_dict_set_item(profile, "Version", plist_new_string(_client->version));
+    plist_dict_set_item(profile, "Build", plist_new_string(_client->build));
+    plist_dict_set_item(profile, "BuildMajor", plist_new_uint(_client->build_major));
+    plist_dict_set_item(profile, "BuildIdentity", plist_copy(build_identity));
+    plist_t components = plist_new_array();
+    for (auto &component : _bootComponents) plist_array_append_item(components, plist_new_string(component.c_str()));
+    plist_dict_set_item(profile, "Components", components);
+    mkdir_with_parents(_bootCacheDir.c_str(), 0755);
+    if (!writeBinaryPlist(profile, _bootCacheDir + "/" BOOT_PROFILE_NAME)) debug("failed to save boot profile in %s\n", _bootCacheDir.c_str());
+}
+
+int futurerestore::doJustBoot(const char *ipsw, string bootargs, bool onlyEnterPwnRecovery){
+#ifndef HAVE_LIBIPATCHER
+    reterror("compiled without libipatcher");
+#else
+    struct idevicerestore_client_t* client = _client;
+    plist_t buildmanifest = NULL;
+    plist_t bootProfile = NULL;
+    plist_t cachedIdentity = NULL;
+    plist_t build_identity = NULL;
+    cleanup([&]{
+        safeFreeCustom(buildmanifest, plist_free);
+        safeFreeCustom(bootProfile, plist_free);
+        safeFreeCustom(cachedIdentity, plist_free);
+        _bootCacheDir.clear();
+    });
+    auto bootStart = std::chrono::steady_clock::now();
+
+    retassure(_enterPwnRecoveryRequested, "--just-boot requires --use-pwndfu\n");
+    retassure(!remoteipsw::isRemote(ipsw), "--just-boot needs a local iPSW\n");
+    client->ipsw = strdup(ipsw);
+    client->flags |= FLAG_BOOT;
+
+    subscribeDeviceEvents();
+    retassure(waitForDeviceMode(10000), "Unable to discover device mode. Please make sure a device is attached.\n");
+    retassure(client->mode->index == MODE_DFU || client->mode->index == MODE_RECOVERY, "device not in DFU/Recovery mode\n");
+    info("Found device in %s mode\n", client->mode->string);
+    info("Identified device as %s, %s\n", getDeviceBoardNoCopy(), getDeviceModelNoCopy());
+
+    client->image4supported = _transport->isImage4Supported();
+    if (client->image4supported) {
+        retassure(_aptickets.size() && _im4ms.size(), "64-bit devices need an APTicket with a generator to boot\n");
+        client->tss = _aptickets.at(0);
+    }
+
+    _bootCacheDir = bootCachePath(ipsw, bootargs);
+    _bootComponents.clear();
+    _bootCacheDirty = false;
+    std::string profilePath = _bootCacheDir + "/" BOOT_PROFILE_NAME;
+    if (!access(profilePath.c_str(), F_OK) && (bootProfile = loadPlistFromFile(profilePath.c_str()))) {
+        plist_t identity = plist_dict_get_item(bootProfile, "BuildIdentity");
+        plist_t components = plist_dict_get_item(bootProfile, "Components");
+        plist_t buildMajor = plist_dict_get_item(bootProfile, "BuildMajor");
+        std::string version = plistStringValue(plist_dict_get_item(bootProfile, "Version"));
+        std::string build = plistStringValue(plist_dict_get_item(bootProfile, "Build"));
+        std::vector<std::string> names;
+        bool complete = identity && components && plist_get_node_type(components) == PLIST_ARRAY && buildMajor && plist_get_node_type(buildMajor) == PLIST_UINT && version.size() && build.size();
+        for (uint32_t i=0; complete && i<plist_array_get_size(components); i++) {
+            std::string name = plistStringValue(plist_array_get_item(components, i));
+            complete = name.size() && !access((_bootCacheDir + "/" + name).c_str(), F_OK);
+            names.push_back(name);
+        }
+        if (complete) {
+            uint64_t major = 0;
+            plist_get_uint_val(buildMajor, &major);
+            client->version = strdup(version.c_str());
+            client->build = strdup(build.c_str());
+            client->build_major = (int)major;
+            build_identity = cachedIdentity = plist_copy(identity);
+            for (auto &name : names) {
+                std::string path = _bootCacheDir + "/" + name;
+                _preparedComponents[name] = std::async(std::launch::async, [path]{
+                    std::string bytes;
+                    retassure(readWholeFile(path, bytes), "failed to read cached component %s\n", path.c_str());
+                    return bytes;
+                }).share();
+                _bootComponents.push_back(name);
+            }
+            info("Booting from cache %s (%zu components)\n", _bootCacheDir.c_str(), names.size());
+        } else {
+            debug("ignoring incomplete boot profile %s\n", profilePath.c_str());
+        }
+    }
+
+    if (!build_identity) {
+        _bootCacheDirty = true;
+        retassure(!access(client->ipsw, F_OK), "ERROR: Firmware file %s does not exist.\n", client->ipsw);
+        info("Extracting BuildManifest from iPSW\n");
+        {
+            char *manifestBuf = NULL;
+            cleanup([&]{
+                safeFree(manifestBuf);
+            });
+            uint32_t manifestSize = 0;
+            retassure(!ipsw_extract_to_memory(client->ipsw, "BuildManifest.plist", (unsigned char**)&manifestBuf, &manifestSize),"ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
+            retassure(buildmanifest = loadBuildManifestForBoard(manifestBuf, manifestSize, client->device->hardware_model, 0),"ERROR: Unable to parse BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
+        }
+        retassure(!build_manifest_check_compatibility(buildmanifest, client->device->product_type),"ERROR: Could not make sure this firmware is suitable for the current device. Refusing to continue.\n");
+        build_manifest_get_version_information(buildmanifest, client);
+        retassure(build_identity = getBuildidentityWithBoardconfig(buildmanifest, client->device->hardware_model, 0),"ERROR: Unable to find any build identities for iPSW\n");
+        if (!client->image4supported) prepareDecryptedComponents(build_identity);
+    }
+    info("Product version: %s\n", client->version);
+    info("Product build: %s Major: %d\n", client->build, client->build_major);
+
+    enterPwnRecovery(build_identity, bootargs);
+    if (onlyEnterPwnRecovery) {
+        //booting the rest goes through idevicerestore's own USB code, which only works with a real device
+        _transport->close();
+        info("[boot] entered pwned recovery in %.2fs\n", std::chrono::duration<double>(std::chrono::steady_clock::now() - bootStart).count());
+        return 0;
+    }
+
+    //32-bit devices get everything decrypted, 64-bit ones get it stitched by idevicerestore
+    if (client->image4supported) {
+        serveComponentsFromMemory();
+    } else {
+        {
+            std::lock_guard<std::mutex> lock(gComponentOwnersLock);
+            gComponentOwners[client] = this;
+        }
+        client->recovery_custom_component_function = get_custom_component;
+    }
+
+    retassure(_transport->sendCommand("bgcolor 0 255 0"), "ERROR: Unable to set bgcolor\n");
+    info("[WARNING] Setting bgcolor to green! If you don't see a green screen, then your device didn't boot iBEC correctly\n");
+
+    bool image4supported = client->image4supported;
+    client->image4supported = true; //dirty hack to not require apticket
+    int result = recovery_enter_restore(client, build_identity);
+    client->image4supported = image4supported;
+    retassure(!result, "ERROR: Unable to boot device\n");
+    _transport->close();
+
+    saveBootProfile(build_identity);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - bootStart).count();
+    info("[boot] booted %s in %.2fs from %s\n", client->build, seconds, (cachedIdentity) ? "cache" : "iPSW");
+    return 0;
+#endif
 }
 
 futurerestore::~futurerestore(){
-    recovery_client_free(_client);
+    if (_remoteIPSW) _remoteIPSW->cancel();
+    //the transport's callback points at us
+    if (_didSubscribeEvents) _transport->unsubscribe();
+    _transport->close();
     idevicerestore_client_free(_client);
     for (auto im4m : _im4ms){
         safeFree(im4m.first);
@@ -1141,6 +2783,15 @@ futurerestore::~futurerestore(){
     }
     safeFreeCustom(_sepbuildmanifest, plist_free);
     safeFreeCustom(_basebandbuildmanifest, plist_free);
+    safeFreeCustom(_deviceProfile, plist_free);
+    safeFreeCustom(_restoreJournal, plist_free);
+    {
+        std::lock_guard<std::mutex> lock(gComponentOwnersLock);
+        gComponentOwners.erase(_client);
+    }
+    //unmount before the session directory containing the mount point goes away
+    _remoteFilesystemMount = NULL;
+    if (_sessionDir.size()) removeDirectory(_sessionDir);
 }
 
 void futurerestore::loadFirmwareTokens(){
@@ -1152,52 +2803,40 @@ void futurerestore::loadFirmwareTokens(){
     }
 }
 
-const char *futurerestore::getDeviceModelNoCopy(){
-    if (!_client->device || !_client->device->product_type){
-
-        int mode = getDeviceMode(true);
-        retassure(mode == MODE_NORMAL || mode == MODE_RECOVERY || mode == MODE_DFU, "unexpected device mode=%d\n",mode);
-        
-        switch (mode) {
-        case MODE_RESTORE:
-            _client->device = restore_get_irecv_device(_client);
-            break;
-        case MODE_NORMAL:
-            _client->device = normal_get_irecv_device(_client);
-            break;
-        case MODE_DFU:
-        case MODE_RECOVERY:
-            _client->device = dfu_get_irecv_device(_client);
-            break;
-        default:
-            break;
+void futurerestore::loadDevice(){
+    if (_client->device && _client->device->product_type) return;
+
+    //the board uniquely identifies the device, a product type may map to several
+    char *board = NULL;
+    plist_t node = (_deviceProfile) ? plist_dict_get_item(_deviceProfile, "HardwareModel") : NULL;
+    if (node && plist_get_node_type(node) == PLIST_STRING) plist_get_string_val(node, &board);
+    if (board) {
+        irecv_device_t device = NULL;
+        if (irecv_devices_get_device_by_hardware_model(board, &device) == IRECV_E_SUCCESS && device && device->product_type) {
+            debug("Using device %s (%s) from device profile\n", device->product_type, device->hardware_model);
+            _client->device = device;
         }
+        free(board);
+        if (_client->device) return;
     }
 
+    int mode = getDeviceMode(true);
+    retassure(mode == MODE_NORMAL || mode == MODE_RECOVERY || mode == MODE_DFU, "unexpected device mode=%d\n",mode);
+    
+    _client->device = _transport->getDevice(mode);
+    retassure(_client->device && _client->device->product_type, "failed to identify device\n");
+    setProfileString("ProductType", _client->device->product_type);
+    setProfileString("HardwareModel", _client->device->hardware_model);
+    setProfileUint("CPID", _client->device->chip_id);
+}
+
+const char *futurerestore::getDeviceModelNoCopy(){
+    loadDevice();
     return _client->device->product_type;
 }
 
 const char *futurerestore::getDeviceBoardNoCopy(){
-    if (!_client->device || !_client->device->product_type){
-
-        int mode = getDeviceMode(true);
-        retassure(mode == MODE_NORMAL || mode == MODE_RECOVERY || mode == MODE_DFU, "unexpected device mode=%d\n",mode);
-        
-        switch (mode) {
-        case MODE_RESTORE:
-            _client->device = restore_get_irecv_device(_client);
-            break;
-        case MODE_NORMAL:
-            _client->device = normal_get_irecv_device(_client);
-            break;
-        case MODE_DFU:
-        case MODE_RECOVERY:
-            _client->device = dfu_get_irecv_device(_client);
-            break;
-        default:
-            break;
-        }
-    }
+    loadDevice();
     return _client->device->hardware_model;
 }
 
@@ -1327,7 +2966,7 @@ void futurerestore::downloadLatestRose(){
     if(roseStr) {
         info("downloading Rose firmware\n\n");
         char roseStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
+        const char *tmp = _firmwaresTmpPath.c_str();
         sprintf(roseStr1, "%s%s", tmp, roseStr);
         std::string rose(roseStr1);
         size_t pos = rose.find_last_of('/');
@@ -1345,7 +2984,7 @@ void futurerestore::downloadLatestSE(){
     if(seStr) {
         info("downloading SE firmware\n\n");
         char seStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
+        const char *tmp = _firmwaresTmpPath.c_str();
         sprintf(seStr1, "%s%s", tmp, seStr);
         std::string se(seStr1);
         size_t pos = se.find_last_of('/');
@@ -1372,8 +3011,8 @@ void futurerestore::downloadLatestSavage(){
     if(savageB0DevStr) {
         info("downloading Savage,B0-Dev-Patch\n\n");
         char savageB0DevStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(savageB0DevStr1, "%s%s", FIRMWARES_TMP_PATH, savageB0DevStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(savageB0DevStr1, "%s%s", tmp, savageB0DevStr);
         std::string savage(savageB0DevStr1);
         size_t pos = savage.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1385,8 +3024,8 @@ void futurerestore::downloadLatestSavage(){
     if(savageB0DevVTStr) {
         info("downloading Savage,B0-Dev-PatchVT\n\n");
         char savageB0DevVTStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(savageB0DevVTStr1, "%s%s", FIRMWARES_TMP_PATH, savageB0DevVTStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(savageB0DevVTStr1, "%s%s", tmp, savageB0DevVTStr);
         std::string savage(savageB0DevVTStr1);
         size_t pos = savage.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1398,8 +3037,8 @@ void futurerestore::downloadLatestSavage(){
     if(savageB0ProdStr) {
         info("downloading Savage,B0-Prod-Patch\n\n");
         char savageB0ProdStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(savageB0ProdStr1, "%s%s", FIRMWARES_TMP_PATH, savageB0ProdStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(savageB0ProdStr1, "%s%s", tmp, savageB0ProdStr);
         std::string savage(savageB0ProdStr1);
         size_t pos = savage.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1411,8 +3050,8 @@ void futurerestore::downloadLatestSavage(){
     if(savageB0ProdVTStr) {
         info("downloading Savage,B0-Prod-PatchVT\n\n");
         char savageB0ProdVTStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(savageB0ProdVTStr1, "%s%s", FIRMWARES_TMP_PATH, savageB0ProdVTStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(savageB0ProdVTStr1, "%s%s", tmp, savageB0ProdVTStr);
         std::string savage(savageB0ProdVTStr1);
         size_t pos = savage.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1424,8 +3063,8 @@ void futurerestore::downloadLatestSavage(){
     if(savageB2DevStr) {
         info("downloading Savage,B2-Dev-Patch\n\n");
         char savageB2DevStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(savageB2DevStr1, "%s%s", FIRMWARES_TMP_PATH, savageB2DevStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(savageB2DevStr1, "%s%s", tmp, savageB2DevStr);
         std::string savage(savageB2DevStr1);
         size_t pos = savage.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1437,8 +3076,8 @@ void futurerestore::downloadLatestSavage(){
     if(savageB2DevVTStr) {
         info("downloading Savage,B2-Dev-PatchV\n\n");
         char savageB2DevVTStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(savageB2DevVTStr1, "%s%s", FIRMWARES_TMP_PATH, savageB2DevVTStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(savageB2DevVTStr1, "%s%s", tmp, savageB2DevVTStr);
         std::string savage(savageB2DevVTStr1);
         size_t pos = savage.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1450,8 +3089,8 @@ void futurerestore::downloadLatestSavage(){
     if(savageB2ProdStr) {
         info("downloading Savage,B2-Prod-Patch\n\n");
         char savageB2ProdStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(savageB2ProdStr1, "%s%s", FIRMWARES_TMP_PATH, savageB2ProdStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(savageB2ProdStr1, "%s%s", tmp, savageB2ProdStr);
         std::string savage(savageB2ProdStr1);
         size_t pos = savage.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1463,8 +3102,8 @@ void futurerestore::downloadLatestSavage(){
     if(savageB2ProdVTStr) {
         info("downloading Savage,B2-Prod-PatchVT\n\n");
         char savageB2ProdVTStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(savageB2ProdVTStr1, "%s%s", FIRMWARES_TMP_PATH, savageB2ProdVTStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(savageB2ProdVTStr1, "%s%s", tmp, savageB2ProdVTStr);
         std::string savage(savageB2ProdVTStr1);
         size_t pos = savage.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1476,8 +3115,8 @@ void futurerestore::downloadLatestSavage(){
     if(savageBADevStr) {
         info("downloading Savage,BA-Dev-Patch\n\n");
         char savageBADevStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(savageBADevStr1, "%s%s", FIRMWARES_TMP_PATH, savageBADevStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(savageBADevStr1, "%s%s", tmp, savageBADevStr);
         std::string savage(savageBADevStr1);
         size_t pos = savage.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1489,8 +3128,8 @@ void futurerestore::downloadLatestSavage(){
     if(savageBAProdStr) {
         info("downloading Savage,BA-Prod-Patch\n\n");
         char savageBAProdStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(savageBAProdStr1, "%s%s", FIRMWARES_TMP_PATH, savageBAProdStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(savageBAProdStr1, "%s%s", tmp, savageBAProdStr);
         std::string savage(savageBAProdStr1);
         size_t pos = savage.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1508,8 +3147,8 @@ void futurerestore::downloadLatestVeridian(){
     if(veridianStr) {
         info("downloading Veridian DigestMap\n\n");
         char veridianStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(veridianStr1, "%s%s", FIRMWARES_TMP_PATH, veridianStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(veridianStr1, "%s%s", tmp, veridianStr);
         std::string veridian(veridianStr1);
         size_t pos = veridian.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1521,8 +3160,8 @@ void futurerestore::downloadLatestVeridian(){
     if(veridianFWMStr) {
         info("downloading Veridian FirmwareMap\n\n");
         char veridianFWMStr1[PATH_MAX];
-        char *tmp = FIRMWARES_TMP_PATH;
-        sprintf(veridianFWMStr1, "%s%s", FIRMWARES_TMP_PATH, veridianFWMStr);
+        const char *tmp = _firmwaresTmpPath.c_str();
+        sprintf(veridianFWMStr1, "%s%s", tmp, veridianFWMStr);
         std::string veridian(veridianFWMStr1);
         size_t pos = veridian.find_last_of('/');
         if (pos != std::string::npos) {
@@ -1535,18 +3174,19 @@ void futurerestore::downloadLatestVeridian(){
 
 void futurerestore::downloadLatestFirmwareComponents(){
     info("Downloading the latest firmware components...\n");
-    __mkdir(FIRMWARES_TMP_PATH, 0755);
+    const char *firmwaresDir = _firmwaresTmpPath.c_str();
+    __mkdir(firmwaresDir, 0755);
     char zip_name[PATH_MAX];
-    sprintf(zip_name, "%s/%s", FUTURERESTORE_TMP_PATH, "Firmwares.ipsw");
+    sprintf(zip_name, "%s/%s", _sessionDir.c_str(), FIRMWARES_ZIP_TMP_NAME);
     unlink(zip_name);
     downloadLatestRose();
     downloadLatestSE();
     downloadLatestSavage();
     downloadLatestVeridian();
-    zip_directory(FIRMWARES_TMP_PATH, zip_name);
-    rmdir(FIRMWARES_TMP_PATH); //remove the dir if its empty so zip won't fail
+    zip_directory(firmwaresDir, zip_name);
+    rmdir(firmwaresDir); //remove the dir if its empty so zip won't fail
     struct stat st{0};
-    if(!stat(FIRMWARES_TMP_PATH, &st))
+    if(!stat(firmwaresDir, &st))
     {
         retassure(!stat(zip_name, &st), "could not zip Firmwares to ipsw\n");
         char *firmware_zip = zip_name;
@@ -1559,28 +3199,28 @@ void futurerestore::loadLatestBaseband(){
     char * manifeststr = getLatestManifest();
     char *pathStr = getPathOfElementInManifest("BasebandFirmware", manifeststr, getDeviceBoardNoCopy(), 0);
     info("downloading Baseband\n\n");
-    retassure(!downloadPartialzip(getLatestFirmwareUrl(), pathStr, _basebandPath = BASEBAND_TMP_PATH), "could not download baseband\n");
-    saveStringToFile(manifeststr, BASEBAND_MANIFEST_TMP_PATH);
-    setBasebandManifestPath(BASEBAND_MANIFEST_TMP_PATH);
-    setBasebandPath(BASEBAND_TMP_PATH);
+    retassure(!downloadPartialzip(getLatestFirmwareUrl(), pathStr, _basebandPath = _basebandTmpPath.c_str()), "could not download baseband\n");
+    saveStringToFile(manifeststr, _basebandManifestTmpPath.c_str());
+    setBasebandManifestPath(_basebandManifestTmpPath.c_str());
+    setBasebandPath(_basebandTmpPath.c_str());
 }
 
 void futurerestore::loadLatestSep(){
     char * manifeststr = getLatestManifest();
     char *pathStr = getPathOfElementInManifest("SEP", manifeststr, getDeviceBoardNoCopy(), 0);
     info("downloading SEP\n\n");
-    retassure(!downloadPartialzip(getLatestFirmwareUrl(), pathStr, SEP_TMP_PATH), "could not download SEP\n");
-    loadSep(SEP_TMP_PATH);
-    saveStringToFile(manifeststr, SEP_MANIFEST_TMP_PATH);
-    setSepManifestPath(SEP_MANIFEST_TMP_PATH);
+    retassure(!downloadPartialzip(getLatestFirmwareUrl(), pathStr, _sepTmpPath.c_str()), "could not download SEP\n");
+    loadSep(_sepTmpPath.c_str());
+    saveStringToFile(manifeststr, _sepManifestTmpPath.c_str());
+    setSepManifestPath(_sepManifestTmpPath.c_str());
 }
 
 void futurerestore::setSepManifestPath(const char *sepManifestPath){
-    retassure(_sepbuildmanifest = loadPlistFromFile(_sepbuildmanifestPath = sepManifestPath), "failed to load SEPManifest");
+    retassure(_sepbuildmanifest = loadBuildManifestFromFile(_sepbuildmanifestPath = sepManifestPath, getDeviceBoardNoCopy(), _isUpdateInstall), "failed to load SEPManifest");
 }
 
 void futurerestore::setBasebandManifestPath(const char *basebandManifestPath){
-    retassure(_basebandbuildmanifest = loadPlistFromFile(_basebandbuildmanifestPath = basebandManifestPath), "failed to load BasebandManifest");
+    retassure(_basebandbuildmanifest = loadBuildManifestFromFile(_basebandbuildmanifestPath = basebandManifestPath, getDeviceBoardNoCopy(), _isUpdateInstall), "failed to load BasebandManifest");
 };
 
 void futurerestore::loadSep(const char *sepPath){
@@ -1608,6 +3248,325 @@ void futurerestore::setBasebandPath(const char *basebandPath){
     fclose(fbb);
 }
 
+#pragma mark catalog
+#define IPSW_CATALOGS_PATH FUTURERESTORE_CACHE_PATH"/catalogs"
+
+//catalogs live in the cache rather than next to the iPSWs, so read-only and shared directories get one too
+static std::string catalogPathForDirectory(const char *catalogDir){
+    std::string dir = catalogDir;
+#ifdef WIN32
+    char *resolved = _fullpath(NULL, catalogDir, 0);
+#else
+    char *resolved = realpath(catalogDir, NULL);
+#endif
+    if (resolved) dir = resolved;
+    safeFree(resolved);
+    return std::string(IPSW_CATALOGS_PATH "/") + sha1Hex(dir.data(), dir.size()) + ".plist";
+}
+
+static void findIPSWsInDirectory(const std::string &dir, const std::string &relpath, vector<std::string> &found){
+    std::string curdir = (relpath.size()) ? dir + "/" + relpath : dir;
+    DIR *dp = ::opendir(curdir.c_str());
+    if (!dp) {
+        error("[catalog] failed to open directory %s: %s\n",curdir.c_str(),strerror(errno));
+        return;
+    }
+    struct dirent *dirp;
+    while ((dirp = readdir(dp)) != NULL) {
+        std::string name = dirp->d_name;
+        if (name == "." || name == "..") continue;
+        std::string rel = (relpath.size()) ? relpath + "/" + name : name;
+        struct stat st{0};
+        if (stat((dir + "/" + rel).c_str(), &st)) continue;
+        if (S_ISDIR(st.st_mode)) {
+            findIPSWsInDirectory(dir, rel, found);
+        } else if (name.size() > 5 && !strcasecmp(name.c_str() + name.size() - 5, ".ipsw")) {
+            found.push_back(rel);
+        }
+    }
+    ::closedir(dp);
+}
+
+static plist_t catalogEntryForIPSW(const std::string &ipswPath, const struct stat &st){
+    plist_t buildmanifest = NULL;
+    unsigned char *buf = NULL;
+    unsigned int bufSize = 0;
+    cleanup([&]{
+        safeFree(buf);
+        safeFreeCustom(buildmanifest, plist_free);
+    });
+
+    //only reads the zip central directory and the BuildManifest entry
+    if (ipsw_extract_to_memory(ipswPath.c_str(), "BuildManifest.plist", &buf, &bufSize) || !bufSize) return NULL;
+    plist_from_memory((const char*)buf, bufSize, &buildmanifest);
+    if (!buildmanifest) return NULL;
+
+    plist_t identities = plist_dict_get_item(buildmanifest, "BuildIdentities");
+    if (!identities || plist_get_node_type(identities) != PLIST_ARRAY) return NULL;
+
+    plist_t entry = plist_new_dict();
+    plist_dict_set_item(entry, "Size", plist_new_uint(st.st_size));
+    plist_dict_set_item(entry, "ModTime", plist_new_uint(st.st_mtime));
+    for (const char *key : {"ProductVersion", "ProductBuildVersion", "SupportedProductTypes"}) {
+        if (plist_t node = plist_dict_get_item(buildmanifest, key))
+            plist_dict_set_item(entry, key, plist_copy(node));
+    }
+
+    //keep everything needed to match a ticket, but only the digests of the components
+    plist_t slimIdentities = plist_new_array();
+    for (uint32_t i=0; i<plist_array_get_size(identities); i++) {
+        plist_t identity = plist_array_get_item(identities, i);
+        plist_t manifest = plist_dict_get_item(identity, "Manifest");
+        if (!manifest) continue;
+
+        plist_t slimManifest = plist_new_dict();
+        plist_dict_iter iter = NULL;
+        plist_dict_new_iter(manifest, &iter);
+        while (true) {
+            char *key = NULL;
+            plist_t node = NULL;
+            plist_dict_next_item(manifest, iter, &key, &node);
+            if (!key) break;
+            plist_t slimNode = plist_new_dict();
+            for (const char *nodeKey : {"Digest", "Trusted", "Info"}) {
+                if (plist_t val = plist_dict_get_item(node, nodeKey))
+                    plist_dict_set_item(slimNode, nodeKey, plist_copy(val));
+            }
+            plist_dict_set_item(slimManifest, key, slimNode);
+            free(key);
+        }
+        safeFree(iter);
+
+        plist_t slimIdentity = plist_copy(identity);
+        plist_dict_set_item(slimIdentity, "Manifest", slimManifest);
+        plist_array_append_item(slimIdentities, slimIdentity);
+    }
+    plist_dict_set_item(entry, "BuildIdentities", slimIdentities);
+    return entry;
+}
+
+plist_t futurerestore::updateIPSWCatalog(const char *catalogDir){
+    std::string catalogPath = catalogPathForDirectory(catalogDir);
+    plist_t oldCatalog = (access(catalogPath.c_str(), F_OK) == 0) ? loadPlistFromFile(catalogPath.c_str()) : NULL;
+    cleanup([&]{
+        safeFreeCustom(oldCatalog, plist_free);
+    });
+    plist_t oldIPSWs = (oldCatalog) ? plist_dict_get_item(oldCatalog, "IPSWs") : NULL;
+
+    vector<std::string> ipsws;
+    findIPSWsInDirectory(catalogDir, "", ipsws);
+    info("[catalog] found %zu iPSWs in %s\n",ipsws.size(),catalogDir);
+
+    //reuse entries of unchanged files, index the others concurrently
+    vector<plist_t> entries(ipsws.size(), NULL);
+    vector<size_t> toIndex;
+    for (size_t i=0; i<ipsws.size(); i++) {
+        struct stat st{0};
+        if (stat((std::string(catalogDir) + "/" + ipsws[i]).c_str(), &st)) continue;
+        plist_t old = (oldIPSWs) ? plist_dict_get_item(oldIPSWs, ipsws[i].c_str()) : NULL;
+        uint64_t size = 0, mtime = 0;
+        if (old) {
+            plist_get_uint_val(plist_dict_get_item(old, "Size"), &size);
+            plist_get_uint_val(plist_dict_get_item(old, "ModTime"), &mtime);
+        }
+        if (old && size == (uint64_t)st.st_size && mtime == (uint64_t)st.st_mtime)
+            entries[i] = plist_copy(old);
+        else
+            toIndex.push_back(i);
+    }
+
+    parallelFor(toIndex.size(), [&](size_t i){
+        size_t idx = toIndex[i];
+        std::string path = std::string(catalogDir) + "/" + ipsws[idx];
+        struct stat st{0};
+        if (stat(path.c_str(), &st)) return;
+        if (!(entries[idx] = catalogEntryForIPSW(path, st)))
+            error("[catalog] failed to read BuildManifest from %s\n",path.c_str());
+    });
+
+    plist_t catalog = plist_new_dict();
+    plist_t newIPSWs = plist_new_dict();
+    size_t indexed = 0;
+    for (size_t i=0; i<ipsws.size(); i++) {
+        if (!entries[i]) continue;
+        plist_dict_set_item(newIPSWs, ipsws[i].c_str(), entries[i]);
+        indexed++;
+    }
+    plist_dict_set_item(catalog, "Directory", plist_new_string(catalogDir));
+    plist_dict_set_item(catalog, "IPSWs", newIPSWs);
+    info("[catalog] indexed %zu new or changed iPSWs, catalog contains %zu iPSWs\n",toIndex.size(),indexed);
+
+    mkdir_with_parents(IPSW_CATALOGS_PATH, 0755);
+    if (writeBinaryPlist(catalog, catalogPath))
+        info("[catalog] saved catalog of %s to %s\n",catalogDir,catalogPath.c_str());
+    else
+        warning("[catalog] could not save catalog to %s, continuing with in-memory catalog\n",catalogPath.c_str());
+
+    return catalog;
+}
+
+const char *futurerestore::getIPSWFromCatalog(const char *catalogDir){
+    retassure(_im4ms.size(), "No APTicket loaded\n");
+    ptr_smart<plist_t> catalog(updateIPSWCatalog(catalogDir),plist_free);
+    plist_t ipsws = plist_dict_get_item(catalog._p, "IPSWs");
+
+    const char *productType = getDeviceModelNoCopy();
+    const char *boardConfig = getDeviceBoardNoCopy();
+    const char *restoreBehavior = (_isUpdateInstall) ? "Update" : "Erase";
+
+    plist_dict_iter iter = NULL;
+    plist_dict_new_iter(ipsws, &iter);
+    cleanup([&]{
+        safeFree(iter);
+    });
+    while (true) {
+        char *key = NULL;
+        plist_t entry = NULL;
+        plist_dict_next_item(ipsws, iter, &key, &entry);
+        if (!key) break;
+        std::string ipswName = key;
+        free(key);
+
+        bool supportsDevice = false;
+        plist_t productTypes = plist_dict_get_item(entry, "SupportedProductTypes");
+        for (uint32_t i=0; productTypes && i<plist_array_get_size(productTypes) && !supportsDevice; i++) {
+            char *pt = NULL;
+            plist_get_string_val(plist_array_get_item(productTypes, i), &pt);
+            supportsDevice = (pt && !strcmp(pt, productType));
+            safeFree(pt);
+        }
+        if (!supportsDevice) continue;
+
+        plist_t identities = plist_dict_get_item(entry, "BuildIdentities");
+        for (uint32_t i=0; i<plist_array_get_size(identities); i++) {
+            plist_t identity = plist_array_get_item(identities, i);
+            plist_t identityInfo = plist_dict_get_item(identity, "Info");
+            char *deviceClass = NULL;
+            char *behavior = NULL;
+            plist_get_string_val(plist_dict_get_item(identityInfo, "DeviceClass"), &deviceClass);
+            plist_get_string_val(plist_dict_get_item(identityInfo, "RestoreBehavior"), &behavior);
+            bool isCandidate = deviceClass && behavior && !strcasecmp(deviceClass, boardConfig) && !strcmp(behavior, restoreBehavior);
+            safeFree(deviceClass);
+            safeFree(behavior);
+            if (!isCandidate) continue;
+
+            plist_t manifest = plist_dict_get_item(identity, "Manifest");
+            for (auto im4m : _im4ms) {
+                //cheap digest lookup first, full ticket match only for candidates
+                const char *lookupComponent = (_client->image4supported) ? "KernelCache" : "RestoreRamDisk";
+                plist_t digestNode = plist_dict_get_item(plist_dict_get_item(manifest, lookupComponent), "Digest");
+                uint64_t digestSize = 0;
+                const char *digest = (digestNode) ? plist_get_data_ptr(digestNode, &digestSize) : NULL;
+                if (!digest || !digestSize) continue;
+
+                bool found = false;
+                if (_client->image4supported) {
+                    if (std::search(im4m.first, im4m.first + im4m.second, digest, digest + digestSize) == im4m.first + im4m.second) continue;
+                    ptr_smart<plist_t> pseudoManifest(plist_new_dict(),plist_free);
+                    plist_t pseudoIdentities = plist_new_array();
+                    plist_array_append_item(pseudoIdentities, plist_copy(identity));
+                    plist_dict_set_item(pseudoManifest._p, "BuildIdentities", pseudoIdentities);
+                    found = (getBuildIdentityForIM4M(im4m, pseudoManifest._p) != NULL);
+                } else {
+                    try {
+                        auto ticketHash = getRamdiskHashFromSCAB(im4m.first, im4m.second);
+                        found = (ticketHash.second == digestSize && !memcmp(ticketHash.first, digest, digestSize));
+                    } catch (tihmstar::exception &e) {
+                        //
+                    }
+                }
+                if (found) {
+                    _catalogIPSWPath = std::string(catalogDir) + "/" + ipswName;
+                    info("[catalog] selected %s for APTicket (%s install)\n",_catalogIPSWPath.c_str(),restoreBehavior);
+                    return _catalogIPSWPath.c_str();
+                }
+            }
+        }
+    }
+    reterror("could not find an iPSW in catalog %s matching the APTicket for %s (%s install)\n",catalogDir,productType,restoreBehavior);
+    return NULL;
+}
+
+#pragma mark plist loading
+#define PLIST_SIDECAR_PATH FUTURERESTORE_CACHE_PATH"/plist"
+
+mappedFile::mappedFile(const char *path){
+    //the destructor doesn't run for a constructor that throws
+    bool didConstruct = false;
+    cleanup([&]{
+        if (didConstruct) return;
+        safeFree(_buf);
+        if (_fd != -1) close(_fd);
+        _fd = -1;
+    });
+#ifdef WIN32
+    retassure((_fd = open(path, O_RDONLY | O_BINARY)) != -1, "could not open file %s\n",path);
+#else
+    retassure((_fd = open(path, O_RDONLY)) != -1, "could not open file %s\n",path);
+#endif
+    struct stat st = {};
+    retassure(!fstat(_fd, &st), "could not stat file %s\n",path);
+    _size = st.st_size;
+#ifndef WIN32
+    void *map = (_size) ? mmap(NULL, _size, PROT_READ, MAP_PRIVATE, _fd, 0) : MAP_FAILED;
+    if (map != MAP_FAILED) {
+        _buf = (char*)map;
+        _mapped = true;
+    }
+#endif
+    if (_size && !_mapped) {
+        retassure(_buf = (char*)malloc(_size), "failed to alloc memory\n");
+        for (size_t done = 0; done < _size;) {
+            ssize_t didRead = read(_fd, _buf+done, _size-done);
+            retassure(didRead > 0, "failed to read %s\n",path);
+            done += didRead;
+        }
+    }
+    didConstruct = true;
+}
+
+mappedFile::~mappedFile(){
+#ifndef WIN32
+    if (_mapped) {
+        munmap(_buf, _size);
+        _buf = NULL;
+    }
+#endif
+    safeFree(_buf);
+    if (_fd != -1) close(_fd);
+}
+
+//sidecars are named after the SHA1 of the source, so an edited source never hits a stale one
+static std::string plistSidecarPath(const mappedFile &file, const char *variant = NULL){
+    std::string ret = std::string(PLIST_SIDECAR_PATH "/") + sha1Hex(file.buf(), file.size());
+    if (variant) {
+        std::string lowerVariant = variant;
+        std::transform(lowerVariant.begin(), lowerVariant.end(), lowerVariant.begin(), ::tolower);
+        ret += "-" + lowerVariant;
+    }
+    return ret + ".bplist";
+}
+
+static plist_t loadPlistSidecar(const std::string &sidecarPath){
+    plist_t ret = NULL;
+    if (access(sidecarPath.c_str(), F_OK)) return NULL;
+    try {
+        mappedFile sidecar(sidecarPath.c_str());
+        if (sidecar.size() >= 8 && memcmp(sidecar.buf(), "bplist00", 8) == 0)
+            plist_from_bin(sidecar.buf(), (uint32_t)sidecar.size(), &ret);
+    } catch (tihmstar::exception &e) {
+        //
+    }
+    if (ret) debug("Loaded plist sidecar %s\n",sidecarPath.c_str());
+    return ret;
+}
+
+static void savePlistSidecar(plist_t plist, const std::string &sidecarPath){
+    //the sidecar is only an accelerator, failing to write it is not an error
+    mkdir_with_parents(PLIST_SIDECAR_PATH, 0755);
+    if (!writeBinaryPlist(plist, sidecarPath)) debug("failed to save plist sidecar %s\n",sidecarPath.c_str());
+}
+
 #pragma mark static methods
 inline void futurerestore::saveStringToFile(const char *str, const char *path){
     FILE *f = NULL;
@@ -1690,37 +3649,461 @@ std::pair<const char *,size_t>futurerestore::getRamdiskHashFromSCAB(const char*
     return {NULL,0};
 }
 
+plist_t futurerestore::getBuildIdentityForIM4M(std::pair<const char *,size_t> im4m, plist_t buildmanifest, std::vector<const char*> *usedIgnoreList){
+    plist_t ticketIdentity = NULL;
+    try {
+        ticketIdentity = img4tool::getBuildIdentityForIm4m({im4m.first,im4m.second}, buildmanifest);
+    } catch (tihmstar::exception &e) {
+        //
+    }
+    if (!ticketIdentity) {
+        //fallback to ignore values which differ between otherwise identical identities
+        std::vector<const char*> ignoreList = {"RestoreRamDisk","RestoreTrustCache"};
+        if (usedIgnoreList) *usedIgnoreList = ignoreList;
+        try {
+            ticketIdentity = img4tool::getBuildIdentityForIm4m({im4m.first,im4m.second}, buildmanifest, ignoreList);
+        } catch (tihmstar::exception &e) {
+            //
+        }
+    }
+    return ticketIdentity;
+}
+
 plist_t futurerestore::loadPlistFromFile(const char *path){
     plist_t ret = NULL;
-    
-    FILE *f = fopen(path,"rb");
-    if (!f){
+    std::unique_ptr<mappedFile> file;
+    try {
+        file.reset(new mappedFile(path));
+    } catch (tihmstar::exception &e) {
         error("could not open file %s\n",path);
         return NULL;
     }
-    fseek(f, 0, SEEK_END);
-    size_t bufSize = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    char *buf = (char*)malloc(bufSize);
-    if (!buf){
-        error("failed to alloc memory\n");
+    if (file->size() < 8) {
+        error("file %s is too small to be a plist\n",path);
         return NULL;
     }
-    
-    size_t freadRet = 0;
-    if ((freadRet = fread(buf, 1, bufSize, f)) != bufSize){
-        error("fread=%zu but bufsize=%zu",freadRet,bufSize);
-        return NULL;
+
+    if (memcmp(file->buf(), "bplist00", 8) == 0) {
+        plist_from_bin(file->buf(), (uint32_t)file->size(), &ret);
+        return ret;
     }
-    fclose(f);
-    
-    if (memcmp(buf, "bplist00", 8) == 0)
-        plist_from_bin(buf, (uint32_t)bufSize, &ret);
-    else
-        plist_from_xml(buf, (uint32_t)bufSize, &ret);
-    free(buf);
-    
+
+    std::string sidecar = plistSidecarPath(*file);
+    if ((ret = loadPlistSidecar(sidecar))) return ret;
+    plist_from_xml(file->buf(), (uint32_t)file->size(), &ret);
+    if (ret) savePlistSidecar(ret, sidecar);
+
+    return ret;
+}
+
+#pragma mark lazy BuildManifest
+static const char *memFind(const char *begin, const char *end, const char *needle){
+    size_t needleLen = strlen(needle);
+    const char *found = std::search(begin, end, needle, needle+needleLen);
+    return (found == end) ? NULL : found;
+}
+
+//returns the position right after the element whose opening tag starts at pos, or NULL if it is not terminated
+static const char *xmlElementEnd(const char *pos, const char *end){
+    int depth = 0;
+    while ((pos = (const char*)memchr(pos, '<', end-pos))) {
+        const char *tagEnd = (const char*)memchr(pos, '>', end-pos);
+        if (!tagEnd) return NULL;
+        if (pos[1] == '/') {
+            depth--;
+        } else if (pos[1] != '?' && pos[1] != '!' && tagEnd[-1] != '/') {
+            depth++;
+        }
+        pos = tagEnd+1;
+        if (depth == 0) return pos;
+    }
+    return NULL;
+}
+
+static const char *xmlSkipWhitespace(const char *pos, const char *end){
+    while (pos < end && isspace((unsigned char)*pos)) pos++;
+    return pos;
+}
+
+//which BuildIdentity to keep: the device's, preferably with the requested install type
+struct identityTarget {
+    const char *boardConfig;
+    int64_t boardID = -1;   //-1 if libirecovery doesn't know the board, DeviceClass decides then
+    int64_t chipID = -1;
+    const char *restoreBehavior;
+
+    identityTarget(const char *board, int isUpdateInstall) : boardConfig(board), restoreBehavior((isUpdateInstall) ? "Update" : "Erase"){
+        irecv_device_t device = NULL;
+        if (board && irecv_devices_get_device_by_hardware_model(board, &device) == IRECV_E_SUCCESS && device) {
+            boardID = device->board_id;
+            chipID = device->chip_id;
+        }
+    }
+
+    //0 for other devices, 1 for this device with the other install type, 2 for the one we want
+    int match(const std::string &apBoardID, const std::string &apChipID, const std::string &deviceClass, const std::string &behavior) const {
+        bool isDevice = false;
+        if (boardID >= 0 && apBoardID.size() && apChipID.size()) {
+            isDevice = (int64_t)strtoull(apBoardID.c_str(), NULL, 0) == boardID && (int64_t)strtoull(apChipID.c_str(), NULL, 0) == chipID;
+        } else {
+            isDevice = strcasecmp(deviceClass.c_str(), boardConfig) == 0;
+        }
+        if (!isDevice) return 0;
+        return (behavior == restoreBehavior) ? 2 : 1;
+    }
+};
+
+//the <string> value following <key>key</key> between pos and end, without parsing anything
+static std::string xmlStringForKey(const char *pos, const char *end, const char *key){
+    std::string keyTag = std::string("<key>") + key + "</key>";
+    const char *keyPos = memFind(pos, end, keyTag.c_str());
+    const char *valStart = (keyPos) ? xmlSkipWhitespace(keyPos + keyTag.size(), end) : NULL;
+    const char *valEnd = NULL;
+    if (!valStart || end-valStart < 8 || memcmp(valStart, "<string>", 8)) return "";
+    valStart += 8;
+    if (!(valEnd = memFind(valStart, end, "</string>"))) return "";
+    return std::string(valStart, valEnd);
+}
+
+#pragma mark bplistReader
+//just enough of the binary plist format to pick single objects out of a file without parsing the rest
+class bplistReader {
+    const uint8_t *_buf;
+    size_t _size;
+    uint8_t _offsetSize = 0;
+    uint8_t _refSize = 0;
+    uint64_t _objectCnt = 0;
+    uint64_t _topObject = 0;
+    uint64_t _offsetTable = 0;
+
+    static uint64_t readBE(const uint8_t *p, size_t size){
+        uint64_t ret = 0;
+        for (size_t i = 0; i < size; i++) ret = (ret << 8) | p[i];
+        return ret;
+    }
+
+    //the marker byte of object ref
+    const uint8_t *object(uint64_t ref) const {
+        retassure(ref < _objectCnt, "bplist: object %llu out of range\n", (unsigned long long)ref);
+        uint64_t offset = readBE(_buf + _offsetTable + ref*_offsetSize, _offsetSize);
+        retassure(offset >= 8 && offset < _offsetTable, "bplist: invalid offset for object %llu\n", (unsigned long long)ref);
+        return _buf + offset;
+    }
+
+    //element count of an object, p is left at its payload
+    uint64_t length(const uint8_t *&p) const {
+        uint64_t len = *p++ & 0x0f;
+        if (len == 0x0f) {
+            retassure((*p & 0xf0) == 0x10, "bplist: invalid length\n");
+            size_t intSize = 1 << (*p & 0x0f);
+            retassure(intSize <= 8 && p + 1 + intSize <= _buf + _offsetTable, "bplist: invalid length\n");
+            len = readBE(p+1, intSize);
+            p += 1 + intSize;
+        }
+        return len;
+    }
+
+    //refs of an array, or keys followed by values of a dict
+    std::vector<uint64_t> refs(const uint8_t *p, uint64_t cnt) const {
+        std::vector<uint64_t> ret;
+        retassure(cnt <= (uint64_t)(_buf + _offsetTable - p) / _refSize, "bplist: container exceeds the object table\n");
+        for (uint64_t i = 0; i < cnt; i++) ret.push_back(readBE(p + i*_refSize, _refSize));
+        return ret;
+    }
+
+    static void appendUTF8(std::string &dst, uint32_t c){
+        if (c < 0x80) {
+            dst += (char)c;
+        } else if (c < 0x800) {
+            dst += (char)(0xc0 | (c >> 6));
+            dst += (char)(0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            dst += (char)(0xe0 | (c >> 12));
+            dst += (char)(0x80 | ((c >> 6) & 0x3f));
+            dst += (char)(0x80 | (c & 0x3f));
+        } else {
+            dst += (char)(0xf0 | (c >> 18));
+            dst += (char)(0x80 | ((c >> 12) & 0x3f));
+            dst += (char)(0x80 | ((c >> 6) & 0x3f));
+            dst += (char)(0x80 | (c & 0x3f));
+        }
+    }
+
+public:
+    bplistReader(const char *buf, size_t size) : _buf((const uint8_t*)buf), _size(size){
+        retassure(_size >= 8 + 32 && !memcmp(_buf, "bplist00", 8), "not a binary plist\n");
+        const uint8_t *trailer = _buf + _size - 32;
+        _offsetSize = trailer[6];
+        _refSize = trailer[7];
+        _objectCnt = readBE(trailer+8, 8);
+        _topObject = readBE(trailer+16, 8);
+        _offsetTable = readBE(trailer+24, 8);
+        retassure(_offsetSize >= 1 && _offsetSize <= 8 && _refSize >= 1 && _refSize <= 8, "bplist: invalid trailer\n");
+        retassure(_offsetTable >= 8 && _offsetTable <= _size - 32 && _objectCnt <= (_size - 32 - _offsetTable) / _offsetSize, "bplist: invalid offset table\n");
+    }
+
+    uint64_t topObject() const {return _topObject;};
+
+    bool isDict(uint64_t ref) const {return (*object(ref) & 0xf0) == 0xd0;};
+    bool isArray(uint64_t ref) const {return (*object(ref) & 0xf0) == 0xa0;};
+
+    std::vector<uint64_t> arrayItems(uint64_t ref) const {
+        const uint8_t *p = object(ref);
+        retassure((*p & 0xf0) == 0xa0, "bplist: object %llu is not an array\n", (unsigned long long)ref);
+        uint64_t cnt = length(p);
+        return refs(p, cnt);
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> dictItems(uint64_t ref) const {
+        std::vector<std::pair<std::string, uint64_t>> ret;
+        const uint8_t *p = object(ref);
+        retassure((*p & 0xf0) == 0xd0, "bplist: object %llu is not a dict\n", (unsigned long long)ref);
+        uint64_t cnt = length(p);
+        std::vector<uint64_t> keysAndValues = refs(p, cnt*2);
+        for (uint64_t i = 0; i < cnt; i++) ret.push_back({string(keysAndValues[i]), keysAndValues[cnt+i]});
+        return ret;
+    }
+
+    //value of key in dict ref, or -1
+    int64_t dictValue(uint64_t ref, const char *key) const {
+        for (auto &item : dictItems(ref)) {
+            if (item.first == key) return (int64_t)item.second;
+        }
+        return -1;
+    }
+
+    std::string string(uint64_t ref) const {
+        const uint8_t *p = object(ref);
+        uint8_t type = *p & 0xf0;
+        std::string ret;
+        if (type != 0x50 && type != 0x60) return ret;
+        uint64_t len = length(p);
+        if (type == 0x50) {
+            retassure(len <= (uint64_t)(_buf + _offsetTable - p), "bplist: string exceeds the object table\n");
+            return std::string((const char*)p, len);
+        }
+        retassure(len <= (uint64_t)(_buf + _offsetTable - p) / 2, "bplist: string exceeds the object table\n");
+        for (uint64_t i = 0; i < len; i++) {
+            uint32_t c = (uint32_t)readBE(p + i*2, 2);
+            if (c >= 0xd800 && c < 0xdc00 && i+1 < len) {
+                uint32_t low = (uint32_t)readBE(p + (i+1)*2, 2);
+                if (low >= 0xdc00 && low < 0xe000) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                    i++;
+                }
+            }
+            appendUTF8(ret, c);
+        }
+        return ret;
+    }
+
+    //materializes ref and everything below it
+    plist_t build(uint64_t ref, int depth = 0) const {
+        retassure(depth < 64, "bplist: nested too deep\n");
+        const uint8_t *p = object(ref);
+        uint8_t marker = *p;
+        switch (marker & 0xf0) {
+            case 0x00:
+                retassure(marker == 0x08 || marker == 0x09, "bplist: unsupported object type 0x%02x\n", marker);
+                return plist_new_bool(marker == 0x09);
+            case 0x10: {
+                size_t intSize = 1 << (marker & 0x0f);
+                retassure(intSize <= 16 && p + 1 + intSize <= _buf + _offsetTable, "bplist: invalid integer\n");
+                //128 bit integers only exist to hold unsigned 64 bit values, those are in the low half
+                return plist_new_uint((intSize == 16) ? readBE(p+9, 8) : readBE(p+1, intSize));
+            }
+            case 0x20: {
+                uint64_t bits = 0;
+                size_t realSize = 1 << (marker & 0x0f);
+                retassure((realSize == 4 || realSize == 8) && p + 1 + realSize <= _buf + _offsetTable, "bplist: invalid real\n");
+                bits = readBE(p+1, realSize);
+                if (realSize == 4) {
+                    float f = 0;
+                    uint32_t bits32 = (uint32_t)bits;
+                    memcpy(&f, &bits32, sizeof(f));
+                    return plist_new_real(f);
+                }
+                double d = 0;
+                memcpy(&d, &bits, sizeof(d));
+                return plist_new_real(d);
+            }
+            case 0x30: {
+                uint64_t bits = 0;
+                double d = 0;
+                retassure(marker == 0x33 && p + 9 <= _buf + _offsetTable, "bplist: invalid date\n");
+                bits = readBE(p+1, 8);
+                memcpy(&d, &bits, sizeof(d));
+                return plist_new_date((int32_t)d, (int32_t)((d - (int32_t)d) * 1000000));
+            }
+            case 0x40: {
+                uint64_t len = length(p);
+                retassure(len <= (uint64_t)(_buf + _offsetTable - p), "bplist: data exceeds the object table\n");
+                return plist_new_data((const char*)p, len);
+            }
+            case 0x50:
+            case 0x60:
+                return plist_new_string(string(ref).c_str());
+            case 0x80:
+                retassure(p + 2 + (marker & 0x0f) <= _buf + _offsetTable, "bplist: invalid uid\n");
+                return plist_new_uid(readBE(p+1, (marker & 0x0f) + 1));
+            case 0xa0: {
+                plist_t ret = plist_new_array();
+                try {
+                    for (uint64_t item : arrayItems(ref)) plist_array_append_item(ret, build(item, depth+1));
+                } catch (...) {
+                    plist_free(ret);
+                    throw;
+                }
+                return ret;
+            }
+            case 0xd0: {
+                plist_t ret = plist_new_dict();
+                try {
+                    for (auto &item : dictItems(ref)) plist_dict_set_item(ret, item.first.c_str(), build(item.second, depth+1));
+                } catch (...) {
+                    plist_free(ret);
+                    throw;
+                }
+                return ret;
+            }
+            default:
+                reterror("bplist: unsupported object type 0x%02x\n", marker);
+        }
+    }
+};
+
+static plist_t loadBinaryBuildManifestForBoard(const char *buf, size_t bufSize, const identityTarget &target){
+    bplistReader bplist(buf, bufSize);
+    plist_t manifest = NULL;
+    uint64_t top = bplist.topObject();
+    int64_t chosen = -1;
+    int chosenMatch = 0;
+    cleanup([&]{
+        safeFreeCustom(manifest, plist_free);
+    });
+    retassure(bplist.isDict(top), "BuildManifest is not a dictionary\n");
+    manifest = plist_new_dict();
+
+    for (auto &item : bplist.dictItems(top)) {
+        if (item.first != "BuildIdentities" || !bplist.isArray(item.second)) {
+            plist_dict_set_item(manifest, item.first.c_str(), bplist.build(item.second));
+            continue;
+        }
+        //only look at the few strings deciding the match, the identity itself is built once it won
+        for (uint64_t identity : bplist.arrayItems(item.second)) {
+            if (!bplist.isDict(identity)) continue;
+            auto str = [&](int64_t dict, const char *key)->std::string{
+                int64_t val = (dict >= 0 && bplist.isDict(dict)) ? bplist.dictValue(dict, key) : -1;
+                return (val >= 0) ? bplist.string(val) : "";
+            };
+            int64_t info = bplist.dictValue(identity, "Info");
+            int match = target.match(str(identity, "ApBoardID"), str(identity, "ApChipID"), str(info, "DeviceClass"), str(info, "RestoreBehavior"));
+            if (match > chosenMatch) {
+                chosen = identity;
+                chosenMatch = match;
+                if (match == 2) break;
+            }
+        }
+        plist_t identities = plist_new_array();
+        plist_dict_set_item(manifest, "BuildIdentities", identities);
+        if (chosen >= 0) plist_array_append_item(identities, bplist.build(chosen));
+    }
+
+    plist_t ret = manifest;
+    manifest = NULL;
+    return ret;
+}
+
+plist_t futurerestore::loadBuildManifestForBoard(const char *buf, size_t bufSize, const char *boardConfig, int isUpdateInstall){
+    plist_t manifest = NULL;
+    plist_t identities = NULL;
+    const char *end = buf+bufSize;
+    const char *arrayStart = NULL;
+    const char *arrayEnd = NULL;
+    const char *chosenStart = NULL;
+    const char *chosenEnd = NULL;
+    int chosenMatch = 0;
+    identityTarget target(boardConfig, isUpdateInstall);
+
+    if (bufSize >= 8 && memcmp(buf, "bplist00", 8) == 0) {
+        if (!boardConfig) {
+            plist_from_bin(buf, (uint32_t)bufSize, &manifest);
+            return manifest;
+        }
+        return loadBinaryBuildManifestForBoard(buf, bufSize, target);
+    }
+
+    if (boardConfig
+        && (arrayStart = memFind(buf, end, "<key>BuildIdentities</key>"))
+        && (arrayStart = xmlSkipWhitespace(arrayStart + sizeof("<key>BuildIdentities</key>")-1, end))
+        && end-arrayStart > 7 && memcmp(arrayStart, "<array>", 7) == 0) {
+        const char *pos = arrayStart + 7;
+        while (true) {
+            pos = xmlSkipWhitespace(pos, end);
+            if (end-pos >= 8 && memcmp(pos, "</array>", 8) == 0) {
+                arrayEnd = pos;
+                break;
+            }
+            if (end-pos < 6 || memcmp(pos, "<dict>", 6) != 0) break;
+            const char *identityEnd = xmlElementEnd(pos, end);
+            if (!identityEnd) break;
+
+            //only look at the few strings deciding the match, the identity itself is parsed once it won
+            if (chosenMatch < 2) {
+                int match = target.match(xmlStringForKey(pos, identityEnd, "ApBoardID"), xmlStringForKey(pos, identityEnd, "ApChipID"),
+                                         xmlStringForKey(pos, identityEnd, "DeviceClass"), xmlStringForKey(pos, identityEnd, "RestoreBehavior"));
+                if (match > chosenMatch) {
+                    chosenStart = pos;
+                    chosenEnd = identityEnd;
+                    chosenMatch = match;
+                }
+            }
+            pos = identityEnd;
+        }
+    }
+
+    if (!arrayEnd) {
+        //not a layout we can scan, fall back to a full parse
+        plist_from_xml(buf, (uint32_t)bufSize, &manifest);
+        return manifest;
+    }
+
+    {
+        std::string skeleton(buf, arrayStart+7);
+        skeleton.append(arrayEnd, end);
+        plist_from_xml(skeleton.c_str(), (uint32_t)skeleton.size(), &manifest);
+    }
+    retassure(manifest && (identities = plist_dict_get_item(manifest, "BuildIdentities")), "failed to parse BuildManifest\n");
+
+    if (chosenStart) {
+        plist_t identity = NULL;
+        std::string identityXml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<plist version=\"1.0\">\n";
+        identityXml.append(chosenStart, chosenEnd);
+        identityXml += "\n</plist>\n";
+        plist_from_xml(identityXml.c_str(), (uint32_t)identityXml.size(), &identity);
+        if (!identity) {
+            plist_free(manifest);
+            reterror("failed to parse BuildIdentity for %s\n", boardConfig);
+        }
+        plist_array_append_item(identities, identity);
+    }
+    debug("BuildManifest: materialized %s BuildIdentity for %s\n", (chosenMatch == 2) ? target.restoreBehavior : (chosenMatch) ? "the other" : "no", boardConfig);
+
+    return manifest;
+}
+
+plist_t futurerestore::loadBuildManifestFromFile(const char *path, const char *boardConfig, int isUpdateInstall){
+    mappedFile file(path);
+    plist_t ret = NULL;
+    bool isBinary = file.size() >= 8 && memcmp(file.buf(), "bplist00", 8) == 0;
+
+    //the sidecar holds the manifest already reduced to this board and install type
+    std::string variant = std::string((boardConfig) ? boardConfig : "all") + ((isUpdateInstall) ? "-update" : "-erase");
+    std::string sidecar = (isBinary) ? "" : plistSidecarPath(file, variant.c_str());
+    if (!sidecar.empty() && (ret = loadPlistSidecar(sidecar))) return ret;
+    ret = loadBuildManifestForBoard(file.buf(), file.size(), boardConfig, isUpdateInstall);
+    if (ret && !sidecar.empty()) savePlistSidecar(ret, sidecar);
+
     return ret;
 }
 
@@ -1728,7 +4111,7 @@ char *futurerestore::getPathOfElementInManifest(const char *element, const char
     char *pathStr = NULL;
     ptr_smart<plist_t> buildmanifest(NULL,plist_free);
     
-    plist_from_xml(manifeststr, (uint32_t)strlen(manifeststr), &buildmanifest);
+    buildmanifest = loadBuildManifestForBoard(manifeststr, strlen(manifeststr), boardConfig, isUpdateInstall);
     
     if (plist_t identity = getBuildidentityWithBoardconfig(buildmanifest._p, boardConfig, isUpdateInstall))
         if (plist_t manifest = plist_dict_get_item(identity, "Manifest"))
@@ -1747,7 +4130,7 @@ bool futurerestore::elemExists(const char *element, const char *manifeststr, con
     char *pathStr = NULL;
     ptr_smart<plist_t> buildmanifest(NULL,plist_free);
     
-    plist_from_xml(manifeststr, (uint32_t)strlen(manifeststr), &buildmanifest);
+    buildmanifest = loadBuildManifestForBoard(manifeststr, strlen(manifeststr), boardConfig, isUpdateInstall);
     
     if (plist_t identity = getBuildidentityWithBoardconfig(buildmanifest._p, boardConfig, isUpdateInstall))
         if (plist_t manifest = plist_dict_get_item(identity, "Manifest"))
@@ -19,6 +19,11 @@
 #include <stdio.h>
 #include <functional>
 #include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <future>
+#include <chrono>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <errno.h>
@@ -27,6 +32,7 @@
 #include "idevicerestore.h"
 #include <jssy.h>
 #include <plist/plist.h>
+#include "devicetransport.hpp"
 
 using namespace std;
 
@@ -48,8 +54,47 @@ public:
     ~ptr_smart(){if (_p) (_ptr_free) ? _ptr_free(_p) : free((void*)_p);}
 };
 
+//read-only view of a whole file, mmapped where the platform allows it
+class mappedFile {
+    int _fd = -1;
+    char *_buf = NULL;
+    size_t _size = 0;
+    bool _mapped = false;
+public:
+    mappedFile(const char *path);
+    mappedFile(const mappedFile &) = delete;
+    ~mappedFile();
+    const char *buf() const {return _buf;};
+    size_t size() const {return _size;};
+};
+
 class futurerestore {
+public:
+    struct modeTransition {
+        int fromMode;
+        int toMode;
+        std::chrono::steady_clock::time_point time;
+        double latency; //seconds since the previous transition (or since subscribing)
+    };
+    struct modeMark {
+        size_t transition;
+        std::chrono::steady_clock::time_point time;
+    };
+    struct uploadStat {
+        std::string name;
+        size_t size; //0 if idevicerestore did the transfer and we don't know the size
+        double seconds;
+    };
+    struct restorePhase {
+        int step;           //RESTORE_STEP_* as reported by idevicerestore
+        std::string name;
+        uint64_t bytes;     //0 for steps which only report a percentage
+        double seconds;
+        double progress;    //0.0 to 1.0, where the step was when it ended
+    };
+private:
     struct idevicerestore_client_t* _client;
+    std::shared_ptr<deviceTransport> _transport;
     char *_ibootBuild = NULL;
     bool _didInit = false;
     vector<plist_t> _aptickets;
@@ -72,11 +117,101 @@ class futurerestore {
     
     bool _enterPwnRecoveryRequested = false;
     bool _rerestoreiOS9 = false;
+    
+    std::string _sessionDir;
+    std::string _basebandTmpPath;
+    std::string _basebandManifestTmpPath;
+    std::string _sepTmpPath;
+    std::string _sepManifestTmpPath;
+    std::string _firmwaresTmpPath;
+    
+    std::string _catalogIPSWPath;
+    
+    std::shared_ptr<class remoteipsw> _remoteIPSW;
+    std::string _remoteIPSWDir;
+    std::future<void> _remoteFilesystem;
+    std::shared_ptr<class remoteFileMount> _remoteFilesystemMount;
+    bool _remoteFilesystemToDisk = false; //store a remote filesystem which can't be streamed instead of failing
+    std::string _downloadedIPSWPath;
+    uint64_t _prewarmBudget = 1024*1024*1024ULL; //bytes of the filesystem to pull into the page cache before ASR
+    uint64_t _preloadBudget = 1024*1024*1024ULL; //bytes of restore components to inflate into memory ahead of time
+    std::string _preloadDir;
+    
+    //mode transitions seen by the event callbacks, guarded by _client->device_event_mutex
+    std::vector<modeTransition> _modeTransitions;
+    int _lastSeenMode = MODE_UNKNOWN;
+    bool _didSubscribeEvents = false;
+    size_t _connectionTransition = 0; //dfu/recovery connections are valid until the transition after this one
+    std::chrono::steady_clock::time_point _lastTransitionTime;
+    
+    plist_t _deviceProfile = NULL; //what we learned about this ECID in earlier runs
+    plist_t _restoreJournal = NULL; //steps of the current restore which an earlier, failed attempt already completed
+    std::vector<uploadStat> _uploadStats;
+    std::map<std::string, std::shared_future<std::string>> _preparedComponents;
+    std::string _preparedBootargs;
+    std::map<std::string, std::string> _preparedCachePaths; //component -> where its patched bytes are cached
+    std::vector<restorePhase> _restorePhases;
+    uint64_t _restoreFilesystemSize = 0;
+    std::chrono::steady_clock::time_point _phaseStart;
+    std::chrono::steady_clock::time_point _phaseLastPrint;
+    std::string _bootCacheDir; //set while doJustBoot runs, the component hooks store what they serve in it
+    std::vector<std::string> _bootComponents;
+    bool _bootCacheDirty = false;
     //methods
+    int checkMode();
+    void deviceModeChanged(int mode);
+    void noteModeChangeLocked();
+    void subscribeDeviceEvents();
+    modeMark markModeTransitions();
+    bool waitForModeTransition(modeMark mark, std::vector<int> sequence, uint32_t timeoutMs);
+    bool waitForDeviceMode(uint32_t timeoutMs);
+    std::string deviceProfilePath();
+    void loadDeviceProfile();
+    void saveDeviceProfile();
+    bool getProfileUint(const char *key, uint64_t *val);
+    void setProfileUint(const char *key, uint64_t val);
+    void setProfileString(const char *key, const char *val);
+    std::string restoreJournalPath();
+    std::string restoreJournalKey(std::pair<const char *,size_t> im4m);
+    void loadRestoreJournal(const std::string &key);
+    void startRestoreJournal(const std::string &key);
+    void discardRestoreJournal();
+    void journalIdentities(std::vector<std::pair<std::string, std::string>> identities);
+    plist_t journalStepNode(const char *step);
+    bool journalStepDone(const char *step);
+    std::string journalArtifact(const char *step, const char *key);
+    void journalStep(const char *step, std::vector<std::pair<std::string, std::string>> artifacts = {});
+    void clearRestoreJournal();
+    void loadDevice();
+    void dropStaleConnections();
+    void connectRecovery();
+    void noteUpload(const char *name, size_t size, std::chrono::steady_clock::time_point start);
+    void sendBootImage(const char *name, const char *buf, size_t size);
+    void readApNonce();
+    void preparePwnBootchain(plist_t build_identity, std::string bootargs = "");
+    void serveComponentsFromMemory();
+    void prepareDecryptedComponents(plist_t build_identity);
+    std::string preparedComponent(const char *component);
+    friend void get_custom_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, unsigned char** data, unsigned int *size);
+    static void preparedComponentHook(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, unsigned char** data, unsigned int *size);
+    static void restoreProgressCallback(int step, double progress, void *userdata);
+    void noteRestoreProgress(int step, double progress);
+    void finishRestorePhase();
+    void printRestoreSummary();
     void enterPwnRecovery(plist_t build_identity, std::string bootargs = "");
+    std::string bootCachePath(const char *ipsw, const std::string &bootargs);
+    void cacheBootComponent(const char *component, const std::string &bytes);
+    void saveBootProfile(plist_t build_identity);
+    const char *stageRemoteIPSW(const char *url);
+    bool preloadComponents(std::string ipsw, std::vector<std::string> files);
+    void verifyComponentDigests(plist_t build_identity, std::pair<const char *,size_t> im4m, std::vector<const char*> ticketIgnoreList = {});
     
 public:
     futurerestore(bool isUpdateInstall = false, bool isPwnDfu = false);
+    //defaults to usb, has to be set before init
+    void setTransport(std::shared_ptr<deviceTransport> transport);
+    //every signing request idevicerestore makes goes to url instead of Apple
+    void setTSSURL(const char *url);
     bool init();
     int getDeviceMode(bool reRequest);
     uint64_t getDeviceEcid();
@@ -109,6 +244,9 @@ public:
     void loadSep(const char *sepPath);
     void setBasebandPath(const char *basebandPath);
     bool isUpdateInstall(){return _isUpdateInstall;};
+    void setPrewarmBudget(uint64_t budget){_prewarmBudget = budget;};
+    void setPreloadBudget(uint64_t budget){_preloadBudget = budget;};
+    void setRemoteFilesystemToDisk(bool val){_remoteFilesystemToDisk = val;};
     
     plist_t sepManifest(){return _sepbuildmanifest;};
     plist_t basebandManifest(){return _basebandbuildmanifest;};
@@ -117,17 +255,38 @@ public:
     bool is32bit(){return !is_image4_supported(_client);};
     
     uint64_t getBasebandGoldCertIDFromDevice();
+    std::vector<modeTransition> modeTransitions();
+    void printTimingReport();
+    const std::vector<uploadStat> &uploadStats(){return _uploadStats;};
+    const std::vector<restorePhase> &restorePhases(){return _restorePhases;};
+    //transitions, uploads and restore phases as an XML plist
+    void writeMetrics(const char *path);
+    
+    const char *getIPSWFromCatalog(const char *catalogDir);
+    const char *downloadIPSW(const char *version, const char *deviceModel = NULL);
     
     void doRestore(const char *ipsw);
-    int doJustBoot(const char *ipsw, std::string bootargs = "");
+    //onlyEnterPwnRecovery stops once iBEC runs, which is as far as a simulated device can be taken
+    int doJustBoot(const char *ipsw, std::string bootargs = "", bool onlyEnterPwnRecovery = false);
     
     ~futurerestore();
     
     static std::pair<const char *,size_t> getRamdiskHashFromSCAB(const char* scab, size_t scabSize);
     static std::pair<const char *,size_t> getNonceFromSCAB(const char* scab, size_t scabSize);
     static uint64_t getEcidFromSCAB(const char* scab, size_t scabSize);
+    static plist_t getBuildIdentityForIM4M(std::pair<const char *,size_t> im4m, plist_t buildmanifest, std::vector<const char*> *usedIgnoreList = NULL);
+    static plist_t updateIPSWCatalog(const char *catalogDir);
+    //XML plists are cached as binary plists keyed by the SHA1 of the source
     static plist_t loadPlistFromFile(const char *path);
+    //parses a single BuildIdentity: the first for boardConfig's ApBoardID/ApChipID with the requested install type,
+    //or the first for the board if it has none of that type. The others are skipped unparsed
+    static plist_t loadBuildManifestForBoard(const char *buf, size_t bufSize, const char *boardConfig, int isUpdateInstall);
+    static plist_t loadBuildManifestFromFile(const char *path, const char *boardConfig, int isUpdateInstall);
     static void saveStringToFile(const char *str, const char *path);
+    //merges a ProductType -> Build -> component -> {IV, Key, Path} plist into the firmware key store, returns how many keys changed
+    static size_t importFirmwareKeys(const char *path);
+    //reads every disk image in a remote iPSW the way a restore would and prints its SHA1, no device needed
+    static void checkRemoteIPSW(const char *url);
     static char *getPathOfElementInManifest(const char *element, const char *manifeststr, const char *boardConfig, int isUpdateInstall);
     bool elemExists(const char *element, const char *manifeststr, const char *boardConfig, int isUpdateInstall);
     static std::string getGeneratorFromSHSH2(const plist_t shsh2);
@@ -12,6 +12,9 @@
 #include <unistd.h>
 #include <vector>
 #include "futurerestore.hpp"
+#include "tssserver.hpp"
+#include "remoteipsw.hpp"
+#include "remotefs.hpp"
 
 extern "C"{
 #include "tsschecker.h"
@@ -45,9 +48,19 @@ static struct option longopts[] = {
     { "latest-sep",         no_argument,            NULL, '0' },
     { "latest-baseband",    no_argument,            NULL, '1' },
     { "no-baseband",        no_argument,            NULL, '2' },
+    { "catalog",            required_argument,      NULL, 'c' },
+    { "download-ipsw",      required_argument,      NULL, '5' },
+    { "prewarm-budget",     required_argument,      NULL, '6' },
+    { "preload-budget",     required_argument,      NULL, '7' },
+    { "simulate",           optional_argument,      NULL, '8' },
+    { "metrics",            required_argument,      NULL, '9' },
+    { "tss-server",         required_argument,      NULL, 'T' },
+    { "check-remote-ipsw",  no_argument,            NULL, 'R' },
+    { "remote-fs-to-disk",  no_argument,            NULL, 'D' },
 #ifdef HAVE_LIBIPATCHER
     { "use-pwndfu",         no_argument,            NULL, '3' },
     { "just-boot",          optional_argument,      NULL, '4' },
+    { "import-keys",        required_argument,      NULL, 'k' },
 #endif
     { NULL, 0, NULL, 0 }
 };
@@ -62,6 +75,9 @@ static struct option longopts[] = {
 void cmd_help(){
     printf("Usage: futurerestore [OPTIONS] iPSW\n");
     printf("Allows restoring to non-matching firmware with custom SEP+baseband\n");
+    printf("iPSW may be a local file or an http(s) URL of a server supporting range requests\n");
+    printf("With FUSE, an uncompressed filesystem in a remote iPSW is streamed to ASR instead of being stored on disk\n");
+    printf("Other remote filesystems are only stored on disk with --remote-fs-to-disk\n");
     printf("\nGeneral options:\n");
     printf("  -t, --apticket PATH\t\tSigning tickets used for restoring\n");
     printf("  -u, --update\t\t\tUpdate instead of erase install (requires appropriate APTicket)\n");
@@ -69,11 +85,39 @@ void cmd_help(){
     printf("  -w, --wait\t\t\tKeep rebooting until ApNonce matches APTicket (ApNonce collision, unreliable)\n");
     printf("  -d, --debug\t\t\tShow all code, use to save a log for debug testing\n");
     printf("  -e, --exit-recovery\t\tExit recovery mode and quit\n");
+    printf("  -c, --catalog PATH\t\tIndex all iPSWs in PATH. If no iPSW is given, restore the one matching the APTicket\n");
+    printf("                    \t\tThe index is kept in futurerestore's cache, PATH is never written to\n");
+    printf("      --download-ipsw [MODEL:]VERSION\n");
+    printf("                    \t\tDownload the iPSW for VERSION (or build) and verify it against firmware.json\n");
+    printf("                    \t\tInterrupted downloads resume. Restored when APTickets but no iPSW are given\n");
+    printf("      --prewarm-budget MB\tRead up to MB of the filesystem into memory before the restore starts (default 1024, 0 disables)\n");
+    printf("      --preload-budget MB\tInflate restore components into /dev/shm ahead of time if they fit in MB (default 1024, 0 disables, Linux tmpfs only, skipped elsewhere)\n");
+    printf("      --simulate[=SPEC]\t\tTalk to a simulated device instead of USB and print a timing report. Runs recovery,\n");
+    printf("                       \t\tApNonce collision (-w, or SPEC's resets) and exit-recovery. With --use-pwndfu, an iPSW and\n");
+    printf("                       \t\t(64-bit) an APTicket it runs the Odysseus bootchain up to pwned recovery instead\n");
+    printf("                       \t\tThe restore itself (doRestore) is not simulated, it needs a real device\n");
+    printf("                       \t\tSPEC is key=value[,...] with mode=normal|recovery|dfu, arch=32|64, board, ecid,\n");
+    printf("                       \t\treconnect (ms), latency (ms), bandwidth (MB/s), nonces (boots until nonces repeat),\n");
+    printf("                       \t\tnoncesize (20|32), resets\n");
+    printf("      --metrics PATH\t\tWrite mode transitions, upload and restore throughput to PATH as an XML plist\n");
+    printf("      --tss-server SPEC\t\tSend idevicerestore's signing requests to a local stand-in for Apple's server\n");
+    printf("                       \t\tSPEC is key=value[,...] with mode=record|replay (default replay), dir (recordings),\n");
+    printf("                       \t\tticket (answer unrecorded AP requests this shsh2 signs), latency (ms), upstream (URL)\n");
+    printf("                       \t\tRecordings are matched ignoring nonces, baseband requests are only ever replayed\n");
+    printf("                       \t\tWhile replaying, tsschecker's signing status checks are skipped\n");
+    printf("      --check-remote-ipsw\tRead every disk image of the remote iPSW the way a restore would and print its SHA1\n");
+    printf("                         \tand throughput. Needs no device\n");
+    printf("      --remote-fs-to-disk\tStore the filesystem of a remote iPSW on disk if it can't be streamed (compressed,\n");
+    printf("                         \tno FUSE or the mount failed). Without it such a restore stops before anything is sent\n");
     
 #ifdef HAVE_LIBIPATCHER
     printf("\nOptions for downgrading with Odysseus:\n");
     printf("      --use-pwndfu\t\tRestoring devices with Odysseus method. Device needs to be in pwned DFU mode already\n");
+    printf("                  \t\tiBSS and iBEC are patched while the APTicket is checked, so the device doesn't wait for them\n");
     printf("      --just-boot=\"-v\"\t\tTethered booting the device from pwned DFU mode. You can optionally set boot-args\n");
+    printf("                        \tEverything sent is cached, booting the same iPSW with the same boot-args again doesn't read the iPSW\n");
+    printf("      --import-keys PATH\tAdd the firmware keys in PATH (ProductType -> Build -> component -> {IV, Key, Path} plist)\n");
+    printf("                        \tto the key store. Keys in the store are used without asking the key server\n");
 #endif
         
     printf("\nOptions for SEP:\n");
@@ -108,6 +152,7 @@ int main_r(int argc, const char * argv[]) {
 #else
     printf("Odysseus support: no\n");
 #endif
+    printf("FUSE for streaming remote filesystems: %s\n",(remoteFileMount::isSupported() ? "yes" : "no"));
 
     int optindex = 0;
     int opt = 0;
@@ -123,6 +168,19 @@ int main_r(int argc, const char * argv[]) {
     const char *sepPath = NULL;
     const char *sepManifestPath = NULL;
     const char *bootargs = NULL;
+    const char *catalogPath = NULL;
+    std::string downloadVersion;
+    std::string downloadModel;
+    long prewarmBudget = -1;
+    long preloadBudget = -1;
+    const char *simulateSpec = NULL;
+    const char *metricsPath = NULL;
+    const char *importKeysPath = NULL;
+    const char *tssServerSpec = NULL;
+    bool checkRemoteIPSW = false;
+    bool remoteFilesystemToDisk = false;
+    std::shared_ptr<tssServer> tss;
+    std::shared_ptr<simulatedDevice> simulator;
     
     vector<const char*> apticketPaths;
     
@@ -134,7 +192,7 @@ int main_r(int argc, const char * argv[]) {
         return -1;
     }
 
-    while ((opt = getopt_long(argc, (char* const *)argv, "ht:b:p:s:m:wude0123", longopts, &optindex)) > 0) {
+    while ((opt = getopt_long(argc, (char* const *)argv, "ht:b:p:s:m:c:wude0123", longopts, &optindex)) > 0) {
         switch (opt) {
             case 't': // long option: "apticket"; can be called as short option
                 apticketPaths.push_back(optarg);
@@ -151,6 +209,37 @@ int main_r(int argc, const char * argv[]) {
             case 'm': // long option: "sep-manifest"; can be called as short option
                 sepManifestPath = optarg;
                 break;
+            case 'c': // long option: "catalog"; can be called as short option
+                catalogPath = optarg;
+                break;
+            case '5': // long option: "download-ipsw";
+                downloadVersion = optarg;
+                if (downloadVersion.find(':') != std::string::npos) {
+                    downloadModel = downloadVersion.substr(0, downloadVersion.find(':'));
+                    downloadVersion.erase(0, downloadModel.size()+1);
+                }
+                break;
+            case '6': // long option: "prewarm-budget";
+                prewarmBudget = atol(optarg);
+                break;
+            case '7': // long option: "preload-budget";
+                preloadBudget = atol(optarg);
+                break;
+            case '8': // long option: "simulate";
+                simulateSpec = (optarg) ? optarg : "";
+                break;
+            case '9': // long option: "metrics";
+                metricsPath = optarg;
+                break;
+            case 'T': // long option: "tss-server";
+                tssServerSpec = optarg;
+                break;
+            case 'R': // long option: "check-remote-ipsw";
+                checkRemoteIPSW = true;
+                break;
+            case 'D': // long option: "remote-fs-to-disk";
+                remoteFilesystemToDisk = true;
+                break;
             case 'w': // long option: "wait"; can be called as short option
                 flags |= FLAG_WAIT;
                 break;
@@ -170,6 +259,9 @@ int main_r(int argc, const char * argv[]) {
             case '3': // long option: "use-pwndfu";
                 flags |= FLAG_IS_PWN_DFU;
                 break;
+            case 'k': // long option: "import-keys";
+                importKeysPath = optarg;
+                break;
             case '4': // long option: "just-boot";
                 bootargs = (optarg) ? optarg : "";
                 break;
@@ -187,15 +279,35 @@ int main_r(int argc, const char * argv[]) {
         }
     }
     
+    if (importKeysPath) {
+        size_t imported = futurerestore::importFirmwareKeys(importKeysPath);
+        info("Imported %zu new firmware keys from %s\n", imported, importKeysPath);
+    }
+    
     if (argc-optind == 1) {
         argc -= optind;
         argv += optind;
         
         ipsw = argv[0];
+    }else if (argc == optind && catalogPath) {
+        if (apticketPaths.size())
+            info("No iPSW specified, selecting one matching the APTicket from catalog %s\n",catalogPath);
+        else {
+            plist_free(futurerestore::updateIPSWCatalog(catalogPath));
+            info("Done\n");
+            return 0;
+        }
+    }else if (argc == optind && downloadVersion.size()) {
+        info("No iPSW specified, using downloaded iPSW %s\n",downloadVersion.c_str());
     }else if (argc == optind && flags & FLAG_WAIT) {
         info("User requested to only wait for ApNonce to match, but not for actually restoring\n");
     }else if (exitRecovery){
         info("Exiting from recovery mode to normal mode\n");
+    }else if (argc == optind && importKeysPath){
+        info("Done\n");
+        return 0;
+    }else if (argc == optind && simulateSpec){
+        info("Running against a simulated device\n");
     }else{
         error("argument parsing failed! agrc=%d optind=%d\n",argc,optind);
         if (idevicerestore_debug){
@@ -206,7 +318,31 @@ int main_r(int argc, const char * argv[]) {
         return -5;
     }
     
+    if (checkRemoteIPSW) {
+        retassure(ipsw && remoteipsw::isRemote(ipsw), "--check-remote-ipsw needs an http(s) URL as iPSW\n");
+        futurerestore::checkRemoteIPSW(ipsw);
+        info("Done\n");
+        return 0;
+    }
+
     futurerestore client(flags & FLAG_UPDATE, flags & FLAG_IS_PWN_DFU);
+    if (prewarmBudget >= 0) client.setPrewarmBudget((uint64_t)prewarmBudget << 20);
+    if (preloadBudget >= 0) client.setPreloadBudget((uint64_t)preloadBudget << 20);
+    client.setRemoteFilesystemToDisk(remoteFilesystemToDisk);
+    if (tssServerSpec) {
+        tss = std::make_shared<tssServer>(tssServer::parseSpec(tssServerSpec));
+        client.setTSSURL(tss->url().c_str());
+    }
+    if (simulateSpec) {
+        retassure(!ipsw || (flags & FLAG_IS_PWN_DFU), "--simulate can't restore, the restore itself needs a real device. An iPSW is only used with --use-pwndfu\n");
+        client.setTransport(simulator = std::make_shared<simulatedDevice>(simulatedDevice::parseSpec(simulateSpec)));
+    }
+    if (downloadVersion.size() && !apticketPaths.size() && downloadModel.size()) {
+        //nothing to restore and the device is known, no need to wait for one
+        client.downloadIPSW(downloadVersion.c_str(), downloadModel.c_str());
+        info("Done\n");
+        return 0;
+    }
     retassure(client.init(),"can't init, no device found\n");
     
     printf("futurerestore init done\n");
@@ -214,12 +350,56 @@ int main_r(int argc, const char * argv[]) {
     
     if (exitRecovery) {
         client.exitRecovery();
+        if (simulator) client.printTimingReport();
+        if (metricsPath) client.writeMetrics(metricsPath);
         info("Done\n");
         return 0;
     }
     
+    if (simulator) {
+        if (apticketPaths.size()) client.loadAPTickets(apticketPaths);
+        if (flags & FLAG_IS_PWN_DFU) {
+            //the Odysseus bootchain: iBSS/iBEC patching, DFU uploads and the ApNonce generator hax
+            retassure(ipsw, "--simulate with --use-pwndfu needs the iPSW to take iBSS and iBEC from\n");
+            try {
+                client.putDeviceIntoRecovery();
+                client.doJustBoot(ipsw, (bootargs) ? bootargs : "", true);
+                printf("Done: entering pwned recovery succeeded!\n");
+            } catch (tihmstar::exception &e) {
+                e.dump();
+                printf("Done: entering pwned recovery failed!\n");
+                err = e.code();
+            }
+            client.printTimingReport();
+            if (metricsPath) client.writeMetrics(metricsPath);
+            return err;
+        }
+        client.putDeviceIntoRecovery();
+        if (flags & FLAG_WAIT) {
+            client.waitForNonce();
+        } else {
+            std::string nonce = simulator->nonceForBoot(simulator->bootCount() + simulator->settings().targetResets);
+            client.waitForNonce({nonce.data()}, nonce.size());
+        }
+        client.exitRecovery();
+        client.printTimingReport();
+        if (metricsPath) client.writeMetrics(metricsPath);
+        info("Done\n");
+        return 0;
+    }
+    
+    if (downloadVersion.size()) {
+        const char *downloadedIPSW = client.downloadIPSW(downloadVersion.c_str(), (downloadModel.size()) ? downloadModel.c_str() : NULL);
+        if (!apticketPaths.size()) {
+            info("Done\n");
+            return 0;
+        }
+        if (!ipsw) ipsw = downloadedIPSW;
+    }
+    
     try {
         if (apticketPaths.size()) client.loadAPTickets(apticketPaths);
+        if (!ipsw && catalogPath && apticketPaths.size()) ipsw = client.getIPSWFromCatalog(catalogPath);
         
         if (!(
               ((apticketPaths.size() && ipsw)
@@ -254,7 +434,10 @@ int main_r(int argc, const char * argv[]) {
             }
             
             versVals.basebandMode = kBasebandModeWithoutBaseband;
-            if (!client.is32bit() && !(isSepManifestSigned = isManifestSignedForDevice(client.sepManifestPath(), &devVals, &versVals))){
+            //tsschecker always asks Apple, which a replaying run must not depend on
+            if (tss && tss->isOffline()) {
+                info("[tss] replaying, not checking signing status of SEP and baseband\n");
+            }else if (!client.is32bit() && !(isSepManifestSigned = isManifestSignedForDevice(client.sepManifestPath(), &devVals, &versVals))){
                 reterror("SEP firmware is NOT being signed!\n");
             }
             if (flags & FLAG_NO_BASEBAND){
@@ -282,12 +465,12 @@ int main_r(int argc, const char * argv[]) {
                 if (!(devVals.bbgcid = client.getBasebandGoldCertIDFromDevice())){
                     printf("[WARNING] using tsschecker's fallback to get BasebandGoldCertID. This might result in invalid baseband signing status information\n");
                 }
-                if (!(isBasebandSigned = isManifestSignedForDevice(client.basebandManifestPath(), &devVals, &versVals))) {
+                if (!(tss && tss->isOffline()) && !(isBasebandSigned = isManifestSignedForDevice(client.basebandManifestPath(), &devVals, &versVals))) {
                     reterror("baseband firmware is NOT being signed!\n");
                 }
             }
         }
-        client.downloadLatestFirmwareComponents();
+        if (!bootargs) client.downloadLatestFirmwareComponents(); //booting doesn't flash any firmware
         client.putDeviceIntoRecovery();
         if (flags & FLAG_WAIT){
             client.waitForNonce();
@@ -303,10 +486,18 @@ int main_r(int argc, const char * argv[]) {
             client.doJustBoot(ipsw,bootargs);
         else
             client.doRestore(ipsw);
-        printf("Done: restoring succeeded!\n");
+        printf("Done: %s succeeded!\n", (bootargs) ? "booting" : "restoring");
     } catch (tihmstar::exception &e) {
         e.dump();
-        printf("Done: restoring failed!\n");
+        printf("Done: %s failed!\n", (bootargs) ? "booting" : "restoring");
+    }
+    if (tss) tss->printSummary();
+    if (metricsPath) {
+        try {
+            client.writeMetrics(metricsPath);
+        } catch (tihmstar::exception &e) {
+            e.dump();
+        }
     }
     
 error:
@@ -0,0 +1,244 @@
+//
+//  remotefs.cpp
+//  futurerestore
+//
+//  Serves a file of a remote iPSW to ASR without storing it on disk. Sequential reads come
+//  out of a bounded read-ahead window, everything else is fetched from the server directly.
+//
+
+#include <libgeneral/macros.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <algorithm>
+#include "remotefs.hpp"
+
+#ifdef HAVE_FUSE
+#   define FUSE_USE_VERSION 26
+#   include <fuse.h>
+#endif // HAVE_FUSE
+
+extern "C"{
+#include "common.h"
+}
+
+using namespace tihmstar;
+
+#pragma mark remoteFileStream
+
+remoteFileStream::remoteFileStream(std::shared_ptr<remoteipsw> ipsw, const std::string &name, size_t windowSize)
+    : _ipsw(ipsw), _name(name), _windowSize(std::max<size_t>(windowSize, 2*1024*1024)), _http(ipsw->url())
+{
+    const remoteipsw::entry *e = NULL;
+    retassure(e = _ipsw->getEntry(_name), "%s does not exist in %s\n", _name.c_str(), _ipsw->url().c_str());
+    retassure(e->method == 0, "%s is compressed, it can only be extracted as a whole\n", _name.c_str());
+    _size = e->size;
+    _dataStart = _ipsw->dataOffset(e);
+    _producer = std::thread([this]{
+        produce();
+    });
+}
+
+remoteFileStream::~remoteFileStream(){
+    stop();
+    if (_producer.joinable()) _producer.join();
+}
+
+void remoteFileStream::stop(){
+    {
+        std::unique_lock<std::mutex> ul(_lock);
+        _stop = true;
+    }
+    _cond.notify_all();
+}
+
+void remoteFileStream::produce(){
+    std::string err;
+    try {
+        _ipsw->extract(_name, [this](const char *buf, size_t size){
+            {
+                std::unique_lock<std::mutex> ul(_lock);
+                _cond.wait(ul, [&]{return _stop || _windowEnd < _readPos + _windowSize/2;});
+                if (_stop) return false;
+                _chunks.emplace_back(buf, size);
+                _windowEnd += size;
+                //keep half a window behind the reader, kernel read-ahead doesn't always arrive in order
+                while (_chunks.size() > 1 && _windowStart + _chunks.front().size() + _windowSize/2 <= _readPos) {
+                    _windowStart += _chunks.front().size();
+                    _chunks.pop_front();
+                }
+            }
+            _cond.notify_all();
+            return true;
+        }, _windowSize/2);
+    } catch (tihmstar::exception &e) {
+        err = e.what();
+    } catch (std::exception &e) {
+        err = e.what();
+    }
+    {
+        std::unique_lock<std::mutex> ul(_lock);
+        _done = true;
+        _error = err;
+    }
+    _cond.notify_all();
+    if (err.size()) error("[remote] streaming %s failed: %s\n", _name.c_str(), err.c_str());
+}
+
+void remoteFileStream::copyFromWindow(char *buf, size_t size, uint64_t offset){
+    uint64_t chunkStart = _windowStart;
+    for (auto &chunk : _chunks) {
+        uint64_t chunkEnd = chunkStart + chunk.size();
+        if (offset < chunkEnd && size) {
+            size_t copySize = (size_t)std::min<uint64_t>(size, chunkEnd - offset);
+            memcpy(buf, chunk.data() + (offset - chunkStart), copySize);
+            buf += copySize;
+            offset += copySize;
+            size -= copySize;
+        }
+        chunkStart = chunkEnd;
+    }
+    assure(!size);
+}
+
+size_t remoteFileStream::readDirect(char *buf, size_t size, uint64_t offset){
+    std::unique_lock<std::mutex> ul(_httpLock);
+    size_t didRead = 0;
+    _http.get(_dataStart + offset, _dataStart + offset + size, [&](const char *data, size_t dataSize){
+        if (didRead + dataSize > size) return false;
+        memcpy(buf + didRead, data, dataSize);
+        didRead += dataSize;
+        return true;
+    });
+    _directBytes += didRead;
+    return didRead;
+}
+
+size_t remoteFileStream::read(char *buf, size_t size, uint64_t offset){
+    if (offset >= _size) return 0;
+    size = (size_t)std::min<uint64_t>(size, _size - offset);
+    {
+        std::unique_lock<std::mutex> ul(_lock);
+        bool inWindow = offset >= _windowStart && offset + size <= _windowEnd;
+        //reads a little past what arrived so far are the sequential ones, they wait for the window to catch up
+        bool aheadOfWindow = offset >= _windowStart && offset < _windowEnd + _windowSize/2 && size <= _windowSize/2 && !_done;
+        if (inWindow || aheadOfWindow) {
+            if (offset > _readPos) _readPos = offset;
+            _cond.notify_all();
+            _cond.wait(ul, [&]{return _stop || _done || offset + size <= _windowEnd;});
+            retassure(!_stop, "reading %s was stopped\n", _name.c_str());
+            if (offset + size <= _windowEnd) {
+                copyFromWindow(buf, size, offset);
+                _readPos = std::max(_readPos, offset + size);
+                ul.unlock();
+                _cond.notify_all();
+                return size;
+            }
+            retassure(_error.empty(), "streaming %s failed: %s", _name.c_str(), _error.c_str());
+        }
+    }
+    //the UDIF trailer, ASR's out of band requests and anything the window already moved past
+    return readDirect(buf, size, offset);
+}
+
+#pragma mark remoteFileMount
+
+#ifdef HAVE_FUSE
+static remoteFileMount *mountFromContext(){
+    return (remoteFileMount*)fuse_get_context()->private_data;
+}
+
+static bool isMountedFile(const char *path){
+    return path[0] == '/' && mountFromContext()->fileName() == path+1;
+}
+
+static int remotefsGetattr(const char *path, struct stat *st){
+    memset(st, 0, sizeof(*st));
+    if (!strcmp(path, "/")) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+    } else if (isMountedFile(path)) {
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        st->st_size = (off_t)mountFromContext()->stream().size();
+    } else {
+        return -ENOENT;
+    }
+    return 0;
+}
+
+static int remotefsReaddir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi){
+    if (strcmp(path, "/")) return -ENOENT;
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    filler(buf, mountFromContext()->fileName().c_str(), NULL, 0);
+    return 0;
+}
+
+static int remotefsOpen(const char *path, struct fuse_file_info *fi){
+    if (!isMountedFile(path)) return -ENOENT;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+    return 0;
+}
+
+static int remotefsRead(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+    try {
+        return (int)mountFromContext()->stream().read(buf, size, (uint64_t)offset);
+    } catch (tihmstar::exception &e) {
+        error("[remote] %s", e.what());
+        return -EIO;
+    }
+}
+#endif // HAVE_FUSE
+
+remoteFileMount::remoteFileMount(std::shared_ptr<remoteipsw> ipsw, const std::string &name, const std::string &mountPoint, size_t windowSize)
+    : _stream(ipsw, name, windowSize), _mountPoint(mountPoint)
+{
+#ifdef HAVE_FUSE
+    struct fuse_operations ops = {};
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    size_t slash = name.rfind('/');
+    cleanup([&]{
+        fuse_opt_free_args(&args);
+    });
+    _fileName = (slash == std::string::npos) ? name : name.substr(slash+1);
+
+    ops.getattr = remotefsGetattr;
+    ops.readdir = remotefsReaddir;
+    ops.open = remotefsOpen;
+    ops.read = remotefsRead;
+
+    retassure(!fuse_opt_add_arg(&args, "futurerestore") && !fuse_opt_add_arg(&args, "-oro,fsname=futurerestore"), "failed to set up FUSE arguments\n");
+    retassure(_chan = fuse_mount(_mountPoint.c_str(), &args), "failed to mount FUSE filesystem on %s\n", _mountPoint.c_str());
+    if (!(_fuse = fuse_new((struct fuse_chan*)_chan, &args, &ops, sizeof(ops), this))) {
+        fuse_unmount(_mountPoint.c_str(), (struct fuse_chan*)_chan);
+        _chan = NULL;
+        reterror("failed to create FUSE filesystem on %s\n", _mountPoint.c_str());
+    }
+    //single threaded, so ASR's reads reach the stream in the order they were issued
+    _loop = std::thread([this]{
+        fuse_loop((struct fuse*)_fuse);
+    });
+#else
+    reterror("futurerestore was built without FUSE support\n");
+#endif // HAVE_FUSE
+}
+
+remoteFileMount::~remoteFileMount(){
+    //a read blocked on the window would keep the loop from ever returning
+    _stream.stop();
+#ifdef HAVE_FUSE
+    if (_fuse) fuse_exit((struct fuse*)_fuse);
+    if (_chan) fuse_unmount(_mountPoint.c_str(), (struct fuse_chan*)_chan);
+    if (_loop.joinable()) _loop.join();
+    if (_fuse) fuse_destroy((struct fuse*)_fuse);
+#endif // HAVE_FUSE
+}
+
+bool remoteFileMount::isSupported(){
+#ifdef HAVE_FUSE
+    return true;
+#else
+    return false;
+#endif // HAVE_FUSE
+}
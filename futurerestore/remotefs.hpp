@@ -0,0 +1,82 @@
+//
+//  remotefs.hpp
+//  futurerestore
+//
+//  Serves a file of a remote iPSW to ASR without storing it on disk. Sequential reads come
+//  out of a bounded read-ahead window, everything else is fetched from the server directly.
+//
+
+#ifndef remotefs_hpp
+#define remotefs_hpp
+
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "remoteipsw.hpp"
+
+class remoteFileStream {
+    std::shared_ptr<remoteipsw> _ipsw;
+    std::string _name;
+    uint64_t _size = 0;
+    uint64_t _dataStart = 0;
+    size_t _windowSize = 0;
+    httpRange _http;
+    std::mutex _httpLock;
+
+    //[_windowStart, _windowEnd) of the file, half of the window may lie behind _readPos and half ahead of it
+    std::mutex _lock;
+    std::condition_variable _cond;
+    std::deque<std::string> _chunks;
+    uint64_t _windowStart = 0;
+    uint64_t _windowEnd = 0;
+    uint64_t _readPos = 0;
+    bool _done = false;
+    bool _stop = false;
+    std::string _error;
+    std::thread _producer;
+    std::atomic<uint64_t> _directBytes{0};
+
+    void produce();
+    void copyFromWindow(char *buf, size_t size, uint64_t offset);
+    size_t readDirect(char *buf, size_t size, uint64_t offset);
+public:
+    //only stored entries, deflated ones can't be read at random offsets
+    remoteFileStream(std::shared_ptr<remoteipsw> ipsw, const std::string &name, size_t windowSize = REMOTEIPSW_DEFAULT_PREFETCH);
+    remoteFileStream(const remoteFileStream &) = delete;
+    ~remoteFileStream();
+
+    uint64_t size() const {return _size;};
+    //copies up to size bytes at offset into buf and returns how many, 0 at the end of the file
+    size_t read(char *buf, size_t size, uint64_t offset);
+    //makes reads waiting for the window fail, so whoever is blocked in read returns
+    void stop();
+    //bytes that were read outside the window and had to be fetched on their own
+    uint64_t directBytes() const {return _directBytes;};
+};
+
+//a read-only FUSE mount at mountPoint containing the file as <mountPoint>/<basename of name>
+class remoteFileMount {
+    remoteFileStream _stream;
+    std::string _mountPoint;
+    std::string _fileName;
+    void *_fuse = NULL;
+    void *_chan = NULL;
+    std::thread _loop;
+public:
+    remoteFileMount(std::shared_ptr<remoteipsw> ipsw, const std::string &name, const std::string &mountPoint, size_t windowSize = REMOTEIPSW_DEFAULT_PREFETCH);
+    remoteFileMount(const remoteFileMount &) = delete;
+    ~remoteFileMount();
+    //false if futurerestore was built without FUSE
+    static bool isSupported();
+
+    const std::string &fileName() const {return _fileName;};
+    std::string path() const {return _mountPoint + "/" + _fileName;};
+    remoteFileStream &stream(){return _stream;};
+};
+
+#endif /* remotefs_hpp */
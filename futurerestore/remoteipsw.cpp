@@ -0,0 +1,564 @@
+//
+//  remoteipsw.cpp
+//  futurerestore
+//
+//  Random access to iPSWs on http(s) servers using range requests.
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <curl/curl.h>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <sys/stat.h>
+#include <plist/plist.h>
+#include "remoteipsw.hpp"
+#include "utils.hpp"
+
+extern "C"{
+#include "common.h"
+}
+
+#define ZIP_LOCAL_HEADER_SIGNATURE      0x04034b50
+#define ZIP_CD_HEADER_SIGNATURE         0x02014b50
+#define ZIP_EOCD_SIGNATURE              0x06054b50
+#define ZIP64_EOCD_SIGNATURE            0x06064b50
+#define ZIP64_EOCD_LOCATOR_SIGNATURE    0x07064b50
+#define ZIP64_EXTRA_FIELD_ID            0x0001
+
+#define ZIP_LOCAL_HEADER_SIZE           30
+#define ZIP_CD_HEADER_SIZE              46
+#define ZIP_EOCD_SIZE                   22
+#define ZIP64_EOCD_SIZE                 56
+#define ZIP64_EOCD_LOCATOR_SIZE         20
+#define ZIP_MAX_COMMENT_SIZE            0xffff
+
+#define STREAM_CHUNK_SIZE               (4*1024*1024)
+#define STREAM_MAX_FETCHERS             REMOTEIPSW_DEFAULT_CONNECTIONS
+#define STREAM_OUT_BUFFER_SIZE          (1024*1024)
+
+#define DOWNLOAD_JOURNAL_INTERVAL       (64*1024*1024)
+
+using namespace tihmstar;
+
+static inline uint16_t le16(const char *p){
+    const uint8_t *b = (const uint8_t*)p;
+    return (uint16_t)(b[0] | (b[1] << 8));
+}
+
+static inline uint32_t le32(const char *p){
+    const uint8_t *b = (const uint8_t*)p;
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static inline uint64_t le64(const char *p){
+    return (uint64_t)le32(p) | ((uint64_t)le32(p+4) << 32);
+}
+
+#pragma mark httpRange
+
+struct rangeRequest {
+    CURL *curl;
+    const std::function<bool(const char *, size_t)> *cb;
+    const std::atomic<bool> *cancel;
+    uint64_t received;
+    long responseCode;
+};
+
+static size_t rangeWriteCallback(char *ptr, size_t size, size_t nmemb, void *userdata){
+    rangeRequest *req = (rangeRequest*)userdata;
+    size_t len = size*nmemb;
+    if (!req->responseCode) {
+        curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &req->responseCode);
+        //a server ignoring the range header sends the whole file, don't swallow that
+        if (req->responseCode != 206) return 0;
+    }
+    if (req->cancel && *req->cancel) return 0;
+    if (!(*req->cb)(ptr, len)) return 0;
+    req->received += len;
+    return len;
+}
+
+static int rangeProgressCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow){
+    const std::atomic<bool> *cancel = (const std::atomic<bool> *)clientp;
+    return (cancel && *cancel) ? 1 : 0;
+}
+
+static std::once_flag curlInitOnce;
+
+httpRange::httpRange(const std::string &url)
+    : _url(url)
+{
+    std::call_once(curlInitOnce, []{curl_global_init(CURL_GLOBAL_ALL);});
+    retassure(_curl = curl_easy_init(), "failed to init curl\n");
+}
+
+httpRange::~httpRange(){
+    if (_curl) {
+        curl_easy_cleanup((CURL*)_curl);
+        _curl = NULL;
+    }
+}
+
+uint64_t httpRange::size(){
+    CURL *curl = (CURL*)_curl;
+    curl_off_t len = -1;
+    long code = 0;
+    CURLcode res = CURLE_OK;
+
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, _url.c_str());
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    retassure((res = curl_easy_perform(curl)) == CURLE_OK, "failed to query %s: %s\n", _url.c_str(), curl_easy_strerror(res));
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    retassure(code == 200, "failed to query %s: HTTP %ld\n", _url.c_str(), code);
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len);
+    retassure(len > 0, "server did not report the size of %s\n", _url.c_str());
+    return (uint64_t)len;
+}
+
+void httpRange::get(uint64_t start, uint64_t end, std::function<bool(const char *, size_t)> cb){
+    CURL *curl = (CURL*)_curl;
+    CURLcode res = CURLE_OK;
+    char range[64];
+    rangeRequest req = {curl, &cb, _cancel, 0, 0};
+    assure(end > start);
+
+    snprintf(range, sizeof(range), "%llu-%llu", (unsigned long long)start, (unsigned long long)end-1);
+
+    //keep the handle (and with it the connection) between requests, only reset the options
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, _url.c_str());
+    curl_easy_setopt(curl, CURLOPT_RANGE, range);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, rangeWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, rangeProgressCallback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, _cancel);
+    //give up on stalled connections instead of hanging the restore forever
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+
+    res = curl_easy_perform(curl);
+    retassure(!_cancel || !*_cancel, "request to %s was cancelled\n", _url.c_str());
+    if (!req.responseCode) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &req.responseCode);
+    retassure(req.responseCode == 206 || (req.responseCode == 0 && res != CURLE_OK), "server does not support range requests for %s (HTTP %ld)\n", _url.c_str(), req.responseCode);
+    retassure(res == CURLE_OK, "failed to fetch range %s of %s: %s\n", range, _url.c_str(), curl_easy_strerror(res));
+    retassure(req.received == end-start, "short read on range %s of %s (got %llu bytes)\n", range, _url.c_str(), (unsigned long long)req.received);
+}
+
+#pragma mark remoteipsw
+
+remoteipsw::remoteipsw(const std::string &url)
+    : _url(url)
+{
+    readCentralDirectory();
+}
+
+bool remoteipsw::isRemote(const char *path){
+    return path && (!strncasecmp(path, "http://", strlen("http://")) || !strncasecmp(path, "https://", strlen("https://")));
+}
+
+const remoteipsw::entry *remoteipsw::getEntry(const std::string &name) const{
+    auto e = _entries.find(name);
+    return (e == _entries.end()) ? NULL : &e->second;
+}
+
+void remoteipsw::readCentralDirectory(){
+    httpRange http(_url);
+    std::string tail;
+    std::string cd;
+    uint64_t tailStart = 0;
+    uint64_t cdOffset = 0;
+    uint64_t cdSize = 0;
+    uint64_t entryCnt = 0;
+    ssize_t eocd = -1;
+    auto append = [](std::string &dst){
+        return [&dst](const char *buf, size_t size){dst.append(buf, size); return true;};
+    };
+
+    _size = http.size();
+    retassure(_size >= ZIP_EOCD_SIZE, "%s is too small to be an iPSW\n", _url.c_str());
+
+    //the end of central directory record sits somewhere in the last 64k (+ record sizes) of the file
+    tailStart = _size - std::min<uint64_t>(_size, ZIP_MAX_COMMENT_SIZE + ZIP_EOCD_SIZE + ZIP64_EOCD_LOCATOR_SIZE);
+    http.get(tailStart, _size, append(tail));
+
+    for (ssize_t i = (ssize_t)tail.size() - ZIP_EOCD_SIZE; i >= 0; i--) {
+        if (le32(&tail[i]) == ZIP_EOCD_SIGNATURE) {
+            eocd = i;
+            break;
+        }
+    }
+    retassure(eocd >= 0, "%s is not a zip file\n", _url.c_str());
+
+    entryCnt = le16(&tail[eocd+10]);
+    cdSize = le32(&tail[eocd+12]);
+    cdOffset = le32(&tail[eocd+16]);
+
+    if (entryCnt == 0xffff || cdSize == 0xffffffff || cdOffset == 0xffffffff) {
+        std::string zip64eocd;
+        uint64_t zip64eocdOffset = 0;
+        retassure(eocd >= ZIP64_EOCD_LOCATOR_SIZE && le32(&tail[eocd-ZIP64_EOCD_LOCATOR_SIZE]) == ZIP64_EOCD_LOCATOR_SIGNATURE, "missing zip64 end of central directory locator in %s\n", _url.c_str());
+        zip64eocdOffset = le64(&tail[eocd-ZIP64_EOCD_LOCATOR_SIZE+8]);
+        retassure(zip64eocdOffset + ZIP64_EOCD_SIZE <= _size, "invalid zip64 end of central directory offset in %s\n", _url.c_str());
+        http.get(zip64eocdOffset, zip64eocdOffset + ZIP64_EOCD_SIZE, append(zip64eocd));
+        retassure(le32(zip64eocd.data()) == ZIP64_EOCD_SIGNATURE, "invalid zip64 end of central directory in %s\n", _url.c_str());
+        entryCnt = le64(&zip64eocd[32]);
+        cdSize = le64(&zip64eocd[40]);
+        cdOffset = le64(&zip64eocd[48]);
+    }
+    retassure(cdOffset + cdSize <= _size, "invalid central directory in %s\n", _url.c_str());
+
+    if (cdOffset >= tailStart) {
+        cd = tail.substr(cdOffset - tailStart, cdSize);
+    } else {
+        cd.reserve(cdSize);
+        http.get(cdOffset, cdOffset + cdSize, append(cd));
+    }
+
+    for (size_t pos = 0, i = 0; i < entryCnt; i++) {
+        entry e = {};
+        uint16_t nameLen = 0;
+        uint16_t extraLen = 0;
+        uint16_t commentLen = 0;
+        retassure(pos + ZIP_CD_HEADER_SIZE <= cd.size() && le32(&cd[pos]) == ZIP_CD_HEADER_SIGNATURE, "corrupted central directory in %s\n", _url.c_str());
+        e.method = le16(&cd[pos+10]);
+        e.crc32 = le32(&cd[pos+16]);
+        e.compressedSize = le32(&cd[pos+20]);
+        e.size = le32(&cd[pos+24]);
+        nameLen = le16(&cd[pos+28]);
+        extraLen = le16(&cd[pos+30]);
+        commentLen = le16(&cd[pos+32]);
+        e.localHeaderOffset = le32(&cd[pos+42]);
+        retassure(pos + ZIP_CD_HEADER_SIZE + nameLen + extraLen + commentLen <= cd.size(), "corrupted central directory in %s\n", _url.c_str());
+        e.name = cd.substr(pos + ZIP_CD_HEADER_SIZE, nameLen);
+
+        //zip64 extended information only carries the fields which overflowed, in this order
+        for (size_t x = pos + ZIP_CD_HEADER_SIZE + nameLen; x + 4 <= pos + ZIP_CD_HEADER_SIZE + nameLen + extraLen;) {
+            uint16_t fieldId = le16(&cd[x]);
+            uint16_t fieldSize = le16(&cd[x+2]);
+            const char *field = &cd[x+4];
+            const char *fieldEnd = field + fieldSize;
+            if (fieldId == ZIP64_EXTRA_FIELD_ID) {
+                if (e.size == 0xffffffff && field+8 <= fieldEnd) e.size = le64(field), field += 8;
+                if (e.compressedSize == 0xffffffff && field+8 <= fieldEnd) e.compressedSize = le64(field), field += 8;
+                if (e.localHeaderOffset == 0xffffffff && field+8 <= fieldEnd) e.localHeaderOffset = le64(field), field += 8;
+            }
+            x += 4 + fieldSize;
+        }
+        pos += ZIP_CD_HEADER_SIZE + nameLen + extraLen + commentLen;
+
+        if (e.name.size() && e.name.back() == '/') continue; //directory
+        _entries[e.name] = e;
+    }
+    debug("[remoteipsw] %s: %llu bytes, %zu files\n", _url.c_str(), (unsigned long long)_size, _entries.size());
+}
+
+//fetches [start, end) in STREAM_CHUNK_SIZE pieces on up to fetcherCnt connections and hands them to consume in order.
+//fetchers never run more than maxBuffered chunks ahead of the consumer, which bounds memory use. consume returns false to stop early
+static void fetchInOrder(const std::string &url, uint64_t start, uint64_t end, size_t fetcherCnt, size_t maxBuffered, const std::atomic<bool> *cancel, std::function<bool(std::string &chunk)> consume){
+    size_t chunkCnt = (size_t)((end - start + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE);
+    std::mutex lock;
+    std::condition_variable cond;
+    std::map<size_t, std::string> ready;
+    size_t nextFetch = 0;
+    size_t consumed = 0;
+    bool stop = false;
+    std::string fetchError;
+    std::vector<std::thread> fetchers;
+
+    cleanup([&]{
+        {
+            std::unique_lock<std::mutex> ul(lock);
+            stop = true;
+        }
+        cond.notify_all();
+        for (auto &t : fetchers) t.join();
+    });
+
+    maxBuffered = std::max<size_t>(2, maxBuffered);
+    fetcherCnt = std::min<size_t>(std::min<size_t>(std::max<size_t>(1, fetcherCnt), maxBuffered), chunkCnt);
+
+    for (size_t i = 0; i < fetcherCnt; i++) {
+        fetchers.push_back(std::thread([&]{
+            std::string err;
+            try {
+                httpRange http(url);
+                http.setCancelFlag(cancel);
+                while (true) {
+                    size_t idx = 0;
+                    uint64_t chunkStart = 0;
+                    uint64_t chunkEnd = 0;
+                    std::string chunk;
+                    {
+                        std::unique_lock<std::mutex> ul(lock);
+                        cond.wait(ul, [&]{return stop || nextFetch >= chunkCnt || nextFetch < consumed + maxBuffered;});
+                        if (stop || nextFetch >= chunkCnt) break;
+                        idx = nextFetch++;
+                    }
+                    chunkStart = start + (uint64_t)idx*STREAM_CHUNK_SIZE;
+                    chunkEnd = std::min<uint64_t>(chunkStart + STREAM_CHUNK_SIZE, end);
+                    chunk.reserve(chunkEnd-chunkStart);
+                    http.get(chunkStart, chunkEnd, [&chunk](const char *buf, size_t size){chunk.append(buf, size); return true;});
+                    {
+                        std::unique_lock<std::mutex> ul(lock);
+                        ready[idx] = std::move(chunk);
+                    }
+                    cond.notify_all();
+                }
+            } catch (tihmstar::exception &ex) {
+                err = ex.what();
+            } catch (std::exception &ex) {
+                err = ex.what();
+            }
+            if (err.size()) {
+                {
+                    std::unique_lock<std::mutex> ul(lock);
+                    if (fetchError.empty()) fetchError = err;
+                    stop = true;
+                }
+                cond.notify_all();
+            }
+        }));
+    }
+
+    for (size_t idx = 0; idx < chunkCnt; idx++) {
+        std::string chunk;
+        {
+            std::unique_lock<std::mutex> ul(lock);
+            cond.wait(ul, [&]{return fetchError.size() || ready.count(idx);});
+            retassure(fetchError.empty(), "%s", fetchError.c_str());
+            chunk = std::move(ready[idx]);
+            ready.erase(idx);
+            consumed = idx+1;
+        }
+        cond.notify_all();
+        if (!consume(chunk)) break;
+    }
+}
+
+uint64_t remoteipsw::dataOffset(const entry *e){
+    std::string localHeader;
+    uint64_t dataStart = 0;
+    {
+        httpRange http(_url);
+        http.setCancelFlag(&_cancel);
+        http.get(e->localHeaderOffset, e->localHeaderOffset + ZIP_LOCAL_HEADER_SIZE, [&localHeader](const char *buf, size_t size){localHeader.append(buf, size); return true;});
+    }
+    retassure(le32(localHeader.data()) == ZIP_LOCAL_HEADER_SIGNATURE, "invalid local header for %s\n", e->name.c_str());
+    dataStart = e->localHeaderOffset + ZIP_LOCAL_HEADER_SIZE + le16(&localHeader[26]) + le16(&localHeader[28]);
+    retassure(dataStart + e->compressedSize <= _size, "%s exceeds the bounds of %s\n", e->name.c_str(), _url.c_str());
+    return dataStart;
+}
+
+bool remoteipsw::extract(const std::string &name, std::function<bool(const char *, size_t)> sink, size_t prefetchSize, bool printProgress){
+    const entry *e = NULL;
+    uint64_t dataStart = 0;
+    uint64_t dataEnd = 0;
+    z_stream zs = {};
+    bool zsInited = false;
+    bool stopped = false;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uint64_t written = 0;
+    std::vector<char> outbuf;
+    int lastProgress = -1;
+    cleanup([&]{
+        if (zsInited) inflateEnd(&zs);
+    });
+
+    retassure(e = getEntry(name), "%s does not exist in %s\n", name.c_str(), _url.c_str());
+    retassure(e->method == 0 || e->method == Z_DEFLATED, "unsupported compression method %d for %s\n", e->method, name.c_str());
+    dataStart = dataOffset(e);
+    dataEnd = dataStart + e->compressedSize;
+
+    if (e->method == Z_DEFLATED) {
+        retassure(inflateInit2(&zs, -MAX_WBITS) == Z_OK, "failed to init inflate\n");
+        zsInited = true;
+        outbuf.resize(STREAM_OUT_BUFFER_SIZE);
+    }
+
+    auto emit = [&](const char *buf, size_t size){
+        crc = crc32(crc, (const Bytef*)buf, (uInt)size);
+        written += size;
+        return (stopped = !sink(buf, size)) == false;
+    };
+
+    if (dataEnd > dataStart) {
+        fetchInOrder(_url, dataStart, dataEnd, STREAM_MAX_FETCHERS, prefetchSize / STREAM_CHUNK_SIZE, &_cancel, [&](std::string &chunk){
+            if (e->method == 0) {
+                if (!emit(chunk.data(), chunk.size())) return false;
+            } else {
+                int ret = Z_OK;
+                zs.next_in = (Bytef*)chunk.data();
+                zs.avail_in = (uInt)chunk.size();
+                do {
+                    zs.next_out = (Bytef*)outbuf.data();
+                    zs.avail_out = (uInt)outbuf.size();
+                    ret = inflate(&zs, Z_NO_FLUSH);
+                    retassure(ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR, "failed to inflate %s (%d)\n", name.c_str(), ret);
+                    if (!emit(outbuf.data(), outbuf.size() - zs.avail_out)) return false;
+                } while (zs.avail_out == 0 && ret != Z_STREAM_END);
+            }
+
+            if (printProgress) {
+                int progress = (int)(((zs.total_in ? zs.total_in : written)*100)/e->compressedSize);
+                if (progress != lastProgress) print_progress_bar(lastProgress = progress);
+            }
+            return true;
+        });
+    }
+    if (stopped) return false;
+
+    retassure(written == e->size, "size mismatch for %s (expected %llu, got %llu)\n", name.c_str(), (unsigned long long)e->size, (unsigned long long)written);
+    retassure(crc == e->crc32, "crc32 mismatch for %s\n", name.c_str());
+    return true;
+}
+
+void remoteipsw::extractToFile(const std::string &name, const std::string &dst, size_t prefetchSize, bool printProgress){
+    //staging directories are shared between concurrent runs, keep their partial files apart
+    std::string partPath = dst + ".part" + std::to_string(getpid());
+    FILE *f = NULL;
+    bool didMove = false;
+    cleanup([&]{
+        safeFreeCustom(f, fclose);
+        if (!didMove) remove(partPath.c_str());
+    });
+
+    retassure(f = fopen(partPath.c_str(), "wb"), "failed to create %s\n", partPath.c_str());
+    extract(name, [&](const char *buf, size_t size){
+        retassure(fwrite(buf, 1, size, f) == size, "failed to write %s\n", partPath.c_str());
+        return true;
+    }, prefetchSize, printProgress);
+    int closeErr = fclose(f);
+    f = NULL;
+    retassure(!closeErr, "failed to write %s\n", partPath.c_str());
+    retassure(!rename(partPath.c_str(), dst.c_str()), "failed to move %s to %s\n", partPath.c_str(), dst.c_str());
+    didMove = true;
+}
+
+#pragma mark download
+
+static plist_t loadJournal(const std::string &path){
+    plist_t journal = NULL;
+    std::string buf;
+    if (!readWholeFile(path, buf)) return NULL;
+    plist_from_memory(buf.data(), (uint32_t)buf.size(), &journal);
+    if (journal && plist_get_node_type(journal) != PLIST_DICT) {
+        plist_free(journal);
+        journal = NULL;
+    }
+    return journal;
+}
+
+//only plain values go in here, the hash of the prefix is recomputed from the .part file on resume
+static void saveJournal(const std::string &path, const std::string &url, uint64_t size, const std::string &sha1, uint64_t completeOffset){
+    plist_t journal = plist_new_dict();
+    char *bin = NULL;
+    uint32_t binSize = 0;
+    cleanup([&]{
+        safeFree(bin);
+        safeFreeCustom(journal, plist_free);
+    });
+    plist_dict_set_item(journal, "URL", plist_new_string(url.c_str()));
+    plist_dict_set_item(journal, "Size", plist_new_uint(size));
+    plist_dict_set_item(journal, "SHA1", plist_new_string(sha1.c_str()));
+    plist_dict_set_item(journal, "CompleteOffset", plist_new_uint(completeOffset));
+    plist_to_bin(journal, &bin, &binSize);
+    retassure(writeFileAtomically(path, bin, binSize), "failed to write %s\n", path.c_str());
+}
+
+void remoteipsw::download(const std::string &url, const std::string &dst, const std::string &sha1, size_t connections){
+    std::string partPath = dst + ".part";
+    std::string journalPath = dst + ".journal";
+    uint64_t size = 0;
+    uint64_t hashedOffset = 0;
+    uint64_t journaledOffset = 0;
+    sha1Hasher hasher;
+    FILE *f = NULL;
+    plist_t journal = NULL;
+    int lastProgress = -1;
+    cleanup([&]{
+        safeFreeCustom(f, fclose);
+        safeFreeCustom(journal, plist_free);
+    });
+
+    {
+        httpRange http(url);
+        size = http.size();
+    }
+
+    //only resume if the journal describes the same file and the data it vouches for is still there
+    if ((journal = loadJournal(journalPath))) {
+        plist_t node = NULL;
+        uint64_t jsize = 0;
+        uint64_t joffset = 0;
+        char *jsha1 = NULL;
+        struct stat st = {};
+        if ((node = plist_dict_get_item(journal, "Size")) && plist_get_node_type(node) == PLIST_UINT) plist_get_uint_val(node, &jsize);
+        if ((node = plist_dict_get_item(journal, "CompleteOffset")) && plist_get_node_type(node) == PLIST_UINT) plist_get_uint_val(node, &joffset);
+        if ((node = plist_dict_get_item(journal, "SHA1")) && plist_get_node_type(node) == PLIST_STRING) plist_get_string_val(node, &jsha1);
+        if (jsize == size && jsha1 && !strcasecmp(jsha1, sha1.c_str())
+            && !stat(partPath.c_str(), &st) && (uint64_t)st.st_size >= joffset && joffset <= size) {
+            journaledOffset = joffset;
+        } else {
+            info("Ignoring stale download journal %s\n", journalPath.c_str());
+        }
+        safeFree(jsha1);
+    }
+
+    if (journaledOffset) {
+        //hash states aren't portable between crypto libraries (or versions of one), so hash the part we keep again
+        char buf[0x10000];
+        info("Resuming download of %s at %llu of %llu bytes, hashing what is already there\n", url.c_str(), (unsigned long long)journaledOffset, (unsigned long long)size);
+        retassure(f = fopen(partPath.c_str(), "r+b"), "failed to open %s\n", partPath.c_str());
+        while (hashedOffset < journaledOffset) {
+            size_t didRead = fread(buf, 1, (size_t)std::min<uint64_t>(sizeof(buf), journaledOffset - hashedOffset), f);
+            retassure(didRead, "failed to read %s\n", partPath.c_str());
+            hasher.update(buf, didRead);
+            hashedOffset += didRead;
+        }
+        retassure(!fseeko(f, (off_t)hashedOffset, SEEK_SET), "failed to seek in %s\n", partPath.c_str());
+    } else {
+        retassure(f = fopen(partPath.c_str(), "wb"), "failed to create %s\n", partPath.c_str());
+    }
+
+    //data is hashed in order as it arrives, so there is no second pass over the file once it is complete
+    if (size > hashedOffset) {
+        fetchInOrder(url, hashedOffset, size, connections, connections*2, NULL, [&](std::string &chunk){
+            retassure(fwrite(chunk.data(), 1, chunk.size(), f) == chunk.size(), "failed to write %s\n", partPath.c_str());
+            hasher.update(chunk.data(), chunk.size());
+            hashedOffset += chunk.size();
+            if (hashedOffset - journaledOffset >= DOWNLOAD_JOURNAL_INTERVAL) {
+                //the journal must never vouch for data that is still in a cache
+                retassure(syncFile(f), "failed to write %s\n", partPath.c_str());
+                saveJournal(journalPath, url, size, sha1, hashedOffset);
+                journaledOffset = hashedOffset;
+            }
+            int progress = (int)((hashedOffset*100)/size);
+            if (progress != lastProgress) print_progress_bar(lastProgress = progress);
+            return true;
+        });
+    }
+    int closeErr = fclose(f);
+    f = NULL;
+    retassure(!closeErr, "failed to write %s\n", partPath.c_str());
+
+    std::string mdHex = hasher.hexDigest();
+    if (sha1.size() && strcasecmp(mdHex.c_str(), sha1.c_str())) {
+        //the journal would only resume into the same mismatch
+        remove(journalPath.c_str());
+        remove(partPath.c_str());
+        reterror("SHA1 mismatch for %s (expected %s, got %s)\n", url.c_str(), sha1.c_str(), mdHex.c_str());
+    }
+    retassure(!rename(partPath.c_str(), dst.c_str()), "failed to move %s to %s\n", partPath.c_str(), dst.c_str());
+    remove(journalPath.c_str());
+}
@@ -0,0 +1,70 @@
+//
+//  remoteipsw.hpp
+//  futurerestore
+//
+//  Random access to iPSWs on http(s) servers using range requests.
+//
+
+#ifndef remoteipsw_hpp
+#define remoteipsw_hpp
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <atomic>
+#include <functional>
+
+#define REMOTEIPSW_DEFAULT_PREFETCH (64*1024*1024)
+#define REMOTEIPSW_DEFAULT_CONNECTIONS 4
+
+class httpRange {
+    void *_curl = NULL;
+    std::string _url;
+    const std::atomic<bool> *_cancel = NULL;
+public:
+    httpRange(const std::string &url);
+    httpRange(const httpRange &) = delete;
+    ~httpRange();
+    void setCancelFlag(const std::atomic<bool> *cancel){_cancel = cancel;};
+    uint64_t size();
+    //fetches bytes [start, end) and hands them to cb as they arrive, cb returns false to abort
+    void get(uint64_t start, uint64_t end, std::function<bool(const char *, size_t)> cb);
+};
+
+class remoteipsw {
+public:
+    struct entry {
+        std::string name;
+        uint16_t method;
+        uint32_t crc32;
+        uint64_t compressedSize;
+        uint64_t size;
+        uint64_t localHeaderOffset;
+    };
+private:
+    std::string _url;
+    uint64_t _size = 0;
+    std::map<std::string, entry> _entries;
+    std::atomic<bool> _cancel{false};
+
+    void readCentralDirectory();
+public:
+    remoteipsw(const std::string &url);
+    static bool isRemote(const char *path);
+
+    const std::string &url() const {return _url;};
+    const entry *getEntry(const std::string &name) const;
+    const std::map<std::string, entry> &entries() const {return _entries;};
+    //where the (possibly compressed) data of e starts in the zip, read from its local header
+    uint64_t dataOffset(const entry *e);
+    //hands the uncompressed contents of name to sink in order, fetching at most prefetchSize ahead of it, and checks size and crc32 at the end.
+    //sink returns false to stop early, extract then returns false without checking anything
+    bool extract(const std::string &name, std::function<bool(const char *, size_t)> sink, size_t prefetchSize = REMOTEIPSW_DEFAULT_PREFETCH, bool printProgress = false);
+    void extractToFile(const std::string &name, const std::string &dst, size_t prefetchSize = REMOTEIPSW_DEFAULT_PREFETCH, bool printProgress = false);
+    void cancel(){_cancel = true;};
+
+    //downloads the whole file over several connections, progress is journaled to <dst>.journal so an interrupted download resumes
+    static void download(const std::string &url, const std::string &dst, const std::string &sha1 = "", size_t connections = REMOTEIPSW_DEFAULT_CONNECTIONS);
+};
+
+#endif /* remoteipsw_hpp */
@@ -0,0 +1,395 @@
+//
+//  tssserver.cpp
+//  futurerestore
+//
+//  A stand-in for Apple's signing server on localhost. It records what the real one answers,
+//  replays it later, or makes up answers from a test ticket, so restores can run offline.
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <chrono>
+#include <curl/curl.h>
+#include <plist/plist.h>
+#include <img4tool/img4tool.hpp>
+#include "tssserver.hpp"
+#include "utils.hpp"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/time.h>
+#endif
+
+extern "C"{
+#include "common.h"
+}
+
+#define TSS_ACCEPT_SLICE_MS 200
+#define TSS_IDLE_TIMEOUT_MS 10000
+#define TSS_MAX_REQUEST_SIZE (16*1024*1024)
+#define TSS_SUCCESS_PREFIX "STATUS=0&MESSAGE=SUCCESS&REQUEST_STRING="
+#define TSS_NOT_SIGNED "STATUS=94&MESSAGE=This device isn't eligible for the requested build."
+
+using namespace tihmstar;
+
+#pragma mark tssServer
+tssServer::config tssServer::parseSpec(const char *spec){
+    config ret;
+    std::string rest = (spec) ? spec : "";
+    while (rest.size()) {
+        size_t comma = rest.find(',');
+        std::string opt = rest.substr(0, comma);
+        rest = (comma == std::string::npos) ? "" : rest.substr(comma+1);
+        if (opt.empty()) continue;
+        size_t eq = opt.find('=');
+        retassure(eq != std::string::npos, "tss server option '%s' needs a value\n", opt.c_str());
+        std::string key = opt.substr(0, eq);
+        std::string val = opt.substr(eq+1);
+
+        if (key == "mode") {
+            if (val == "replay") ret.mode = kTSSModeReplay;
+            else if (val == "record") ret.mode = kTSSModeRecord;
+            else reterror("unknown tss server mode '%s'\n", val.c_str());
+        } else if (key == "dir") {
+            ret.dir = val;
+        } else if (key == "ticket") {
+            ret.ticket = val;
+        } else if (key == "latency") {
+            ret.latencyMs = (uint32_t)atol(val.c_str());
+        } else if (key == "upstream") {
+            ret.upstream = val;
+        } else {
+            reterror("unknown tss server option '%s'\n", key.c_str());
+        }
+    }
+    retassure(ret.dir.size() || ret.mode == kTSSModeReplay, "recording needs a dir\n");
+    retassure(ret.dir.size() || ret.ticket.size(), "the tss server needs a dir to replay from or a ticket to answer with\n");
+    return ret;
+}
+
+//nonces change with every boot (the SEP one even without a generator), a key containing them would never be hit again
+static const char *requestKeyIgnored[] = {"@UUID", "ApNonce", "SepNonce", "BbNonce"};
+
+std::string tssServer::requestKey(const std::string &request){
+    plist_t req = NULL;
+    char *bin = NULL;
+    uint32_t binSize = 0;
+    cleanup([&]{
+        safeFree(bin);
+        safeFreeCustom(req, plist_free);
+    });
+    std::string input = request;
+    plist_from_xml(request.data(), (uint32_t)request.size(), &req);
+    if (req && plist_get_node_type(req) == PLIST_DICT) {
+        for (const char *ignored : requestKeyIgnored) plist_dict_remove_item(req, ignored);
+        plist_to_bin(req, &bin, &binSize);
+        if (bin) input.assign(bin, binSize);
+    }
+    return sha1Hex(input.data(), input.size());
+}
+
+tssServer::requestKind tssServer::classifyRequest(plist_t request){
+    plist_t node = NULL;
+    if ((node = plist_dict_get_item(request, "@BBTicket")) && plist_get_node_type(node) == PLIST_BOOLEAN) return kRequestBaseband;
+    if ((node = plist_dict_get_item(request, "@ApImg4Ticket")) && plist_get_node_type(node) == PLIST_BOOLEAN) return kRequestImg4;
+    if ((node = plist_dict_get_item(request, "@APTicket")) && plist_get_node_type(node) == PLIST_BOOLEAN) return kRequestAPTicket;
+    return kRequestUnknown;
+}
+
+//the SEP request comes from a different build than the AP one, only the request whose digests the ticket signs may get it
+bool tssServer::ticketCoversRequest(plist_t request){
+    plist_t identity = NULL;
+    plist_t manifest = NULL;
+    plist_dict_iter it = NULL;
+    cleanup([&]{
+        safeFree(it);
+        safeFreeCustom(identity, plist_free);
+    });
+    identity = plist_new_dict();
+    manifest = plist_new_dict();
+    plist_dict_set_item(identity, "Manifest", manifest);
+    for (const char *id : {"ApBoardID", "ApChipID"}) {
+        plist_t node = plist_dict_get_item(request, id);
+        uint64_t val = 0;
+        if (!node || plist_get_node_type(node) != PLIST_UINT) continue;
+        plist_get_uint_val(node, &val);
+        char buf[0x20];
+        snprintf(buf, sizeof(buf), "0x%02llX", (unsigned long long)val);
+        plist_dict_set_item(identity, id, plist_new_string(buf));
+    }
+
+    plist_dict_new_iter(request, &it);
+    while (true) {
+        char *key = NULL;
+        plist_t node = NULL;
+        plist_dict_next_item(request, it, &key, &node);
+        if (!key) break;
+        if (plist_get_node_type(node) == PLIST_DICT && plist_dict_get_item(node, "Digest"))
+            plist_dict_set_item(manifest, key, plist_copy(node));
+        free(key);
+    }
+    retassure(plist_dict_get_size(manifest), "request has no digests to match against the ticket\n");
+    try {
+        return img4tool::im4mMatchesBuildIdentity({_apImg4Ticket.data(), _apImg4Ticket.size()}, identity);
+    } catch (tihmstar::exception &e) {
+        debug("[tss] ticket check failed: %s\n", e.what());
+        return false;
+    }
+}
+
+tssServer::tssServer(const config &cfg) : _config(cfg){
+#ifdef WIN32
+    reterror("the tss server is not supported on Windows\n");
+#else
+    if (_config.ticket.size()) {
+        std::string ticket;
+        plist_t tss = NULL;
+        char *xml = NULL;
+        uint32_t xmlSize = 0;
+        cleanup([&]{
+            safeFree(xml);
+            safeFreeCustom(tss, plist_free);
+        });
+        retassure(readWholeFile(_config.ticket, ticket), "failed to read ticket %s\n", _config.ticket.c_str());
+        if (ticket.compare(0, 8, "bplist00") == 0)
+            plist_from_bin(ticket.data(), (uint32_t)ticket.size(), &tss);
+        else
+            plist_from_xml(ticket.data(), (uint32_t)ticket.size(), &tss);
+        retassure(tss && plist_get_node_type(tss) == PLIST_DICT, "%s is not a ticket\n", _config.ticket.c_str());
+        plist_to_xml(tss, &xml, &xmlSize);
+        _ticketResponse = std::string(TSS_SUCCESS_PREFIX) + std::string(xml, xmlSize);
+        safeFree(xml);
+
+        plist_t img4Ticket = plist_dict_get_item(tss, "ApImg4Ticket");
+        if (img4Ticket && plist_get_node_type(img4Ticket) == PLIST_DATA) {
+            char *data = NULL;
+            uint64_t dataSize = 0;
+            plist_get_data_val(img4Ticket, &data, &dataSize);
+            if (data) _apImg4Ticket.assign(data, (size_t)dataSize);
+            safeFree(data);
+            //a real answer to an image4 request only carries the ticket
+            plist_t response = plist_new_dict();
+            plist_dict_set_item(response, "ApImg4Ticket", plist_copy(img4Ticket));
+            plist_to_xml(response, &xml, &xmlSize);
+            plist_free(response);
+            _img4Response = std::string(TSS_SUCCESS_PREFIX) + std::string(xml, xmlSize);
+        }
+    }
+    if (_config.dir.size()) mkdir_with_parents(_config.dir.c_str(), 0755);
+
+    struct sockaddr_in addr = {};
+    socklen_t addrLen = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0; //let the kernel pick
+    retassure((_fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0, "failed to create tss server socket (%s)\n", strerror(errno));
+    if (bind(_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(_fd, 8) || getsockname(_fd, (struct sockaddr*)&addr, &addrLen)) {
+        int err = errno;
+        ::close(_fd);
+        _fd = -1;
+        reterror("failed to start tss server (%s)\n", strerror(err));
+    }
+    _port = ntohs(addr.sin_port);
+    _worker = std::thread(&tssServer::run, this);
+    info("[tss] %s on %s\n", (_config.mode == kTSSModeRecord) ? "recording" : "replaying", url().c_str());
+#endif
+}
+
+tssServer::~tssServer(){
+    _stop = true;
+    if (_worker.joinable()) _worker.join();
+#ifndef WIN32
+    if (_fd >= 0) ::close(_fd);
+#endif
+}
+
+std::string tssServer::url(){
+    return "http://127.0.0.1:" + std::to_string(_port) + "/TSS/controller?action=2";
+}
+
+//one connection at a time is plenty, a restore never has more than two requests in flight
+void tssServer::run(){
+#ifndef WIN32
+    while (!_stop) {
+        struct pollfd pfd = {_fd, POLLIN, 0};
+        if (poll(&pfd, 1, TSS_ACCEPT_SLICE_MS) <= 0) continue;
+        int fd = accept(_fd, NULL, NULL);
+        if (fd < 0) continue;
+        //replies are small, a client that stops reading them is gone
+        struct timeval sendTimeout = {TSS_IDLE_TIMEOUT_MS/1000, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+        try {
+            handleConnection(fd);
+        } catch (tihmstar::exception &e) {
+            error("[tss] %s\n", e.what());
+        }
+        ::close(fd);
+    }
+#endif
+}
+
+//waits in slices so a client which stops sending neither blocks shutdown nor the next connection for long
+ssize_t tssServer::receive(int fd, char *buf, size_t bufSize){
+#ifdef WIN32
+    return -1;
+#else
+    for (uint32_t waited = 0; !_stop && waited < TSS_IDLE_TIMEOUT_MS; waited += TSS_ACCEPT_SLICE_MS) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, TSS_ACCEPT_SLICE_MS);
+        if (ready < 0 && errno != EINTR) return -1;
+        if (ready > 0) return recv(fd, buf, bufSize, 0);
+    }
+    return -1;
+#endif
+}
+
+void tssServer::handleConnection(int fd){
+#ifndef WIN32
+    std::string data;
+    char buf[0x4000];
+    ssize_t didRead = 0;
+    size_t headerEnd = std::string::npos;
+    while ((headerEnd = data.find("\r\n\r\n")) == std::string::npos) {
+        retassure((didRead = receive(fd, buf, sizeof(buf))) > 0, "connection closed or stalled before the request header was complete\n");
+        data.append(buf, didRead);
+        retassure(data.size() < TSS_MAX_REQUEST_SIZE, "request header too large\n");
+    }
+    std::string header = data.substr(0, headerEnd);
+    std::string body = data.substr(headerEnd + 4);
+    for (auto &c : header) c = tolower(c);
+
+    size_t contentLength = 0;
+    size_t lenPos = header.find("content-length:");
+    if (lenPos != std::string::npos) contentLength = strtoul(header.c_str() + lenPos + strlen("content-length:"), NULL, 10);
+    retassure(contentLength < TSS_MAX_REQUEST_SIZE, "request too large\n");
+    //curl asks before sending larger bodies
+    if (header.find("expect: 100-continue") != std::string::npos && body.size() < contentLength)
+        send(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25, 0);
+    while (body.size() < contentLength) {
+        retassure((didRead = receive(fd, buf, sizeof(buf))) > 0, "connection closed or stalled before the request body was complete\n");
+        body.append(buf, didRead);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::string response = answer(body);
+    if (_config.latencyMs) std::this_thread::sleep_until(start + std::chrono::milliseconds(_config.latencyMs));
+
+    std::string reply = "HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\nContent-Length: " + std::to_string(response.size()) + "\r\nConnection: close\r\n\r\n" + response;
+    for (size_t sent = 0; sent < reply.size();) {
+        ssize_t didSend = send(fd, reply.data() + sent, reply.size() - sent, 0);
+        retassure(didSend > 0, "failed to send tss response (%s)\n", strerror(errno));
+        sent += didSend;
+    }
+#endif
+}
+
+std::string tssServer::answer(const std::string &request){
+    std::string key = requestKey(request);
+    std::string responsePath = _config.dir + "/" + key + ".response";
+
+    if (_config.mode == kTSSModeRecord) {
+        std::string response = forward(request);
+        //only signed answers are worth replaying, "not signed" might change the next time
+        if (response.compare(0, strlen("STATUS=0&"), "STATUS=0&") == 0) {
+            if (!writeFileAtomically(_config.dir + "/" + key + ".request.plist", request.data(), request.size())
+                || !writeFileAtomically(responsePath, response.data(), response.size())) {
+                error("[tss] failed to record %s\n", key.c_str());
+            } else {
+                debug("[tss] recorded %s\n", key.c_str());
+                _recorded++;
+            }
+        }
+        return response;
+    }
+
+    if (_config.dir.size()) {
+        std::string response;
+        if (readWholeFile(responsePath, response)) {
+            debug("[tss] replaying %s\n", key.c_str());
+            _replayed++;
+            return response;
+        }
+    }
+    if (_ticketResponse.size()) {
+        std::string response = synthesize(request);
+        if (response.size()) {
+            debug("[tss] answering %s with %s\n", key.c_str(), _config.ticket.c_str());
+            _synthesized++;
+            return response;
+        }
+    }
+    warning("[tss] no recording for request %s, answering as not signed\n", key.c_str());
+    _unanswered++;
+    return TSS_NOT_SIGNED;
+}
+
+//returns an empty string for requests the ticket can not answer
+std::string tssServer::synthesize(const std::string &request){
+    plist_t req = NULL;
+    cleanup([&]{
+        safeFreeCustom(req, plist_free);
+    });
+    plist_from_xml(request.data(), (uint32_t)request.size(), &req);
+    if (!req || plist_get_node_type(req) != PLIST_DICT) return "";
+
+    switch (classifyRequest(req)) {
+        case kRequestImg4:
+            if (_img4Response.empty()) {
+                warning("[tss] %s has no ApImg4Ticket, can not answer image4 requests\n", _config.ticket.c_str());
+                return "";
+            }
+            if (!ticketCoversRequest(req)) {
+                warning("[tss] %s does not sign this request (SEP from another build?)\n", _config.ticket.c_str());
+                return "";
+            }
+            return _img4Response;
+        case kRequestAPTicket:
+            return _ticketResponse;
+        case kRequestBaseband:
+            warning("[tss] baseband tickets can not be made up, record them first\n");
+            return "";
+        default:
+            warning("[tss] unknown request type\n");
+            return "";
+    }
+}
+
+static size_t forwardWriteCallback(char *ptr, size_t size, size_t nmemb, void *userdata){
+    ((std::string*)userdata)->append(ptr, size*nmemb);
+    return size*nmemb;
+}
+
+std::string tssServer::forward(const std::string &request){
+    CURL *curl = NULL;
+    struct curl_slist *headers = NULL;
+    cleanup([&]{
+        safeFreeCustom(headers, curl_slist_free_all);
+        safeFreeCustom(curl, curl_easy_cleanup);
+    });
+    std::string response;
+    CURLcode res = CURLE_OK;
+    retassure(curl = curl_easy_init(), "failed to init curl\n");
+    headers = curl_slist_append(headers, "Cache-Control: no-cache");
+    headers = curl_slist_append(headers, "Content-type: text/xml; charset=\"utf-8\"");
+    headers = curl_slist_append(headers, "Expect:");
+    curl_easy_setopt(curl, CURLOPT_URL, _config.upstream.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "InetURL/1.0");
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.data());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)request.size());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, forwardWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    retassure((res = curl_easy_perform(curl)) == CURLE_OK, "failed to reach %s: %s\n", _config.upstream.c_str(), curl_easy_strerror(res));
+    return response;
+}
+
+void tssServer::printSummary(){
+    info("[tss] %zu replayed, %zu recorded, %zu answered with the ticket, %zu unanswered\n", (size_t)_replayed, (size_t)_recorded, (size_t)_synthesized, (size_t)_unanswered);
+}
@@ -0,0 +1,77 @@
+//
+//  tssserver.hpp
+//  futurerestore
+//
+//  A stand-in for Apple's signing server on localhost. It records what the real one answers,
+//  replays it later, or makes up answers from a test ticket, so restores can run offline.
+//
+
+#ifndef tssserver_hpp
+#define tssserver_hpp
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <plist/plist.h>
+
+#define TSS_UPSTREAM_URL "http://gs.apple.com/TSS/controller?action=2"
+
+class tssServer {
+public:
+    enum tssMode {
+        kTSSModeReplay,     //answer from recordings, then from the ticket, otherwise "not signed"
+        kTSSModeRecord      //forward to the upstream server and record every answer
+    };
+    enum requestKind {
+        kRequestUnknown,
+        kRequestImg4,       //@ApImg4Ticket, AP or SEP
+        kRequestAPTicket,   //@APTicket, 32-bit devices
+        kRequestBaseband    //@BBTicket
+    };
+    struct config {
+        tssMode mode = kTSSModeReplay;
+        std::string dir;                //where recordings are kept, <key>.request.plist and <key>.response
+        std::string ticket;             //shsh2/APTicket handed out for AP requests nobody recorded
+        uint32_t latencyMs = 0;         //added to every answer
+        std::string upstream = TSS_UPSTREAM_URL;
+    };
+private:
+    config _config;
+    int _fd = -1;
+    uint16_t _port = 0;
+    std::thread _worker;
+    std::atomic<bool> _stop{false};
+    std::string _ticketResponse;
+    std::string _img4Response;
+    std::string _apImg4Ticket;
+    std::atomic<size_t> _replayed{0};
+    std::atomic<size_t> _recorded{0};
+    std::atomic<size_t> _synthesized{0};
+    std::atomic<size_t> _unanswered{0};
+
+    void run();
+    ssize_t receive(int fd, char *buf, size_t bufSize);
+    void handleConnection(int fd);
+    std::string answer(const std::string &request);
+    std::string synthesize(const std::string &request);
+    bool ticketCoversRequest(plist_t request);
+    std::string forward(const std::string &request);
+public:
+    tssServer(const config &cfg);
+    tssServer(const tssServer &) = delete;
+    ~tssServer();
+    //SPEC is a comma separated list of key=value, see cmd_help for the keys
+    static config parseSpec(const char *spec);
+    //requests which only differ in their UUID or nonces get the same key, so a replayed answer
+    //carries the nonces of the recording and only boots devices that come up with those again
+    static std::string requestKey(const std::string &request);
+    static requestKind classifyRequest(plist_t request);
+
+    std::string url();
+    bool isOffline(){return _config.mode == kTSSModeReplay;};
+    void printSummary();
+};
+
+#endif /* tssserver_hpp */
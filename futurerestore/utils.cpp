@@ -0,0 +1,122 @@
+//
+//  utils.cpp
+//  futurerestore
+//
+//  Small file and hashing helpers shared by the caches, the journals and the tss server.
+//
+
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "utils.hpp"
+
+#ifdef WIN32
+#   include <io.h>
+#   define fsync(fd) _commit(fd)
+#endif // WIN32
+
+#ifdef __APPLE__
+#   include <CommonCrypto/CommonDigest.h>
+#else
+#   include <openssl/evp.h>
+#endif // __APPLE__
+
+std::string hexString(const unsigned char *buf, size_t bufSize){
+    static const char digits[] = "0123456789abcdef";
+    std::string ret;
+    ret.reserve(bufSize*2);
+    for (size_t i=0; i<bufSize; i++) {
+        ret += digits[buf[i] >> 4];
+        ret += digits[buf[i] & 0xf];
+    }
+    return ret;
+}
+
+#pragma mark sha1Hasher
+
+//the low level SHA1_* functions are deprecated since OpenSSL 3, EVP is what is left
+sha1Hasher::sha1Hasher(){
+#ifdef __APPLE__
+    retassure(_ctx = calloc(1, sizeof(CC_SHA1_CTX)), "failed to allocate SHA1 context\n");
+    CC_SHA1_Init((CC_SHA1_CTX*)_ctx);
+#else
+    retassure(_ctx = EVP_MD_CTX_new(), "failed to allocate SHA1 context\n");
+    if (EVP_DigestInit_ex((EVP_MD_CTX*)_ctx, EVP_sha1(), NULL) != 1) {
+        EVP_MD_CTX_free((EVP_MD_CTX*)_ctx);
+        _ctx = NULL;
+        reterror("failed to init SHA1\n");
+    }
+#endif // __APPLE__
+}
+
+sha1Hasher::~sha1Hasher(){
+#ifdef __APPLE__
+    safeFree(_ctx);
+#else
+    if (_ctx) EVP_MD_CTX_free((EVP_MD_CTX*)_ctx);
+#endif // __APPLE__
+}
+
+void sha1Hasher::update(const void *buf, size_t bufSize){
+#ifdef __APPLE__
+    CC_SHA1_Update((CC_SHA1_CTX*)_ctx, buf, (CC_LONG)bufSize);
+#else
+    retassure(EVP_DigestUpdate((EVP_MD_CTX*)_ctx, buf, bufSize) == 1, "failed to update SHA1\n");
+#endif // __APPLE__
+}
+
+std::string sha1Hasher::hexDigest(){
+    unsigned char md[20];
+#ifdef __APPLE__
+    CC_SHA1_Final(md, (CC_SHA1_CTX*)_ctx);
+#else
+    unsigned int mdSize = sizeof(md);
+    retassure(EVP_DigestFinal_ex((EVP_MD_CTX*)_ctx, md, &mdSize) == 1, "failed to finalize SHA1\n");
+#endif // __APPLE__
+    return hexString(md, sizeof(md));
+}
+
+std::string sha1Hex(const void *buf, size_t bufSize){
+    sha1Hasher hasher;
+    hasher.update(buf, bufSize);
+    return hasher.hexDigest();
+}
+
+#pragma mark files
+
+bool syncFile(FILE *f){
+    return !fflush(f) && !fsync(fileno(f));
+}
+
+bool writeFileAtomically(const std::string &path, const char *buf, size_t bufSize){
+    FILE *f = NULL;
+    cleanup([&]{
+        safeFreeCustom(f, fclose);
+    });
+    std::string partPath = path + ".part" + std::to_string(getpid());
+    if (!(f = fopen(partPath.c_str(), "wb"))) return false;
+    bool didWrite = fwrite(buf, 1, bufSize, f) == bufSize && syncFile(f);
+    didWrite &= fclose(f) == 0;
+    f = NULL;
+    if (!didWrite || rename(partPath.c_str(), path.c_str())) {
+        remove(partPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool readWholeFile(const std::string &path, std::string &bytes){
+    FILE *f = NULL;
+    cleanup([&]{
+        safeFreeCustom(f, fclose);
+    });
+    std::string ret;
+    if (!(f = fopen(path.c_str(), "rb"))) return false;
+    char buf[0x4000];
+    size_t didRead = 0;
+    while ((didRead = fread(buf, 1, sizeof(buf), f)) > 0) ret.append(buf, didRead);
+    if (ferror(f) || ret.empty()) return false;
+    bytes.swap(ret);
+    return true;
+}
@@ -0,0 +1,40 @@
+//
+//  utils.hpp
+//  futurerestore
+//
+//  Small file and hashing helpers shared by the caches, the journals and the tss server.
+//
+
+#ifndef utils_hpp
+#define utils_hpp
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+
+//lowercase hex of buf
+std::string hexString(const unsigned char *buf, size_t bufSize);
+//lowercase hex SHA1 of buf, used to name everything that is cached by content
+std::string sha1Hex(const void *buf, size_t bufSize);
+
+//SHA1 over data that arrives in pieces
+class sha1Hasher {
+    void *_ctx = NULL;
+public:
+    sha1Hasher();
+    sha1Hasher(const sha1Hasher &) = delete;
+    ~sha1Hasher();
+    void update(const void *buf, size_t bufSize);
+    //lowercase hex of the digest, the hasher can't be updated afterwards
+    std::string hexDigest();
+};
+
+//flushes f and waits until its data reached the disk, returns false if either failed
+bool syncFile(FILE *f);
+//writes and syncs next to path first, so neither readers nor a crash ever see half a file.
+//Returns false if anything failed
+bool writeFileAtomically(const std::string &path, const char *buf, size_t bufSize);
+//returns false if path is missing, unreadable or empty
+bool readWholeFile(const std::string &path, std::string &bytes);
+
+#endif /* utils_hpp */
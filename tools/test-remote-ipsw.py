@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+#
+#  test-remote-ipsw.py
+#  futurerestore
+#
+#  Builds a small fake iPSW, serves it from a local http server supporting range requests and
+#  checks that futurerestore --check-remote-ipsw reads every disk image in it correctly.
+#  When futurerestore was built with FUSE, the stored image has to be read through a FUSE mount,
+#  which on Linux the server also sees in /proc/mounts while it answers requests.
+#
+#  usage: tools/test-remote-ipsw.py [path to futurerestore] [size of the stored image in MB]
+#
+
+import hashlib
+import http.server
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import threading
+import zipfile
+
+
+def isCheckMounted():
+    #remoteFileMount mounts with fsname=futurerestore, --check-remote-ipsw on <sessions>/<pid>-check
+    try:
+        with open('/proc/mounts') as f:
+            return any(l.split()[0] == 'futurerestore' and l.split()[1].endswith('-check') for l in f if l.strip())
+    except OSError:
+        return False
+
+
+class RangeHandler(http.server.SimpleHTTPRequestHandler):
+    ranged = 0
+    whileMounted = 0
+
+    def do_GET(self):
+        path = self.translate_path(self.path)
+        size = os.path.getsize(path)
+        m = re.match(r'bytes=(\d+)-(\d*)$', self.headers.get('Range', ''))
+        if not m:
+            #futurerestore must never pull the whole file in one go
+            self.send_error(400, 'range requests only')
+            return
+        start = int(m.group(1))
+        end = int(m.group(2)) if m.group(2) else size - 1
+        if start >= size or end < start:
+            self.send_error(416)
+            return
+        end = min(end, size - 1)
+        RangeHandler.ranged += 1
+        if isCheckMounted():
+            RangeHandler.whileMounted += 1
+        self.send_response(206)
+        self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, end, size))
+        self.send_header('Content-Length', str(end - start + 1))
+        self.end_headers()
+        with open(path, 'rb') as f:
+            f.seek(start)
+            left = end - start + 1
+            while left:
+                buf = f.read(min(left, 1 << 20))
+                self.wfile.write(buf)
+                left -= len(buf)
+
+    def log_message(self, fmt, *args):
+        pass
+
+
+def main():
+    futurerestore = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else 'futurerestore/futurerestore')
+    storedMB = int(sys.argv[2]) if len(sys.argv) > 2 else 160
+    work = tempfile.mkdtemp()
+    ipsw = os.path.join(work, 'test.ipsw')
+
+    #bigger than the read-ahead window, so it has to move along with the reader
+    images = {
+        'stored.dmg': (os.urandom(storedMB << 20), zipfile.ZIP_STORED),
+        'compressed.dmg': (b'futurerestore' * (1 << 19), zipfile.ZIP_DEFLATED),
+    }
+    with zipfile.ZipFile(ipsw, 'w', allowZip64=True) as z:
+        z.writestr('BuildManifest.plist', b'<plist version="1.0"><dict/></plist>', zipfile.ZIP_DEFLATED)
+        for name, (data, method) in images.items():
+            z.writestr(name, data, method)
+
+    os.chdir(work)
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), RangeHandler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    url = 'http://127.0.0.1:%d/test.ipsw' % server.server_address[1]
+
+    out = subprocess.run([futurerestore, '--check-remote-ipsw', url], stdout=subprocess.PIPE, stderr=subprocess.STDOUT).stdout.decode(errors='replace')
+    server.shutdown()
+    print(out)
+
+    failed = False
+    for name, (data, method) in images.items():
+        m = re.search(r'\[remote\] %s: (\d+) bytes, SHA1 ([0-9a-f]{40})' % re.escape(name), out)
+        expected = hashlib.sha1(data).hexdigest()
+        if not m:
+            print('FAIL %s: not reported' % name)
+            failed = True
+        elif int(m.group(1)) != len(data) or m.group(2) != expected:
+            print('FAIL %s: got %s bytes SHA1 %s, expected %d bytes SHA1 %s' % (name, m.group(1), m.group(2), len(data), expected))
+            failed = True
+        else:
+            print('OK   %s' % name)
+    print('%d range requests' % RangeHandler.ranged)
+
+    if 'FUSE for streaming remote filesystems: yes' not in out:
+        print('SKIP mount: futurerestore was built without FUSE')
+    elif not os.path.exists('/dev/fuse') and sys.platform.startswith('linux'):
+        print('SKIP mount: /dev/fuse is missing')
+    else:
+        m = re.search(r'\[remote\] stored\.dmg: .*\((.*)\)', out)
+        if not m or not m.group(1).startswith('streamed through FUSE'):
+            print('FAIL mount: stored.dmg was not read through FUSE')
+            failed = True
+        elif sys.platform.startswith('linux') and not RangeHandler.whileMounted:
+            print('FAIL mount: no request was served while the FUSE filesystem was mounted')
+            failed = True
+        else:
+            print('OK   mount (%d range requests while mounted)' % RangeHandler.whileMounted)
+    os.remove(ipsw)
+    os.rmdir(work)
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())